@@ -25,6 +25,7 @@
 #include <algorithm>
 #include <mutex>
 #include <vector>
+#include <unordered_set>
 #include <thread>
 #include <condition_variable>
 #include <iostream>
@@ -33,16 +34,38 @@
 using namespace std::chrono_literals;
 
 #include "mu-scanner.hh"
+#include "mu-watcher.hh"
 #include "utils/mu-async-queue.hh"
 #include "utils/mu-error.hh"
+#include "utils/mu-utils.hh"
 #include "../mu-store.hh"
+#include "../mu-maildir.hh"
 
 using namespace Mu;
 
+// maximum number of paths in the work queue; the memory budget below is
+// usually reached first.
+constexpr size_t MaxTodoItems = 256 * 1024;
+// maximum number of parsed messages waiting for the writer.
+constexpr size_t MaxWriteItems = 512;
+// default memory budget for the work queue.
+constexpr size_t DefaultQueueMemory = 32 * 1024 * 1024;
+
+// add workers when items wait longer than this in the queue...
+constexpr auto MaxQueueLatency = 20ms;
+// ... but not more often than this ...
+constexpr auto ScaleInterval = 250ms;
+// ... and only while the per-worker throughput holds up (relative to the
+// best we've seen); otherwise, we're probably bound by I/O.
+constexpr auto MinScaleEfficiency = 0.75;
+// workers that have had nothing to do for this many polls (of 250ms) go away.
+constexpr auto MaxIdlePolls = 8;
+
 struct IndexState {
 	enum State { Idle,
 		     Scanning,
-		     Cleaning };
+		     Cleaning,
+		     Watching };
 	static const char* name(State s)
 	{
 		switch (s) {
@@ -52,6 +75,8 @@ struct IndexState {
 			return "scanning";
 		case Cleaning:
 			return "cleaning";
+		case Watching:
+			return "watching";
 		default:
 			return "<error>";
 		}
@@ -78,11 +103,25 @@ private:
 };
 
 struct Indexer::Private {
+	struct WorkItem {
+		std::string full_path;
+		enum Type {
+			Dir,
+			File,
+			Remove,
+			Rename
+		};
+		Type              type;
+		size_t            bytes{};  /* (estimated) memory use */
+		Clock::time_point queued{}; /* when the item was queued */
+	};
+
 	Private(Mu::Store& store)
 	    : store_{store}, scanner_{store_.properties().root_maildir,
 	                              [this](auto&& path, auto&& statbuf, auto&& info) {
 					      return handler(path, statbuf, info);
 				      }},
+	      watcher_{[this](auto&& events) { handle_events(events); }},
 	      max_message_size_{store_.properties().max_message_size}
 	{
 		g_message("created indexer for %s -> %s (batch-size: %zu)",
@@ -98,11 +137,30 @@ struct Indexer::Private {
 	bool dir_predicate(const std::string& path, const struct dirent* dirent) const;
 	bool handler(const std::string& fullpath, struct stat* statbuf, Scanner::HandleType htype);
 
+	struct Worker;
+	bool push_todo(const std::string& path, WorkItem::Type type);
 	void maybe_start_worker();
-	void item_worker();
+	bool maybe_retire_worker(Worker& worker);
+	void item_worker(Worker& worker);
+	void write_worker();
 	void scan_worker();
 
-	bool cleanup();
+	void   load_scan_cache();
+	void   clear_scan_cache();
+	time_t dirstamp(const std::string& path) const;
+	bool   contains_message(const std::string& path) const;
+
+	void queue_message(const std::string& path);
+	bool maybe_renamed(const std::string& path);
+	bool rename_message(const std::string& path);
+	void remember_message(const std::string& path, Store::Id id);
+
+	void handle_events(const Watcher::Events& events);
+	void rescan_dir(const std::string& path);
+	void wait_pending();
+
+	void remember_seen(const std::string& path, bool is_dir);
+	bool cleanup(const std::vector<std::string>& dirs = {});
 
 	bool start(const Indexer::Config& conf);
 	bool stop();
@@ -110,29 +168,69 @@ struct Indexer::Private {
 	Indexer::Config conf_;
 	Store&          store_;
 	Scanner         scanner_;
+	Watcher         watcher_;
 	const size_t    max_message_size_;
 
-	time_t                   dirstamp_{};
-	std::size_t              max_workers_;
-	std::vector<std::thread> workers_;
-	std::thread              scanner_worker_;
+	/* item_worker (parallel) parses messages; write_worker (single
+	 * thread) adds them to the store */
+	struct WriteItem {
+		WorkItem::Type         type;
+		std::string            full_path;
+		Store::PreparedMessage pmsg; /* for File */
+	};
 
-	struct WorkItem {
-		std::string full_path;
-		enum Type {
-			Dir,
-			File
-		};
-		Type type;
+	struct Worker {
+		std::thread       thread;
+		std::atomic<bool> done{};
 	};
 
-	AsyncQueue<WorkItem> todos_;
+	std::size_t                          max_workers_;
+	std::vector<std::unique_ptr<Worker>> workers_;
+	std::thread                          scanner_worker_;
+	std::thread                          writer_;
+
+	AsyncQueue<WorkItem, MaxTodoItems>   todos_;
+	AsyncQueue<WriteItem, MaxWriteItems> writes_;
+	std::atomic<size_t> pending_{}; /* items queued but not yet written */
+
+	/* backpressure & worker scaling */
+	size_t                queue_budget_{};      /* max bytes in todos_ */
+	std::atomic<size_t>   queued_bytes_{};      /* bytes in todos_ */
+	std::atomic<uint64_t> queue_latency_us_{};  /* moving average */
+	Clock::time_point     scale_time_{};        /* last scaling decision */
+	size_t                scale_parsed_{};      /* # parsed at scale_time_ */
+	double                best_worker_rate_{};  /* best msgs/s/worker */
+
+	/* for recognizing renamed messages: (hash of the base-name, docid) for
+	 * the messages in the store, sorted; built on demand */
+	using RenameIndex = std::vector<std::pair<size_t, Store::Id>>;
+	RenameIndex rename_index_;
+	bool        rename_index_built_{};
+	std::mutex  rename_lock_;
+
+	/* for the scan phase: the dirstamps and path-hashes from the store, so
+	 * we only need to touch the database for things that changed. Only
+	 * valid while scanning. */
+	Store::DirStamps      dirstamps_;
+	std::vector<uint64_t> path_hashes_;
+	bool                  have_scan_cache_{};
+
+	/* for cleanup: the (hashes of) the message paths seen during the scan,
+	 * and the dirs that were scanned completely */
+	std::vector<size_t>             seen_;
+	std::unordered_set<std::string> scanned_dirs_;
+	std::mutex                      seen_lock_;
 
 	Progress   progress_;
 	IndexState state_;
 	std::mutex lock_, w_lock_;
 };
 
+// the dirstamp for the directory being scanned. The scanner may scan multiple
+// directories in parallel, but the entries of a single directory are always
+// handled by the thread that entered it.
+static thread_local time_t cur_dirstamp;
+
 bool
 Indexer::Private::handler(const std::string& fullpath, struct stat* statbuf,
                           Scanner::HandleType htype)
@@ -144,42 +242,35 @@ Indexer::Private::handler(const std::string& fullpath, struct stat* statbuf,
 		// is up-to-date (this is _not_ always true; hence we call it
 		// lazy-mode); only for actual message dirs, since the dir
 		// tstamps may not bubble up.
-		dirstamp_ = store_.dirstamp(fullpath);
-		if (conf_.lazy_check && dirstamp_ >= statbuf->st_mtime &&
+		cur_dirstamp = dirstamp(fullpath);
+		if (conf_.lazy_check && cur_dirstamp >= statbuf->st_mtime &&
 		    htype == Scanner::HandleType::EnterNewCur) {
 			g_debug("skip %s (seems up-to-date: %s >= %s)", fullpath.c_str(),
-			        time_to_string("%FT%T", dirstamp_).c_str(),
+			        time_to_string("%FT%T", cur_dirstamp).c_str(),
 			        time_to_string("%FT%T", statbuf->st_mtime).c_str());
+			if (conf_.watch) // we still want to see future changes
+				watcher_.add_dir(fullpath);
 			return false;
 		}
 
-		// don't index dirs with '.noindex'
-		auto noindex = ::access((fullpath + "/.noindex").c_str(), F_OK) == 0;
-		if (noindex) {
-			g_debug("skip %s (has .noindex)", fullpath.c_str());
-			return false; // don't descend into this dir.
-		}
-
-		// don't index dirs with '.noupdate', unless we do a full
-		// (re)index.
-		if (!conf_.ignore_noupdate) {
-			auto noupdate = ::access((fullpath + "/.noupdate").c_str(), F_OK) == 0;
-			if (noupdate) {
-				g_debug("skip %s (has .noupdate)", fullpath.c_str());
-				return false;
-			}
-		}
+		// note: dirs with '.noindex' (and '.noupdate', unless we do a
+		// full (re)index) are skipped by the scanner.
 
 		g_debug("checked %s", fullpath.c_str());
 		return true;
 	}
 	case Scanner::HandleType::LeaveDir: {
-		todos_.push({fullpath, WorkItem::Type::Dir});
+		// only dirs that were not skipped get here.
+		remember_seen(fullpath, true);
+		if (conf_.watch)
+			watcher_.add_dir(fullpath);
+		push_todo(fullpath, WorkItem::Type::Dir);
 		return true;
 	}
 
 	case Scanner::HandleType::File: {
 		++progress_.checked;
+		remember_seen(fullpath, false);
 
 		if ((size_t)statbuf->st_size > max_message_size_) {
 			g_debug("skip %s (too big: %" G_GINT64_FORMAT " bytes)", fullpath.c_str(),
@@ -189,14 +280,14 @@ Indexer::Private::handler(const std::string& fullpath, struct stat* statbuf,
 
 		// if the message is not in the db yet, or not up-to-date, queue
 		// it for updating/inserting.
-		if (statbuf->st_mtime <= dirstamp_ && store_.contains_message(fullpath)) {
+		if (statbuf->st_mtime <= cur_dirstamp && contains_message(fullpath)) {
 			// g_debug ("skip %s: already up-to-date");
 			return false;
 		}
 
 		// push the remaining messages to our "todo" queue for
 		// (re)parsing and adding/updating to the database.
-		todos_.push({fullpath, WorkItem::Type::File});
+		queue_message(fullpath);
 		return true;
 	}
 	default:
@@ -205,69 +296,396 @@ Indexer::Private::handler(const std::string& fullpath, struct stat* statbuf,
 	}
 }
 
+void
+Indexer::Private::load_scan_cache()
+{
+	const auto start{Clock::now()};
+
+	dirstamps_       = store_.dirstamps();
+	path_hashes_     = store_.path_hashes();
+	have_scan_cache_ = true;
+
+	g_debug("loaded %zu dirstamp(s) and %zu path-hash(es) in %" G_GINT64_FORMAT " ms",
+		dirstamps_.size(), path_hashes_.size(),
+		static_cast<gint64>(to_ms(Clock::now() - start)));
+}
+
+void
+Indexer::Private::clear_scan_cache()
+{
+	have_scan_cache_ = false;
+	dirstamps_       = {};
+	path_hashes_     = {};
+}
+
+time_t
+Indexer::Private::dirstamp(const std::string& path) const
+{
+	if (!have_scan_cache_ || state_ != IndexState::Scanning)
+		return store_.dirstamp(path);
+
+	const auto it = dirstamps_.find(path);
+	return it == dirstamps_.end() ? 0 : it->second;
+}
+
+bool
+Indexer::Private::contains_message(const std::string& path) const
+{
+	if (!have_scan_cache_ || state_ != IndexState::Scanning)
+		return store_.contains_message(path);
+
+	// the path-hash _is_ the message's unique id in the store, so this is
+	// exact.
+	return std::binary_search(path_hashes_.begin(), path_hashes_.end(),
+				  Store::path_hash(path));
+}
+
+void
+Indexer::Private::queue_message(const std::string& path)
+{
+	// a message that is not in the store may be a renamed version of one
+	// that is; if so, we can avoid re-parsing it.
+	const auto rename{!contains_message(path) && maybe_renamed(path)};
+
+	push_todo(path, rename ? WorkItem::Type::Rename : WorkItem::Type::File);
+}
+
+bool
+Indexer::Private::maybe_renamed(const std::string& path)
+{
+	std::lock_guard lock{rename_lock_};
+
+	if (!rename_index_built_) {
+		store_.for_each_message_path([&](Store::Id id, const std::string& mpath) {
+			rename_index_.emplace_back(
+			    std::hash<std::string>{}(mu_maildir_base_name(mpath)), id);
+			return true;
+		});
+		std::sort(rename_index_.begin(), rename_index_.end());
+		rename_index_built_ = true;
+		g_debug("rename-index with %zu message(s)", rename_index_.size());
+	}
+
+	const auto hash{std::hash<std::string>{}(mu_maildir_base_name(path))};
+	const auto it = std::lower_bound(rename_index_.begin(), rename_index_.end(),
+					 std::make_pair(hash, Store::Id{}));
+
+	return it != rename_index_.end() && it->first == hash;
+}
+
+bool
+Indexer::Private::rename_message(const std::string& path)
+{
+	const auto hash{std::hash<std::string>{}(mu_maildir_base_name(path))};
+
+	std::vector<Store::Id> ids;
+	{
+		std::lock_guard lock{rename_lock_};
+		auto            it = std::lower_bound(rename_index_.begin(), rename_index_.end(),
+						      std::make_pair(hash, Store::Id{}));
+		for (; it != rename_index_.end() && it->first == hash; ++it)
+			ids.emplace_back(it->second);
+	}
+
+	return std::any_of(ids.begin(), ids.end(),
+			   [&](auto&& id) {
+				   return store_.rename_message(id, path,
+								true /*use-transaction*/);
+			   });
+}
+
+void
+Indexer::Private::remember_message(const std::string& path, Store::Id id)
+{
+	std::lock_guard lock{rename_lock_};
+	if (!rename_index_built_)
+		return;
+
+	const auto item{std::make_pair(std::hash<std::string>{}(mu_maildir_base_name(path)), id)};
+	rename_index_.insert(
+	    std::lower_bound(rename_index_.begin(), rename_index_.end(), item), item);
+}
+
+bool
+Indexer::Private::push_todo(const std::string& path, WorkItem::Type type)
+{
+	WorkItem item{path, type};
+	item.bytes = sizeof(item) + item.full_path.capacity();
+
+	// backpressure: when there's too much work queued up, wait for the
+	// workers to catch up. There's always room for at least one item.
+	while (queued_bytes_ > 0 && queued_bytes_ + item.bytes > queue_budget_) {
+		if (state_ == IndexState::Idle)
+			return false;
+		maybe_start_worker();
+		std::this_thread::sleep_for(1ms);
+	}
+
+	++pending_;
+	queued_bytes_ += item.bytes;
+	item.queued = Clock::now();
+
+	// the queue has a maximum size as well.
+	while (!todos_.push(std::move(item), 100ms)) {
+		if (state_ == IndexState::Idle) {
+			--pending_;
+			queued_bytes_ -= item.bytes;
+			return false;
+		}
+	}
+
+	return true;
+}
+
 void
 Indexer::Private::maybe_start_worker()
 {
 	std::lock_guard lock{w_lock_};
+	if (state_ == IndexState::Idle)
+		return; // stopping; see stop().
+
+	// clean up workers that went away.
+	workers_.erase(std::remove_if(workers_.begin(), workers_.end(),
+				      [](auto&& worker) {
+					      if (!worker->done)
+						      return false;
+					      worker->thread.join();
+					      return true;
+				      }),
+		       workers_.end());
+
+	if (workers_.size() >= max_workers_ || todos_.empty())
+		return;
+
+	// only add workers if items are waiting for too long, and if the
+	// writer is keeping up.
+	if (queue_latency_us_ < static_cast<uint64_t>(to_us(MaxQueueLatency)) ||
+	    writes_.full())
+		return;
+
+	const auto now{Clock::now()};
+	const auto elapsed{to_ms(now - scale_time_)};
+	if (elapsed < to_ms(ScaleInterval))
+		return;
+
+	// when adding workers no longer helps (e.g. because we're waiting for
+	// the disk), the throughput per worker goes down; then don't add more.
+	const auto parsed{progress_.parsed.load()};
+	const auto rate{(parsed - scale_parsed_) * 1000.0 / elapsed /
+			std::max<size_t>(workers_.size(), 1)};
+	scale_time_       = now;
+	scale_parsed_     = parsed;
+	best_worker_rate_ = std::max(best_worker_rate_, rate);
+	if (rate < best_worker_rate_ * MinScaleEfficiency)
+		return;
+
+	auto worker{std::make_unique<Worker>()};
+	worker->thread = std::thread([this, w = worker.get()] { item_worker(*w); });
+	workers_.emplace_back(std::move(worker));
+	g_debug("added worker %zu (latency: %" G_GUINT64_FORMAT " us; %.1f msg/s/worker)",
+		workers_.size(), queue_latency_us_.load(), rate);
+}
 
-	if (todos_.size() > workers_.size() && workers_.size() < max_workers_) {
-		workers_.emplace_back(std::thread([this] { item_worker(); }));
-		g_debug("added worker %zu", workers_.size());
-	}
+bool
+Indexer::Private::maybe_retire_worker(Worker& worker)
+{
+	std::lock_guard lock{w_lock_};
+
+	// always keep at least one worker.
+	const auto active{std::count_if(workers_.begin(), workers_.end(),
+					[](auto&& w) { return !w->done; })};
+	if (active <= 1)
+		return false;
+
+	worker.done = true;
+	g_debug("retired idle worker (%zu left)", static_cast<size_t>(active - 1));
+
+	return true;
 }
 
 void
-Indexer::Private::item_worker()
+Indexer::Private::item_worker(Worker& worker)
 {
 	WorkItem item;
+	size_t   idle{};
 
 	g_debug("started worker");
 
-	while (state_ == IndexState::Scanning) {
-		if (!todos_.pop(item, 250ms))
+	while (state_ != IndexState::Idle) {
+		if (!todos_.pop(item, 250ms)) {
+			if (++idle >= MaxIdlePolls && maybe_retire_worker(worker))
+				return;
 			continue;
+		}
+		idle = 0;
+		queued_bytes_ -= item.bytes;
+		const auto latency{static_cast<uint64_t>(to_us(Clock::now() - item.queued))};
+		queue_latency_us_ = (queue_latency_us_ * 7 + latency) / 8;
+
+		WriteItem witem{item.type, std::move(item.full_path), {}};
 		try {
-			std::lock_guard lock{w_lock_};
+			if (item.type == WorkItem::Type::File) {
+				const auto start{Clock::now()};
+				witem.pmsg = store_.prepare_message(witem.full_path);
+				progress_.parse_us += to_us(Clock::now() - start);
+				progress_.bytes_read += witem.pmsg.bytes_read;
+				++progress_.parsed;
+			}
+			// the write-queue is bounded as well, so when the
+			// writer falls behind, the workers wait for it.
+			while (!writes_.push(std::move(witem), 250ms) &&
+			       state_ != IndexState::Idle)
+				;
+		} catch (const Mu::Error& er) {
+			g_warning("error parsing message @ %s: %s",
+			          witem.full_path.c_str(), er.what());
+			--pending_;
+		}
+
+		maybe_start_worker();
+		std::this_thread::yield();
+	}
+
+	worker.done = true;
+}
+
+void
+Indexer::Private::write_worker()
+{
+	WriteItem item;
+
+	g_debug("started writer");
+
+	while (state_ != IndexState::Idle) {
+		if (!writes_.pop(item, 250ms))
+			continue;
+		try {
+			const auto start{Clock::now()};
 			switch (item.type) {
-			case WorkItem::Type::File:
-				store_.add_message(item.full_path,
-				                   true /*use-transaction*/);
+			case WorkItem::Type::File: {
+				const auto id{store_.add_message(std::move(item.pmsg),
+								 true /*use-transaction*/)};
 				++progress_.updated;
+				// when watching, new messages are often renamed
+				// soon after (e.g. new/ -> cur/)
+				if (state_ == IndexState::Watching)
+					remember_message(item.full_path, id);
 				break;
+			}
 			case WorkItem::Type::Dir:
 				store_.set_dirstamp(item.full_path, ::time(NULL));
 				break;
+			case WorkItem::Type::Remove:
+				if (store_.remove_message(item.full_path,
+							  true /*use-transaction*/))
+					++progress_.removed;
+				break;
+			case WorkItem::Type::Rename:
+				if (rename_message(item.full_path))
+					++progress_.updated;
+				else { // not a rename after all; parse it. Do so
+				       // here; the workers may be waiting for us.
+					store_.add_message(
+					    store_.prepare_message(item.full_path),
+					    true /*use-transaction*/);
+					++progress_.updated;
+				}
+				break;
 			default:
 				g_warn_if_reached();
 				break;
 			}
+			progress_.write_us += to_us(Clock::now() - start);
 		} catch (const Mu::Error& er) {
 			g_warning("error adding message @ %s: %s",
 			          item.full_path.c_str(), er.what());
 		}
-
-		maybe_start_worker();
-		std::this_thread::yield();
+		--pending_;
 	}
 }
 
+void
+Indexer::Private::remember_seen(const std::string& path, bool is_dir)
+{
+	// only the initial scan counts; later (watch-mode) rescans only cover
+	// part of the maildir.
+	if (state_ != IndexState::Scanning || !conf_.cleanup)
+		return;
+
+	std::lock_guard lock{seen_lock_};
+	if (is_dir)
+		scanned_dirs_.emplace(path);
+	else
+		seen_.emplace_back(std::hash<std::string>{}(path));
+}
+
 bool
-Indexer::Private::cleanup()
+Indexer::Private::cleanup(const std::vector<std::string>& dirs)
 {
 	g_debug("starting cleanup");
 
+	// with dirs, only look at the messages under those (after watch-events);
+	// otherwise, all of them.
+	const auto in_scope = [&](const std::string& path) {
+		return dirs.empty() ||
+		       std::any_of(dirs.begin(), dirs.end(), [&](auto&& dir) {
+			       return path.size() > dir.size() &&
+				      path.compare(0, dir.size(), dir) == 0 &&
+				      path[dir.size()] == '/';
+		       });
+	};
+
+	// for messages in directories that were scanned completely, we know
+	// whether they still exist; others (e.g. in lazily skipped dirs) need
+	// checking.
+	std::lock_guard lock{seen_lock_};
+	std::sort(seen_.begin(), seen_.end());
+
 	size_t                 n{};
 	std::vector<Store::Id> orphans; // store messages without files.
+	std::vector<std::pair<Store::Id, std::string>> unknown;
 	store_.for_each_message_path([&](Store::Id id, const std::string& path) {
+		if (!in_scope(path))
+			return state_ != IndexState::Idle;
 		++n;
-		if (::access(path.c_str(), R_OK) != 0) {
-			g_debug("cannot read %s (id=%u); queueing for removal from store",
-			        path.c_str(), id);
-			orphans.emplace_back(id);
-		}
+		const auto slash{path.rfind('/')};
+		if (slash != std::string::npos &&
+		    scanned_dirs_.find(path.substr(0, slash)) != scanned_dirs_.end()) {
+			if (!std::binary_search(seen_.begin(), seen_.end(),
+						std::hash<std::string>{}(path))) {
+				g_debug("%s (id=%u) is gone; queueing for removal from store",
+					path.c_str(), id);
+				orphans.emplace_back(id);
+			}
+		} else
+			unknown.emplace_back(id, path);
 
-		return state_ == IndexState::Cleaning;
+		return state_ != IndexState::Idle;
 	});
+	g_debug("checked %zu message(s); %zu in unscanned dirs", n, unknown.size());
+
+	// check the remaining ones in parallel; this is I/O-bound.
+	if (!unknown.empty()) {
+		std::mutex               olock;
+		std::vector<std::thread> checkers;
+		const auto               n_checkers{std::min(max_workers_, unknown.size())};
+		for (auto i = 0U; i != n_checkers; ++i)
+			checkers.emplace_back([&, i] {
+				for (auto j = i; j < unknown.size(); j += n_checkers) {
+					if (state_ == IndexState::Idle)
+						break;
+					const auto& [id, path] = unknown[j];
+					if (::access(path.c_str(), R_OK) == 0)
+						continue;
+					g_debug("cannot read %s (id=%u); queueing for removal "
+						"from store", path.c_str(), id);
+					std::lock_guard olock_guard{olock};
+					orphans.emplace_back(id);
+				}
+			});
+		for (auto&& checker : checkers)
+			checker.join();
+	}
 
 	if (orphans.empty())
 		g_debug("nothing to clean up");
@@ -280,36 +698,171 @@ Indexer::Private::cleanup()
 	return true;
 }
 
+void
+Indexer::Private::wait_pending()
+{
+	const auto state{state_ == IndexState::Watching ? IndexState::Watching
+							: IndexState::Scanning};
+	while (pending_ > 0 && state_ == state)
+		std::this_thread::sleep_for(10ms);
+}
+
+void
+Indexer::Private::rescan_dir(const std::string& path)
+{
+	g_debug("rescanning %s", path.c_str());
+
+	// the scanner does not call the handler for its top-level dir, so
+	// do so here.
+	if (conf_.watch)
+		watcher_.add_dir(path);
+	cur_dirstamp = store_.dirstamp(path);
+
+	Scanner scanner{path, [this](auto&& fpath, auto&& statbuf, auto&& htype) {
+				return handler(fpath, statbuf, htype);
+			}};
+	if (!scanner.start(conf_.ignore_noupdate ? Scanner::Mode::IgnoreNoUpdate
+						 : Scanner::Mode::Default))
+		return;
+
+	push_todo(path, WorkItem::Type::Dir);
+}
+
+void
+Indexer::Private::handle_events(const Watcher::Events& events)
+{
+	using Type = Watcher::Event::Type;
+
+	std::vector<std::string>        cleanup_dirs; // dirs with messages that may be gone
+	std::unordered_set<std::string> dirs; // dirs with changes, for their dirstamps
+	auto&                           readability{store_.readability()};
+	const auto                      tracking{readability.is_tracking()};
+
+	for (auto&& event : events) {
+		if (state_ != IndexState::Watching)
+			return;
+
+		switch (event.type) {
+		case Type::Changed:
+		case Type::Removed: {
+			// only consider files in cur/ and new/
+			const auto slash{event.path.rfind('/')};
+			if (slash == std::string::npos || slash < 4 ||
+			    event.path[slash + 1] == '.')
+				break;
+			const auto dir{event.path.substr(0, slash)};
+			if (!g_str_has_suffix(dir.c_str(), "/cur") &&
+			    !g_str_has_suffix(dir.c_str(), "/new"))
+				break;
+			dirs.emplace(dir);
+
+			// events may have been coalesced; so check what's
+			// actually there.
+			struct stat statbuf {
+			};
+			if (::stat(event.path.c_str(), &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+				++progress_.checked;
+				readability.mark_present(event.path);
+				if ((size_t)statbuf.st_size > max_message_size_) {
+					g_debug("skip %s (too big)", event.path.c_str());
+					break;
+				}
+				queue_message(event.path);
+			} else {
+				// queries can skip it, even before it's removed.
+				readability.mark_gone(event.path);
+				push_todo(event.path, WorkItem::Type::Remove);
+			}
+			break;
+		}
+		case Type::DirAdded:
+			rescan_dir(event.path);
+			break;
+		case Type::DirRemoved:
+			// the messages below it went away (unless it came back
+			// already); the cleanup checks which.
+			readability.stop_tracking();
+			cleanup_dirs.emplace_back(event.path);
+			break;
+		case Type::Overflow: {
+			// we lost events; so lazily rescan the directories we
+			// were watching, and clean up those afterwards.
+			readability.stop_tracking();
+			for (auto&& dir : watcher_.dirs()) {
+				struct stat statbuf {
+				};
+				if (::stat(dir.c_str(), &statbuf) != 0)
+					cleanup_dirs.emplace_back(dir); // gone
+				else if (statbuf.st_mtime >= store_.dirstamp(dir)) {
+					rescan_dir(dir);
+					cleanup_dirs.emplace_back(dir);
+				}
+			}
+			break;
+		}
+		default:
+			g_warn_if_reached();
+			break;
+		}
+	}
+
+	for (auto&& dir : dirs)
+		push_todo(dir, WorkItem::Type::Dir);
+
+	// commit right away, so the changes become visible.
+	wait_pending();
+	if (!cleanup_dirs.empty())
+		cleanup(cleanup_dirs);
+	store_.commit();
+
+	if (tracking && state_ == IndexState::Watching)
+		readability.start_tracking();
+}
+
 void
 Indexer::Private::scan_worker()
 {
 	progress_.reset();
 
+	if (conf_.watch)
+		watcher_.add_dir(store_.properties().root_maildir);
+
 	if (conf_.scan) {
+		load_scan_cache();
 		g_debug("starting scanner");
-		if (!scanner_.start()) { // blocks.
+		auto mode{conf_.ignore_noupdate ? Scanner::Mode::IgnoreNoUpdate
+						 : Scanner::Mode::Default};
+		if (conf_.parallel_scan)
+			mode |= Scanner::Mode::Parallel;
+		if (!scanner_.start(mode)) { // blocks.
 			g_warning("failed to start scanner");
 			goto leave;
 		}
 		g_debug("scanner finished with %zu file(s) in queue", todos_.size());
 	}
 
-	// now there may still be messages in the work queue...
+	// now there may still be messages in the work queues...
 	// finish those; this is a bit ugly; perhaps we should
 	// handle SIGTERM etc.
 
-	if (!todos_.empty()) {
+	if (pending_ > 0) {
 		const auto workers_size = std::invoke([this] {
 			std::lock_guard lock{w_lock_};
 			return workers_.size();
 		});
 		g_debug("process %zu remaining message(s) with %zu worker(s)",
-		        todos_.size(), workers_size);
-		while (!todos_.empty())
-			std::this_thread::sleep_for(100ms);
+		        pending_.load(), workers_size);
+		wait_pending();
 	}
 
+	clear_scan_cache();
 	store_.commit();
+	g_debug("parsed %zu message(s) (%.1f/s); wrote %zu (%.1f/s)",
+	        progress_.parsed.load(), progress_.parse_rate(),
+	        progress_.updated.load(), progress_.write_rate());
+
+	if (state_ != IndexState::Scanning)
+		goto leave; // stopped.
 
 	if (conf_.cleanup) {
 		g_debug("starting cleanup");
@@ -317,7 +870,25 @@ Indexer::Private::scan_worker()
 		cleanup();
 		g_debug("cleanup finished");
 	}
+
+	{ // the scan results are of no further use.
+		std::lock_guard lock{seen_lock_};
+		seen_ = {};
+		scanned_dirs_ = {};
+	}
+
+	if (conf_.watch && state_ != IndexState::Idle) {
+		// after a complete scan and cleanup, the store reflects the
+		// maildir; the watcher keeps it that way.
+		if (conf_.scan && conf_.cleanup)
+			store_.readability().start_tracking();
+		state_.change_to(IndexState::Watching);
+		if (!watcher_.start()) // blocks
+			g_warning("failed to start watcher");
+	}
 leave:
+	store_.readability().stop_tracking();
+	clear_scan_cache();
 	state_.change_to(IndexState::Idle);
 }
 
@@ -339,9 +910,29 @@ Indexer::Private::start(const Indexer::Config& conf)
 	g_debug("indexing: %s; clean-up: %s", conf_.scan ? "yes" : "no",
 	        conf_.cleanup ? "yes" : "no");
 
+	pending_          = 0;
+	queue_budget_     = conf_.max_queue_memory ? conf_.max_queue_memory
+						   : DefaultQueueMemory;
+	queued_bytes_     = 0;
+	queue_latency_us_ = 0;
+	scale_time_       = Clock::now();
+	scale_parsed_     = 0;
+	best_worker_rate_ = 0;
+	watcher_.clear();
+	store_.readability().clear();
+	rename_index_.clear();
+	rename_index_built_ = false;
+	seen_.clear();
+	scanned_dirs_.clear();
 	state_.change_to(IndexState::Scanning);
-	/* kick off the first worker, which will spawn more if needed. */
-	workers_.emplace_back(std::thread([this] { item_worker(); }));
+	/* kick off the single writer, and the first parse worker, which will
+	 * spawn more if needed. */
+	writer_ = std::thread([this] { write_worker(); });
+	{
+		auto worker{std::make_unique<Worker>()};
+		worker->thread = std::thread([this, w = worker.get()] { item_worker(*w); });
+		workers_.emplace_back(std::move(worker));
+	}
 	/* kick the disk-scanner thread */
 	scanner_worker_ = std::thread([this] { scan_worker(); });
 
@@ -354,16 +945,27 @@ bool
 Indexer::Private::stop()
 {
 	scanner_.stop();
+	watcher_.stop();
 
 	todos_.clear();
+	writes_.clear();
+	state_.change_to(IndexState::Idle);
 	if (scanner_worker_.joinable())
 		scanner_worker_.join();
 
-	state_.change_to(IndexState::Idle);
-	for (auto&& w : workers_)
-		if (w.joinable())
-			w.join();
-	workers_.clear();
+	// the workers may still be adding / removing workers (see
+	// maybe_start_worker); so take them out under the lock. Since we're
+	// Idle now, no new ones get added.
+	decltype(workers_) workers;
+	{
+		std::lock_guard lock{w_lock_};
+		workers.swap(workers_);
+	}
+	for (auto&& w : workers)
+		if (w->thread.joinable())
+			w->thread.join();
+	if (writer_.joinable())
+		writer_.join();
 
 	return true;
 }
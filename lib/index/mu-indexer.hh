@@ -23,6 +23,7 @@
 #include <atomic>
 #include <memory>
 #include <chrono>
+#include <cstdint>
 
 namespace Mu {
 
@@ -56,6 +57,15 @@ public:
 		bool lazy_check{};
 		/**< whether to skip directories that don't have a changed
 		 * mtime */
+		bool parallel_scan{};
+		/**< scan the maildir tree with multiple threads */
+		bool watch{};
+		/**< after scanning, keep watching the maildirs for changes,
+		 * until stop() is called */
+		size_t max_queue_memory{};
+		/**< memory budget (in bytes) for work waiting to be processed;
+		 * when exceeded, scanning waits for the workers to catch up. 0
+		 * for the default */
 	};
 
 	/**
@@ -93,12 +103,51 @@ public:
 		{
 			running = false;
 			checked = updated = removed = 0;
+			parsed = parse_us = write_us = bytes_read = 0;
+		}
+
+		/**
+		 * Throughput of the parse stage, in messages per second of
+		 * (summed) parser time.
+		 *
+		 * @return messages/second, or 0 if nothing was parsed yet.
+		 */
+		double parse_rate() const
+		{
+			return parse_us ? parsed * 1000000.0 / parse_us : 0;
+		}
+
+		/**
+		 * Throughput of the write stage, in messages per second of
+		 * writer time.
+		 *
+		 * @return messages/second, or 0 if nothing was written yet.
+		 */
+		double write_rate() const
+		{
+			return write_us ? updated * 1000000.0 / write_us : 0;
+		}
+
+		/**
+		 * Average number of bytes read from disk per parsed message.
+		 *
+		 * @return bytes/message, or 0 if nothing was parsed yet.
+		 */
+		double bytes_per_message() const
+		{
+			return parsed ? static_cast<double>(bytes_read) / parsed : 0;
 		}
 
 		std::atomic<bool>   running{}; /**< Is an index operation in progress? */
 		std::atomic<size_t> checked{}; /**< Number of messages checked for changes */
 		std::atomic<size_t> updated{}; /**< Number of messages (re)parsed/added/updated */
 		std::atomic<size_t> removed{}; /**< Number of message removed from store */
+
+		std::atomic<size_t>   parsed{};   /**< Number of messages parsed */
+		std::atomic<uint64_t> parse_us{}; /**< Time spent parsing, summed over
+						   * the parser threads (in µs) */
+		std::atomic<uint64_t> write_us{}; /**< Time spent writing to the store (in µs) */
+		std::atomic<uint64_t> bytes_read{}; /**< Bytes read from disk for parsing */
 	};
 
 	/**
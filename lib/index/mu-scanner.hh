@@ -22,6 +22,7 @@
 
 #include <functional>
 #include <memory>
+#include <utils/mu-utils.hh>
 
 #include <dirent.h>
 #include <sys/types.h>
@@ -39,6 +40,21 @@ namespace Mu {
 ///  - files starting with '.'
 ///  - files that do not live in a cur / new leaf maildir
 ///  - directories '.' and '..' and 'tmp'
+///  - directories with a '.noindex' file (and everything below)
+///  - directories with a '.noupdate' file (and everything below), unless
+///    scanning with Mode::IgnoreNoUpdate
+///
+/// Directories are walked relative to their file-descriptors (openat/fstatat);
+/// the entries of each directory are read in one go and handled in inode
+/// order, and the file type from the directory entry is used to avoid
+/// stat-calls where possible.
+///
+/// In Mode::Parallel, directories are scanned by a small pool of threads (one
+/// directory per task, with work-stealing between the threads), so the
+/// handler may be called from several threads at the same time. The entries
+/// of any given directory (EnterDir/EnterNewCur, its File entries and
+/// LeaveDir) are handled by a single thread, in that order; LeaveDir does
+/// not wait for the directory's sub-directories though.
 ///
 class Scanner {
 	public:
@@ -49,6 +65,12 @@ class Scanner {
 		LeaveDir
 	};
 
+	enum struct Mode {
+		Default	       = 0,	 /**< Default scan */
+		IgnoreNoUpdate = 1 << 0, /**< Do not skip dirs with a .noupdate file */
+		Parallel       = 1 << 1, /**< Scan directories in parallel */
+	};
+
 	/// Prototype for a handler function
 	using Handler = std::function<
 	    bool(const std::string& fullpath, struct stat* statbuf, HandleType htype)>;
@@ -72,9 +94,11 @@ class Scanner {
 	 * Start the scan; this is a blocking call than runs until
 	 * finished or (from another thread) stop() is called.
 	 *
+	 * @param mode scan mode flags
+	 *
 	 * @return true if starting worked; false otherwise
 	 */
-	bool start();
+	bool start(Mode mode = Mode::Default);
 
 	/**
 	 * Stop the scan
@@ -94,6 +118,7 @@ class Scanner {
 	struct Private;
 	std::unique_ptr<Private> priv_;
 };
+MU_ENABLE_BITOPS(Scanner::Mode);
 
 } // namespace Mu
 
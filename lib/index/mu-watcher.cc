@@ -0,0 +1,319 @@
+/*
+** Copyright (C) 2022 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#include "mu-watcher.hh"
+
+#include "config.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <unordered_map>
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif /*HAVE_SYS_INOTIFY_H*/
+
+#include <glib.h>
+
+#include "utils/mu-utils.hh"
+#include "utils/mu-error.hh"
+
+using namespace Mu;
+using namespace std::chrono_literals;
+
+// wait for this long after the most recent event before reporting a batch...
+constexpr auto QuietPeriod = 100ms;
+// ... but never longer than this after the first event in the batch.
+constexpr auto MaxDelay = 500ms;
+
+struct Watcher::Private {
+	Private(Watcher::Handler handler) : handler_{handler}
+	{
+		if (!handler_)
+			throw Mu::Error{Error::Code::Internal, "missing handler"};
+	}
+	~Private()
+	{
+		clear();
+	}
+
+	bool add_dir(const std::string& path);
+	void clear();
+	bool start();
+	bool stop();
+
+	void read_events();
+	void add_event(std::string&& path, Event::Type etype);
+	void flush_events();
+
+	const Watcher::Handler handler_;
+	int                    fd_{-1};
+
+	std::unordered_map<int, std::string> dirs_; // watch-descriptor -> path
+	mutable std::mutex                   lock_;
+
+	Events                                  events_;
+	std::unordered_map<std::string, size_t> event_idx_; // path -> index in events_
+
+	std::atomic<bool> running_{};
+	std::atomic<bool> stopping_{};
+};
+
+bool
+Watcher::supported()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	return true;
+#else
+	return false;
+#endif /*HAVE_SYS_INOTIFY_H*/
+}
+
+bool
+Watcher::Private::add_dir(const std::string& path)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	std::lock_guard lock{lock_};
+
+	if (fd_ < 0) {
+		fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd_ < 0) {
+			g_warning("failed to initialize inotify: %s", g_strerror(errno));
+			return false;
+		}
+	}
+
+	const auto wd = ::inotify_add_watch(fd_, path.c_str(),
+					    IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO |
+					    IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR);
+	if (wd < 0) {
+		g_warning("failed to watch %s: %s", path.c_str(), g_strerror(errno));
+		return false;
+	}
+
+	dirs_[wd] = path;
+	return true;
+#else
+	return false;
+#endif /*HAVE_SYS_INOTIFY_H*/
+}
+
+void
+Watcher::Private::clear()
+{
+	std::lock_guard lock{lock_};
+
+	if (fd_ >= 0)
+		::close(fd_); // removes all watches.
+	fd_ = -1;
+	dirs_.clear();
+	stopping_ = false;
+}
+
+void
+Watcher::Private::add_event(std::string&& path, Event::Type etype)
+{
+	// coalesce: only the last event for a given path matters.
+	if (const auto it = event_idx_.find(path); it != event_idx_.end())
+		events_[it->second].type = etype;
+	else {
+		event_idx_.emplace(path, events_.size());
+		events_.emplace_back(Event{std::move(path), etype});
+	}
+}
+
+void
+Watcher::Private::flush_events()
+{
+	if (events_.empty())
+		return;
+
+	g_debug("handling %zu event(s)", events_.size());
+	handler_(events_);
+
+	events_.clear();
+	event_idx_.clear();
+}
+
+void
+Watcher::Private::read_events()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	alignas(struct inotify_event) char buf[16 * 1024];
+
+	while (true) {
+		const auto len = ::read(fd_, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len < 0 && errno != EAGAIN && errno != EINTR)
+				g_warning("failed to read events: %s", g_strerror(errno));
+			return;
+		}
+
+		std::lock_guard lock{lock_};
+		for (auto ptr = buf; ptr < buf + len;) {
+			const auto ev{reinterpret_cast<const struct inotify_event*>(ptr)};
+			ptr += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				g_warning("inotify queue overflow; events were lost");
+				add_event({}, Event::Type::Overflow);
+				continue;
+			} else if (ev->mask & IN_IGNORED) { // watch is gone
+				dirs_.erase(ev->wd);
+				continue;
+			}
+
+			const auto it = dirs_.find(ev->wd);
+			if (it == dirs_.end() || ev->len == 0)
+				continue;
+
+			auto path{it->second + "/" + ev->name};
+			const auto added{(ev->mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE)) != 0};
+
+			if (ev->mask & IN_ISDIR)
+				add_event(std::move(path), added ? Event::Type::DirAdded
+								 : Event::Type::DirRemoved);
+			else
+				add_event(std::move(path), added ? Event::Type::Changed
+								 : Event::Type::Removed);
+		}
+	}
+#endif /*HAVE_SYS_INOTIFY_H*/
+}
+
+bool
+Watcher::Private::start()
+{
+	if (!supported()) {
+		g_warning("watching directories is not supported on this system");
+		return false;
+	}
+
+	const auto [fd, n_dirs] = std::invoke([this] {
+		std::lock_guard lock{lock_};
+		return std::make_pair(fd_, dirs_.size());
+	});
+	if (fd < 0) {
+		g_warning("no directories to watch");
+		return false;
+	}
+
+	if (stopping_)
+		return true; // stopped before we even started
+
+	running_ = true;
+	g_debug("start watching %zu dir(s)", n_dirs);
+
+	Clock::time_point first{}, last{};
+	while (!stopping_) {
+		struct pollfd pfd {
+			fd, POLLIN, 0
+		};
+		const auto timeout = events_.empty() ? 250ms : QuietPeriod;
+		const auto res = ::poll(&pfd, 1, static_cast<int>(to_ms(timeout)));
+		if (res < 0 && errno != EINTR) {
+			g_warning("failed to poll: %s", g_strerror(errno));
+			break;
+		}
+
+		const auto now{Clock::now()};
+		if (res > 0) {
+			if (events_.empty())
+				first = now;
+			last = now;
+			read_events();
+		}
+
+		// report events when things calm down, or when they have been
+		// waiting for too long.
+		if (!events_.empty() && (now - last >= QuietPeriod || now - first >= MaxDelay))
+			flush_events();
+	}
+
+	flush_events();
+	running_ = false;
+	g_debug("stopped watching");
+
+	return true;
+}
+
+bool
+Watcher::Private::stop()
+{
+	g_debug("stopping watcher");
+	stopping_ = true;
+
+	return true;
+}
+
+Watcher::Watcher(Watcher::Handler handler) : priv_{std::make_unique<Private>(handler)} {}
+
+Watcher::~Watcher() = default;
+
+bool
+Watcher::add_dir(const std::string& path)
+{
+	return priv_->add_dir(path);
+}
+
+std::vector<std::string>
+Watcher::dirs() const
+{
+	std::lock_guard lock{priv_->lock_};
+
+	std::vector<std::string> dirs;
+	for (auto&& item : priv_->dirs_)
+		dirs.emplace_back(item.second);
+
+	return dirs;
+}
+
+void
+Watcher::clear()
+{
+	priv_->clear();
+}
+
+bool
+Watcher::start()
+{
+	if (priv_->running_)
+		return true; // nothing to do
+
+	return priv_->start(); /* blocks */
+}
+
+bool
+Watcher::stop()
+{
+	return priv_->stop();
+}
+
+bool
+Watcher::is_running() const
+{
+	return priv_->running_;
+}
@@ -0,0 +1,129 @@
+/*
+** Copyright (C) 2022 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#ifndef MU_WATCHER_HH__
+#define MU_WATCHER_HH__
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Mu {
+
+/// @brief Directory watcher
+///
+/// Watches a set of directories for files being added / removed (using
+/// inotify), and calls the Handler callback with batches of (coalesced)
+/// events.
+///
+/// Events are coalesced per path: when a burst of events arrives, the
+/// watcher waits until things quiet down (or until some maximum delay has
+/// passed) and then reports only the last event for each path.
+///
+class Watcher {
+public:
+	struct Event {
+		enum struct Type {
+			Changed,    /**< File was added or changed */
+			Removed,    /**< File was removed */
+			DirAdded,   /**< Directory was added */
+			DirRemoved, /**< Directory was removed */
+			Overflow,   /**< Events were lost; path is empty */
+		};
+		std::string path; /**< Full path */
+		Type        type; /**< Event type */
+	};
+	using Events = std::vector<Event>;
+
+	/// Prototype for a handler function
+	using Handler = std::function<void(const Events& events)>;
+
+	/**
+	 * Construct a watcher object
+	 *
+	 * @param handler handler function for batches of events
+	 */
+	Watcher(Handler handler);
+
+	/**
+	 * DTOR
+	 */
+	~Watcher();
+
+	/**
+	 * Is watching directories supported on this system?
+	 *
+	 * @return true or false
+	 */
+	static bool supported();
+
+	/**
+	 * Start watching some directory (non-recursively). This can be called
+	 * from multiple threads, and before or after start().
+	 *
+	 * @param path full path to the directory
+	 *
+	 * @return true if adding the watch worked, false otherwise
+	 */
+	bool add_dir(const std::string& path);
+
+	/**
+	 * Get the directories being watched
+	 *
+	 * @return the directories
+	 */
+	std::vector<std::string> dirs() const;
+
+	/**
+	 * Remove all watches, and reset the watcher after a stop().
+	 */
+	void clear();
+
+	/**
+	 * Start watching; this is a blocking call that runs until (from
+	 * another thread) stop() is called.
+	 *
+	 * @return true if starting worked; false otherwise
+	 */
+	bool start();
+
+	/**
+	 * Stop watching. If this is called before start(), that start()
+	 * returns immediately, until the watcher is reset with clear().
+	 *
+	 * @return true if stopping worked; false otherwise
+	 */
+	bool stop();
+
+	/**
+	 * Is the watcher running?
+	 *
+	 * @return true or false
+	 */
+	bool is_running() const;
+
+private:
+	struct Private;
+	std::unique_ptr<Private> priv_;
+};
+
+} // namespace Mu
+
+#endif /* MU_WATCHER_HH__ */
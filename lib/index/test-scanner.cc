@@ -17,45 +17,130 @@
 **  02110-1301, USA.
 */
 
+#include <config.h>
+
 #include <vector>
 #include <glib.h>
 
+#include <algorithm>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <unordered_set>
 
 #include "mu-scanner.hh"
-#include "mu-utils.hh"
+#include "utils/mu-utils.hh"
 
 using namespace Mu;
 
+using HType = Scanner::HandleType;
+using Calls = std::vector<std::pair<HType, std::string>>;
+
+// scan a maildir, and return the handler calls, in the order they happened.
+static Calls
+scan(const std::string& root, Scanner::Mode mode)
+{
+	Calls      calls;
+	std::mutex lock; // for Mode::Parallel
+	Scanner    scanner{root, [&](auto&& fullpath, auto&& statbuf, auto&& htype) {
+				   g_assert_nonnull(statbuf);
+				   std::lock_guard guard{lock};
+				   calls.emplace_back(htype, fullpath);
+				   return true;
+			   }};
+	g_assert_true(scanner.start(mode));
+	g_assert_false(scanner.is_running());
+
+	return calls;
+}
+
+static std::string
+dirname(const std::string& path)
+{
+	const auto slash{path.rfind('/')};
+	g_assert_true(slash != std::string::npos);
+
+	return path.substr(0, slash);
+}
+
+// check that the entries of each dir are handled in order: first entering
+// the dir, then its files, then leaving it (except for skipped dirs, e.g.
+// with a .noindex file, which are never left).
 static void
-test_scan_maildir()
+check_order(const std::string& root, const Calls& calls)
 {
-	allow_warnings();
-
-	Scanner scanner{
-	    "/home/djcb/Maildir",
-	    [](const dirent* dentry) -> bool {
-		    g_print("%02x %s\n", dentry->d_type, dentry->d_name);
-		    return true;
-	    },
-	    [](const std::string& fullpath, const struct stat* statbuf, auto&& info) -> bool {
-		    g_print("%s %zu\n", fullpath.c_str(), statbuf->st_size);
-		    return true;
-	    }};
-	g_assert_true(scanner.start());
-
-	while (scanner.is_running()) {
-		sleep(1);
+	std::unordered_set<std::string> entered, left;
+	for (auto&& [htype, path] : calls) {
+		switch (htype) {
+		case HType::EnterDir:
+		case HType::EnterNewCur:
+			g_assert_true(entered.emplace(path).second);
+			// sub-dirs are entered after their parent (the handler
+			// is not called for the root dir itself).
+			if (dirname(path) != root)
+				g_assert_true(entered.find(dirname(path)) != entered.end());
+			break;
+		case HType::File:
+			g_assert_true(entered.find(dirname(path)) != entered.end());
+			g_assert_true(left.find(dirname(path)) == left.end());
+			break;
+		case HType::LeaveDir:
+			g_assert_true(entered.find(path) != entered.end());
+			g_assert_true(left.emplace(path).second);
+			break;
+		default:
+			g_assert_not_reached();
+		}
 	}
 }
 
+static void
+test_scan_modes(const std::string& root)
+{
+	auto dflt{scan(root, Scanner::Mode::Default)};
+	auto parallel{scan(root, Scanner::Mode::Parallel)};
+
+	check_order(root, dflt);
+	check_order(root, parallel);
+
+	const auto count = [](const Calls& calls, HType htype) {
+		return std::count_if(calls.begin(), calls.end(),
+				     [&](auto&& call) { return call.first == htype; });
+	};
+	g_assert_cmpuint(count(dflt, HType::File), >, 0);
+	g_assert_cmpuint(count(dflt, HType::EnterNewCur), >, 0);
+
+	// the same calls, whatever the order.
+	std::sort(dflt.begin(), dflt.end());
+	std::sort(parallel.begin(), parallel.end());
+	g_assert_true(dflt == parallel);
+
+	// the tmp/ dirs, and the files in there, are skipped.
+	g_assert_true(std::none_of(dflt.begin(), dflt.end(), [&](auto&& call) {
+		const auto relpath{call.second.substr(root.size()) + "/"};
+		return relpath.find("/tmp/") != std::string::npos;
+	}));
+}
+
+static void
+test_scan_maildir()
+{
+	test_scan_modes(Mu::canonicalize_filename(MU_TESTMAILDIR, "/"));
+}
+
+static void
+test_scan_maildir_tree()
+{
+	test_scan_modes(Mu::canonicalize_filename(MU_TESTMAILDIR2, "/"));
+}
+
 int
 main(int argc, char* argv[])
 try {
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/utils/scanner/scan-maildir", test_scan_maildir);
+	g_test_add_func("/utils/scanner/scan-maildir-tree", test_scan_maildir_tree);
 
 	return g_test_run();
 
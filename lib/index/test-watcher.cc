@@ -0,0 +1,144 @@
+/*
+** Copyright (C) 2022 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+**  This library is free software; you can redistribute it and/or
+**  modify it under the terms of the GNU Lesser General Public License
+**  as published by the Free Software Foundation; either version 2.1
+**  of the License, or (at your option) any later version.
+**
+**  This library is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+**  Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public
+**  License along with this library; if not, write to the Free
+**  Software Foundation, 51 Franklin Street, Fifth Floor, Boston, MA
+**  02110-1301, USA.
+*/
+
+#include <config.h>
+
+#include <vector>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "mu-watcher.hh"
+#include "test-mu-common.hh"
+
+using namespace Mu;
+using namespace std::chrono_literals;
+
+using Type = Watcher::Event::Type;
+
+struct Recorder {
+	// wait until at least n events came in, and return them.
+	Watcher::Events wait_for(size_t n)
+	{
+		std::unique_lock lock{lock_};
+		cond_.wait_for(lock, 5s, [&] { return events_.size() >= n; });
+
+		auto events{std::move(events_)};
+		events_.clear();
+		return events;
+	}
+
+	void operator()(const Watcher::Events& events)
+	{
+		std::lock_guard lock{lock_};
+		g_assert_cmpuint(events.size(), >, 0);
+		events_.insert(events_.end(), events.begin(), events.end());
+		cond_.notify_one();
+	}
+
+	std::mutex              lock_;
+	std::condition_variable cond_;
+	Watcher::Events         events_;
+};
+
+static bool
+has_event(const Watcher::Events& events, const std::string& path, Type type)
+{
+	return std::any_of(events.begin(), events.end(), [&](auto&& event) {
+		return event.path == path && event.type == type;
+	});
+}
+
+static void
+test_watch_maildir()
+{
+	if (!Watcher::supported()) {
+		g_test_skip("watching is not supported");
+		return;
+	}
+
+	char* tmpdir{test_mu_common_get_random_tmpdir()};
+	const std::string mdir{tmpdir};
+	g_free(tmpdir);
+	for (auto&& sub : {"/cur", "/new", "/tmp"})
+		g_assert_cmpint(g_mkdir_with_parents((mdir + sub).c_str(), 0700), ==, 0);
+
+	Recorder recorder;
+	Watcher  watcher{[&](auto&& events) { recorder(events); }};
+	g_assert_true(watcher.add_dir(mdir + "/cur"));
+	g_assert_true(watcher.add_dir(mdir + "/new"));
+	g_assert_cmpuint(watcher.dirs().size(), ==, 2);
+
+	std::thread thread{[&] { g_assert_true(watcher.start()); }};
+
+	// a new message; the create & write events are coalesced
+	const auto new_path{mdir + "/new/1652626363.123_1.foo"};
+	std::ofstream{new_path} << "From: foo@example.com\n\nhello\n";
+	auto events{recorder.wait_for(1)};
+	g_assert_cmpuint(events.size(), ==, 1);
+	g_assert_true(has_event(events, new_path, Type::Changed));
+
+	// ... which is moved to cur/
+	const auto cur_path{mdir + "/cur/1652626363.123_1.foo:2,S"};
+	g_assert_cmpint(::rename(new_path.c_str(), cur_path.c_str()), ==, 0);
+	events = recorder.wait_for(2);
+	g_assert_cmpuint(events.size(), ==, 2);
+	g_assert_true(has_event(events, new_path, Type::Removed));
+	g_assert_true(has_event(events, cur_path, Type::Changed));
+
+	// ... and deleted.
+	g_assert_cmpint(::unlink(cur_path.c_str()), ==, 0);
+	events = recorder.wait_for(1);
+	g_assert_cmpuint(events.size(), ==, 1);
+	g_assert_true(has_event(events, cur_path, Type::Removed));
+
+	// a message that comes and goes in one burst only yields the last
+	// event.
+	const auto tmp_path{mdir + "/new/1652626363.123_2.foo"};
+	std::ofstream{tmp_path} << "From: foo@example.com\n\nbye\n";
+	g_assert_cmpint(::unlink(tmp_path.c_str()), ==, 0);
+	events = recorder.wait_for(1);
+	g_assert_cmpuint(events.size(), ==, 1);
+	g_assert_true(has_event(events, tmp_path, Type::Removed));
+
+	g_assert_true(watcher.stop());
+	thread.join();
+	g_assert_false(watcher.is_running());
+}
+
+int
+main(int argc, char* argv[])
+try {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/index/watcher/watch-maildir", test_watch_maildir);
+
+	return g_test_run();
+
+} catch (const std::runtime_error& re) {
+	std::cerr << re.what() << "\n";
+	return 1;
+}
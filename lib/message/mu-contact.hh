@@ -126,7 +126,8 @@ struct Contact {
 							   * contact originates (or 0) */
 	bool			personal;	/**<  A personal message? */
 	size_t			frequency;	/**< Frequency of this contact */
-	int64_t			tstamp;	/**< Timestamp for this contact (internal use) */
+	int64_t			tstamp;	/**< Timestamp / change-sequence number for this
+					 * contact (internal use) */
 
 private:
 	void cleanup_name() { // replace control characters by spaces.
@@ -72,6 +72,7 @@ struct Field {
 		/* add new ones here... */
 		MailingList, /**< Mailing list */
 		ThreadId,    /**< Thread Id */
+		ThreadPath,  /**< Position in the thread (internal) */
 
 		/*
 		 * <private>
@@ -464,6 +465,16 @@ static constexpr std::array<Field, Field::id_size()>
 		'w',
 		Field::Flag::NormalTerm
 	    },
+	    // ThreadPath (internal)
+	    {
+		Field::Id::ThreadPath,
+		Field::Type::String,
+		"thread-path",
+		"Position of a message in its thread",
+		{},
+		{},
+		Field::Flag::Value
+	    },
 	}};
 
 /*
@@ -359,24 +359,16 @@ calculate_sha256(const std::string& path)
 {
 	g_autoptr(GChecksum) checksum{g_checksum_new(G_CHECKSUM_SHA256)};
 
-	FILE *file{::fopen(path.c_str(), "r")};
-	if (!file)
-		return Err(Error{Error::Code::File, "failed to open %s: %s",
-					path.c_str(), ::strerror(errno)});
-
-	std::array<uint8_t, 4096> buf{};
-	while (true) {
-		const auto n = ::fread(buf.data(), 1, buf.size(), file);
-		if (n == 0)
-			break;
-		g_checksum_update(checksum, buf.data(), n);
-	}
+	// map the file; its pages are already in memory after parsing, so this
+	// does not need to read anything from disk.
+	GError *err{};
+	g_autoptr(GMappedFile) mfile{g_mapped_file_new(path.c_str(), FALSE, &err)};
+	if (!mfile)
+		return Err(Error::Code::File, &err, "failed to map %s", path.c_str());
 
-	bool has_err = ::ferror(file) != 0;
-	::fclose(file);
-
-	if (has_err)
-		return Err(Error{Error::Code::File, "failed to read %s", path.c_str()});
+	g_checksum_update(checksum,
+			  reinterpret_cast<const guchar*>(g_mapped_file_get_contents(mfile)),
+			  static_cast<gssize>(g_mapped_file_get_length(mfile)));
 
 	return Ok(g_checksum_get_string(checksum));
 }
@@ -408,7 +400,9 @@ fill_document(Message::Private& priv)
 
 	const auto path{doc.string_value(Field::Id::Path)};
 	const auto refs{mime_msg.references()};
-	const auto message_id{mime_msg.message_id().value_or(fake_message_id(path))};
+	// only calculate a fake message-id when we actually need it.
+	auto msgid{mime_msg.message_id()};
+	const auto message_id{msgid ? std::move(*msgid) : fake_message_id(path)};
 
 	process_message(mime_msg, path, priv);
 
@@ -478,6 +472,8 @@ fill_document(Message::Private& priv)
 			// either the oldest reference, or otherwise the message id
 			doc.add(field.id, refs.empty() ? message_id : refs.at(0));
 			break;
+		case Field::Id::ThreadPath: /* maintained by the store */
+			break;
 		case Field::Id::To:
 			doc.add(field.id, mime_msg.addresses(AddrType::To));
 			break;
@@ -23,6 +23,9 @@
 #include "utils/mu-utils.hh"
 #include <mutex>
 #include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 
 using namespace Mu;
@@ -140,12 +143,24 @@ make_from_stream(GMimeStream* &&stream/*consume*/)
 Result<MimeMessage>
 MimeMessage::make_from_file(const std::string& path)
 {
-	GError* err{};
-	if (auto&& stream{g_mime_stream_file_open(path.c_str(), "r", &err)}; !stream)
-		return Err(Error::Code::Message, &err,
+	const auto fd{::open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+	if (fd < 0)
+		return Err(Error::Code::File, "failed to open %s: %s",
+			   path.c_str(), g_strerror(errno));
+
+	// parse from a memory-mapping of the file, so we don't need to copy the
+	// message through stdio buffers; this does not work for empty files,
+	// so fall back to reading.
+	auto stream{g_mime_stream_mmap_new(fd, PROT_READ, MAP_PRIVATE)};
+	if (!stream)
+		stream = g_mime_stream_fs_new(fd);
+	if (!stream) {
+		::close(fd);
+		return Err(Error::Code::Message,
 			   "failed to open stream for %s", path.c_str());
-	else
-		return make_from_stream(std::move(stream));
+	}
+
+	return make_from_stream(std::move(stream));
 }
 
 Result<MimeMessage>
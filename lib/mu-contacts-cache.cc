@@ -24,9 +24,17 @@
 #include <set>
 #include <sstream>
 #include <functional>
+#include <iterator>
 #include <algorithm>
 #include <regex>
 #include <ctime>
+#include <cmath>
+#include <array>
+#include <limits>
+#include <unordered_set>
+#include <map>
+#include <atomic>
+#include <thread>
 
 #include <utils/mu-utils.hh>
 #include <glib.h>
@@ -45,24 +53,118 @@ struct EmailEqual {
 };
 
 using ContactUMap = std::unordered_map<const std::string, Contact, EmailHash, EmailEqual>;
+
+// contacts are persisted in shards, based on their (lowercase) e-mail address,
+// so we only need to write the shards that changed.
+constexpr size_t NumShards = 256;
+static size_t
+shard_of(const std::string& email)
+{
+	return lowercase_hash(email) % NumShards;
+}
+
+// contacts are first collected in accumulators, one for each (hash of the)
+// thread adding them, so those threads do not get in each other's way; they are
+// merged into the cache when needed.
+constexpr size_t NumAccumulators = 16;
+struct Accumulator {
+	struct Item {
+		Contact contact;
+		size_t  adds; /* number of times this was added */
+	};
+	std::mutex        mtx_;
+	std::vector<Item> items_; /* in order of (first) addition */
+	std::unordered_map<std::string, size_t, EmailHash, EmailEqual> pos_; /* in items_ */
+};
+
+static std::string
+ascii_lower(const std::string& str)
+{
+	std::string lower{str};
+	for (auto& c : lower)
+		c = g_ascii_tolower(c);
+	return lower;
+}
+
 struct ContactsCache::Private {
 	Private(const std::string& serialized, const StringVec& personal)
 		: contacts_{deserialize(serialized)},
 		  personal_plain_{make_personal_plain(personal)},
 		  personal_rx_{make_personal_rx(personal)},
 		  dirty_{0}
-	{}
+	{ init_contacts(); }
+
+	Private(const LoadFunc& load, const StringVec& personal)
+		: personal_plain_{make_personal_plain(personal)},
+		  personal_rx_{make_personal_rx(personal)},
+		  dirty_{0}
+	{
+		load_contacts(load);
+		init_contacts();
+	}
 
 	ContactUMap deserialize(const std::string&) const;
-	std::string serialize() const;
+	void        load_contacts(const LoadFunc& load);
+	void        deserialize_shard(const std::string& data, ContactUMap& contacts) const;
+	std::string serialize_shard(size_t shard) const;
+	void        init_contacts();
+
+	void mark_dirty(const std::string& email) {
+		++dirty_;
+		dirty_shards_[shard_of(email)] = true;
+	}
+
+	void mark_changed(Contact& contact) {
+		if (const auto it = changes_.find(contact.tstamp);
+		    it != changes_.end() && it->second == &contact)
+			changes_.erase(it);
+		contact.tstamp = ++seq_;
+		changes_.emplace(contact.tstamp, &contact);
+	}
+
+	void index_contact(const Contact& contact);
+	void reindex_contact(const Contact& contact, const StringVec& old_words);
+	void update_index();
+
+	void merge(Contact&& contact, size_t adds);
+	void merge_pending();
+	bool is_personal(const std::string& addr);
 
 	ContactUMap contacts_;
 	std::mutex  mtx_;
 
-	const StringVec               personal_plain_;
-	const std::vector<std::regex> personal_rx_;
-
-	size_t dirty_;
+	const std::unordered_set<std::string> personal_plain_; /* lowercase */
+	const std::vector<std::regex>         personal_rx_;
+	std::unordered_map<std::string, bool> personal_verdicts_; /* for the rx */
+	std::mutex                            personal_mtx_;
+
+	std::array<Accumulator, NumAccumulators> accumulators_;
+	std::atomic<size_t>                      pending_{}; /* in the accumulators */
+
+	size_t                        dirty_;
+	std::array<bool, NumShards>   dirty_shards_{};
+	bool                          migrate_{}; /* still in the old format? */
+
+	// the completion index: (flattened) words from names / addresses,
+	// pointing to their contact. The first index_sorted_ entries are
+	// sorted; the rest were added later, and get merged when needed.
+	// Note that the contacts_ map never invalidates the pointers, as long
+	// as we don't remove contacts. Entries for words a contact no longer
+	// has (after a name change) are queued in index_removed_, and then
+	// cleared (contact == nullptr) until there are enough to compact.
+	using IndexEntry = std::pair<std::string, const Contact*>;
+	std::vector<IndexEntry> index_;
+	size_t                  index_sorted_{};
+	std::vector<IndexEntry> index_removed_;
+	size_t                  index_cleared_{};
+	bool                    index_stale_{}; /* needs a full rebuild */
+
+	// the change log: each change to a contact gets a new sequence number
+	// (the contact's tstamp); changes_ maps the latest one for each
+	// contact to that contact.
+	int64_t                           seq_{};       /* latest sequence number */
+	int64_t                           clear_seq_{}; /* sequence number of last clear() */
+	std::map<int64_t, const Contact*> changes_;
 
 private:
 	/**
@@ -72,14 +174,12 @@ private:
 	 *
 	 * @return
 	 */
-	StringVec make_personal_plain(const StringVec& personal) const {
-		StringVec svec;
-		std::copy_if(personal.begin(),  personal.end(),
-			     std::back_inserter(svec), [&](auto&& p) {
-				     return p.size() < 2
-					     || p.at(0) != '/' || p.at(p.length() - 1) != '/';
-			     });
-		return svec;
+	std::unordered_set<std::string> make_personal_plain(const StringVec& personal) const {
+		std::unordered_set<std::string> plain;
+		for (auto&& p : personal)
+			if (p.size() < 2 || p.at(0) != '/' || p.at(p.length() - 1) != '/')
+				plain.emplace(ascii_lower(p));
+		return plain;
 	}
 
 	/**
@@ -112,6 +212,177 @@ private:
 
 constexpr auto Separator = "\xff"; // Invalid in UTF-8
 
+// metadata keys for the old text format, and the new binary one.
+constexpr auto LegacyKey      = "contacts";
+constexpr auto VersionKey     = "contacts-version";
+constexpr auto SeqKey         = "contacts-seq";
+constexpr auto ShardKeyPrefix = "contacts-";
+
+// version of the binary format; version 2 did not have the change-sequence
+// numbers.
+constexpr uint8_t FormatVersion = 3;
+
+static std::string
+shard_key(size_t shard)
+{
+	return format("%s%02zx", ShardKeyPrefix, shard);
+}
+
+static void
+put_varint(std::string& data, uint64_t val)
+{
+	while (val >= 0x80) {
+		data += static_cast<char>((val & 0x7f) | 0x80);
+		val >>= 7;
+	}
+	data += static_cast<char>(val);
+}
+
+static void
+put_string(std::string& data, const std::string& str)
+{
+	put_varint(data, str.size());
+	data += str;
+}
+
+// reads from a buffer; returns false when trying to read beyond the end.
+struct Reader {
+	Reader(const std::string& data): cur{data.data()}, end{data.data() + data.size()} {}
+
+	bool varint(uint64_t& val) {
+		val = 0;
+		for (auto shift = 0U; cur != end && shift < 64; shift += 7) {
+			const auto byte{static_cast<uint8_t>(*cur++)};
+			val |= static_cast<uint64_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	bool string(std::string& str) {
+		uint64_t len{};
+		if (!varint(len) || len > static_cast<size_t>(end - cur))
+			return false;
+		str.assign(cur, len);
+		cur += len;
+		return true;
+	}
+
+	bool byte(uint8_t& b) {
+		if (cur == end)
+			return false;
+		b = static_cast<uint8_t>(*cur++);
+		return true;
+	}
+
+	const char* cur;
+	const char* end;
+};
+
+std::string
+ContactsCache::Private::serialize_shard(size_t shard) const
+{
+	std::string data;
+	data += static_cast<char>(FormatVersion);
+
+	for (auto&& item : contacts_) {
+		const auto& ci{item.second};
+		if (shard_of(ci.email) != shard)
+			continue;
+		put_string(data, ci.email);
+		put_string(data, ci.name);
+		// zig-zag encoding for the (signed) date
+		put_varint(data, (static_cast<uint64_t>(ci.message_date) << 1) ^
+				     static_cast<uint64_t>(ci.message_date >> 63));
+		data += static_cast<char>(ci.personal ? 1 : 0);
+		put_varint(data, ci.frequency);
+		put_varint(data, static_cast<uint64_t>(std::max<int64_t>(ci.tstamp, 0)));
+	}
+
+	return data;
+}
+
+void
+ContactsCache::Private::deserialize_shard(const std::string& data, ContactUMap& contacts) const
+{
+	if (data.empty())
+		return;
+
+	Reader  reader{data};
+	uint8_t version{};
+	if (!reader.byte(version) || version < 2 || version > FormatVersion) {
+		g_warning("unsupported contacts format %u", version);
+		return;
+	}
+
+	while (reader.cur != reader.end) {
+		std::string email, name;
+		uint64_t    date{}, freq{}, seq{};
+		uint8_t     personal{};
+		if (!reader.string(email) || !reader.string(name) || !reader.varint(date) ||
+		    !reader.byte(personal) || !reader.varint(freq) ||
+		    (version > 2 && !reader.varint(seq))) {
+			g_warning("invalid contacts data");
+			return;
+		}
+		Contact ci(email, std::move(name),
+			   static_cast<time_t>((date >> 1) ^ -(date & 1)),
+			   personal != 0,
+			   static_cast<size_t>(freq),
+			   static_cast<int64_t>(seq));
+		contacts.emplace(std::move(email), std::move(ci));
+	}
+}
+
+void
+ContactsCache::Private::load_contacts(const LoadFunc& load)
+{
+	if (!load)
+		return;
+
+	const auto version{load(VersionKey)};
+	if (version.empty()) { // not converted yet (or no contacts at all)
+		contacts_ = deserialize(load(LegacyKey));
+		if (!contacts_.empty()) {
+			g_debug("converting %zu contact(s) to the new format",
+				contacts_.size());
+			migrate_ = true;
+			dirty_shards_.fill(true);
+			++dirty_;
+		}
+		return;
+	}
+
+	const auto vnum{g_ascii_strtoll(version.c_str(), {}, 10)};
+	if (vnum < 2 || vnum > FormatVersion) {
+		g_warning("unsupported contacts version %s", version.c_str());
+		return;
+	}
+
+	seq_ = g_ascii_strtoll(load(SeqKey).c_str(), {}, 10);
+	for (auto shard = 0U; shard != NumShards; ++shard)
+		deserialize_shard(load(shard_key(shard)), contacts_);
+
+	if (vnum != FormatVersion) { // upgrade
+		dirty_shards_.fill(true);
+		++dirty_;
+	}
+}
+
+void
+ContactsCache::Private::init_contacts()
+{
+	for (auto&& item : contacts_) {
+		const auto& contact{item.second};
+		seq_ = std::max(seq_, contact.tstamp);
+		if (contact.tstamp > 0)
+			changes_.emplace(contact.tstamp, &contact);
+	}
+
+	index_stale_ = !contacts_.empty();
+}
+
 
 ContactUMap
 ContactsCache::Private::deserialize(const std::string& serialized) const
@@ -131,98 +402,264 @@ ContactsCache::Private::deserialize(const std::string& serialized) const
 				  (time_t)g_ascii_strtoll(parts[4].c_str(), NULL, 10),       // message_date
 				  parts[3][0] == '1' ? true : false,                         // personal
 				  (std::size_t)g_ascii_strtoll(parts[5].c_str(), NULL, 10),  // frequency
-				  g_get_monotonic_time());                                   // tstamp
+				  0);                                                        // tstamp
 		contacts.emplace(std::move(parts[1]), std::move(ci));
 	}
 
 	return contacts;
 }
 
+/**
+ * Get the words for the completion index for some contact, i.e. the
+ * address, the parts of the address, and the name and its parts. All of those
+ * are flattened (lowercase, no accents), and unique.
+ *
+ * @param contact some contact
+ *
+ * @return the words
+ */
+static StringVec
+completion_words(const Contact& contact)
+{
+	StringVec words;
+	const auto add_words = [&](const std::string& str, const char* sepas) {
+		if (str.empty())
+			return;
+		auto flat{utf8_flatten(str)};
+		for (auto b = flat.find_first_not_of(sepas); b != std::string::npos;) {
+			const auto e = flat.find_first_of(sepas, b);
+			words.emplace_back(flat.substr(b, e == std::string::npos ?
+							  std::string::npos : e - b));
+			b = e == std::string::npos ? e : flat.find_first_not_of(sepas, e);
+		}
+		words.emplace_back(std::move(flat));
+	};
+
+	add_words(contact.email, "@.-_+");
+	add_words(contact.name, " \t\"'<>(),.");
+
+	std::sort(words.begin(), words.end());
+	words.erase(std::unique(words.begin(), words.end()), words.end());
+
+	return words;
+}
+
+void
+ContactsCache::Private::index_contact(const Contact& contact)
+{
+	if (index_stale_)
+		return; // we'll rebuild everything anyway.
+
+	for (auto&& word : completion_words(contact))
+		index_.emplace_back(std::move(word), &contact);
+}
+
+void
+ContactsCache::Private::reindex_contact(const Contact& contact, const StringVec& old_words)
+{
+	if (index_stale_)
+		return; // we'll rebuild everything anyway.
+
+	// both are sorted; only touch the words that changed.
+	const auto new_words{completion_words(contact)};
+	StringVec  gone, added;
+	std::set_difference(old_words.begin(), old_words.end(),
+			    new_words.begin(), new_words.end(), std::back_inserter(gone));
+	std::set_difference(new_words.begin(), new_words.end(),
+			    old_words.begin(), old_words.end(), std::back_inserter(added));
+
+	for (auto&& word : gone)
+		index_removed_.emplace_back(std::move(word), &contact);
+	for (auto&& word : added)
+		index_.emplace_back(std::move(word), &contact);
+}
+
+void
+ContactsCache::Private::update_index()
+{
+	if (index_stale_) {
+		index_.clear();
+		index_removed_.clear();
+		index_sorted_  = 0;
+		index_cleared_ = 0;
+		index_stale_   = false;
+		for (auto&& item : contacts_)
+			index_contact(item.second);
+	}
+
+	if (index_sorted_ != index_.size()) {
+		const auto mid{index_.begin() + index_sorted_};
+		std::sort(mid, index_.end());
+		std::inplace_merge(index_.begin(), mid, index_.end());
+		index_sorted_ = index_.size();
+	}
+
+	for (auto&& [word, contact] : index_removed_) {
+		const auto range{std::equal_range(
+		    index_.begin(), index_.end(), IndexEntry{word, nullptr},
+		    [](auto&& entry1, auto&& entry2) { return entry1.first < entry2.first; })};
+		const auto it = std::find_if(range.first, range.second, [&](auto&& entry) {
+			return entry.second == contact;
+		});
+		if (it != range.second) {
+			it->second = nullptr;
+			++index_cleared_;
+		}
+	}
+	index_removed_.clear();
+
+	if (index_cleared_ > 0 && index_cleared_ >= index_.size() / 8) {
+		index_.erase(std::remove_if(index_.begin(), index_.end(),
+					    [](auto&& entry) { return !entry.second; }),
+			     index_.end());
+		index_sorted_  = index_.size();
+		index_cleared_ = 0;
+	}
+}
+
 ContactsCache::ContactsCache(const std::string& serialized, const StringVec& personal)
     : priv_{std::make_unique<Private>(serialized, personal)}
 {
 }
 
+ContactsCache::ContactsCache(const LoadFunc& load, const StringVec& personal)
+    : priv_{std::make_unique<Private>(load, personal)}
+{
+}
+
 ContactsCache::~ContactsCache() = default;
-std::string
-ContactsCache::serialize() const
+
+size_t
+ContactsCache::serialize(const SaveFunc& save) const
 {
 	std::lock_guard<std::mutex> l_{priv_->mtx_};
-	std::string                 s;
+	priv_->merge_pending();
 
-	for (auto& item : priv_->contacts_) {
-		const auto& ci{item.second};
-		s += Mu::format("%s%s"
-				"%s%s"
-				"%s%s"
-				"%d%s"
-				"%" G_GINT64_FORMAT "%s"
-				"%" G_GINT64_FORMAT "\n",
-				ci.display_name().c_str(),
-				Separator,
-				ci.email.c_str(),
-				Separator,
-				ci.name.c_str(),
-				Separator,
-				ci.personal ? 1 : 0,
-				Separator,
-				(gint64)ci.message_date,
-				Separator,
-				(gint64)ci.frequency);
+	size_t n{};
+	for (auto shard = 0U; shard != NumShards; ++shard) {
+		if (!priv_->dirty_shards_[shard])
+			continue;
+		save(shard_key(shard), priv_->serialize_shard(shard));
+		priv_->dirty_shards_[shard] = false;
+		++n;
+	}
+
+	if (priv_->migrate_ || n > 0) {
+		save(VersionKey, format("%u", FormatVersion));
+		save(SeqKey, format("%" PRId64, priv_->seq_));
+		n += 2;
+	}
+	if (priv_->migrate_) { // remove the old data.
+		save(LegacyKey, "");
+		priv_->migrate_ = false;
+		++n;
 	}
 
 	priv_->dirty_ = 0;
 
-	return s;
+	return n;
 }
 
 bool
 ContactsCache::dirty() const
 {
-	return priv_->dirty_;
+	return priv_->dirty_ > 0 || priv_->pending_ > 0;
 }
 
-//const Contact
 void
-ContactsCache::add(Contact&& contact)
+ContactsCache::Private::merge(Contact&& contact, size_t adds)
 {
-	std::lock_guard<std::mutex> l_{priv_->mtx_};
+	mark_dirty(contact.email);
 
-	++priv_->dirty_;
+	auto it = contacts_.find(contact.email);
 
-	auto it = priv_->contacts_.find(contact.email);
+	if (it == contacts_.end()) { // completely new contact
 
-	if (it == priv_->contacts_.end()) { // completely new contact
-
-		contact.name         = contact.name;
 		if (!contact.personal)
 			contact.personal = is_personal(contact.email);
-		contact.tstamp       = g_get_monotonic_time();
+		contact.frequency += adds - 1;
 
 		auto email{contact.email};
-		// return priv_->contacts_.emplace(ContactUMap::value_type(email, std::move(contact)))
-		//     .first->second;
-
-		priv_->contacts_.emplace(ContactUMap::value_type(email, std::move(contact)));
+		const auto res{contacts_.emplace(
+				ContactUMap::value_type(email, std::move(contact)))};
+		mark_changed(res.first->second);
+		index_contact(res.first->second);
 
 	} else {	// existing contact.
 		auto& existing{it->second};
-		++existing.frequency;
+		existing.frequency += adds;
 		if (contact.message_date > existing.message_date) {	// update?
+			// when the name changes, so do the words in the index.
+			const auto reindex{!contact.name.empty() &&
+					   existing.name != contact.name};
+			const auto old_words{reindex ? completion_words(existing)
+						     : StringVec{}};
 			existing.email	      = std::move(contact.email);
 			// update name only if new one is not empty.
 			if (!contact.name.empty())
 				existing.name = std::move(contact.name);
-			existing.tstamp	      = g_get_monotonic_time();
 			existing.message_date = contact.message_date;
+			if (reindex)
+				reindex_contact(existing, old_words);
+		}
+		mark_changed(existing);
+	}
+}
+
+void
+ContactsCache::Private::merge_pending()
+{
+	// mtx_ must be locked.
+	if (pending_ == 0)
+		return;
+
+	for (auto&& acc : accumulators_) {
+		decltype(acc.items_) items;
+		{
+			std::lock_guard<std::mutex> l_{acc.mtx_};
+			std::swap(items, acc.items_);
+			acc.pos_.clear();
+		}
+		for (auto&& item : items) {
+			pending_ -= item.adds;
+			merge(std::move(item.contact), item.adds);
 		}
 	}
 }
 
+void
+ContactsCache::add(Contact&& contact)
+{
+	auto& acc{priv_->accumulators_[std::hash<std::thread::id>{}(
+			std::this_thread::get_id()) % NumAccumulators]};
+
+	std::lock_guard<std::mutex> l_{acc.mtx_};
+
+	const auto it = acc.pos_.find(contact.email);
+	if (it == acc.pos_.end()) {
+		acc.pos_.emplace(contact.email, acc.items_.size());
+		acc.items_.emplace_back(Accumulator::Item{std::move(contact), 1});
+	} else {
+		auto& item{acc.items_[it->second]};
+		auto& existing{item.contact};
+		++item.adds;
+		// same as in merge()
+		if (contact.message_date > existing.message_date) {
+			existing.email = std::move(contact.email);
+			if (!contact.name.empty())
+				existing.name = std::move(contact.name);
+			existing.message_date = contact.message_date;
+		}
+	}
+
+	++priv_->pending_;
+}
+
 const Contact*
 ContactsCache::_find(const std::string& email) const
 {
 	std::lock_guard<std::mutex> l_{priv_->mtx_};
+	priv_->merge_pending();
 
 	const auto it = priv_->contacts_.find(email);
 	if (it == priv_->contacts_.end())
@@ -236,15 +673,32 @@ ContactsCache::clear()
 {
 	std::lock_guard<std::mutex> l_{priv_->mtx_};
 
+	for (auto&& acc : priv_->accumulators_) {
+		std::lock_guard<std::mutex> al_{acc.mtx_};
+		acc.items_.clear();
+		acc.pos_.clear();
+	}
+	priv_->pending_ = 0;
+
 	++priv_->dirty_;
+	priv_->dirty_shards_.fill(true);
 
 	priv_->contacts_.clear();
+	priv_->index_.clear();
+	priv_->index_removed_.clear();
+	priv_->index_sorted_  = 0;
+	priv_->index_cleared_ = 0;
+	priv_->index_stale_   = false;
+
+	priv_->changes_.clear();
+	priv_->clear_seq_ = ++priv_->seq_;
 }
 
 std::size_t
 ContactsCache::size() const
 {
 	std::lock_guard<std::mutex> l_{priv_->mtx_};
+	priv_->merge_pending();
 
 	return priv_->contacts_.size();
 }
@@ -293,6 +747,7 @@ void
 ContactsCache::for_each(const EachContactFunc& each_contact) const
 {
 	std::lock_guard<std::mutex> l_{priv_->mtx_};
+	priv_->merge_pending();
 
 	if (!each_contact)
 		return; // nothing to do
@@ -306,20 +761,137 @@ ContactsCache::for_each(const EachContactFunc& each_contact) const
 		each_contact(ci);
 }
 
+int64_t
+ContactsCache::seq() const
+{
+	std::lock_guard<std::mutex> l_{priv_->mtx_};
+	priv_->merge_pending();
+
+	return priv_->seq_;
+}
+
 bool
-ContactsCache::is_personal(const std::string& addr) const
+ContactsCache::for_each_since(int64_t seq, const EachContactFunc& each_contact) const
+{
+	std::lock_guard<std::mutex> l_{priv_->mtx_};
+	priv_->merge_pending();
+
+	// we can't tell what changed since seq when it's from some other
+	// cache, or from before the last clear().
+	if (seq > priv_->seq_ || seq < priv_->clear_seq_)
+		return false;
+
+	for (auto it = priv_->changes_.upper_bound(seq); it != priv_->changes_.end(); ++it)
+		each_contact(*it->second);
+
+	return true;
+}
+
+int
+ContactsCache::relevance(const Contact& contact)
+{
+	// personal first; then a mix of how recently and how often we've seen
+	// the contact: every doubling of the frequency counts as much as being
+	// seen a month later. Unlike ContactLessThan, this does not depend on
+	// the current time, so the relevance of unchanged contacts is stable.
+	constexpr int PersonalBit{1 << 30}, Mask{PersonalBit - 1};
+	constexpr auto DaysPerDoubling{30};
+
+	const auto days{std::max<int64_t>(contact.message_date, 0) / (24 * 3600)};
+	const auto freq{static_cast<int64_t>(
+	    DaysPerDoubling * std::log2(1.0 + static_cast<double>(contact.frequency)))};
+
+	return (contact.personal ? PersonalBit : 0) |
+	       static_cast<int>(std::min<int64_t>(days + freq, Mask));
+}
+
+std::vector<Contact>
+ContactsCache::complete(const std::string& prefix, size_t maxnum,
+			const ContactFilterFunc& filter) const
 {
-	for (auto&& p : priv_->personal_plain_)
-		if (g_ascii_strcasecmp(addr.c_str(), p.c_str()) == 0)
-			return true;
+	std::lock_guard<std::mutex> l_{priv_->mtx_};
+
+	priv_->merge_pending();
+	priv_->update_index();
+
+	if (maxnum == 0)
+		maxnum = std::numeric_limits<size_t>::max();
+
+	// find all the contacts with some word starting with prefix, and keep
+	// the best maxnum of those in a (min) heap.
+	const auto           flat{utf8_flatten(prefix)};
+	const ContactLessThan less_than;
+	const auto heap_cmp = [&](const Contact* c1, const Contact* c2) {
+		return less_than(*c2, *c1);
+	};
+	std::vector<const Contact*>        heap;
+	std::unordered_set<const Contact*> seen;
+
+	auto it = std::lower_bound(priv_->index_.begin(), priv_->index_.end(),
+				   flat, [](auto&& entry, auto&& str) {
+					   return entry.first < str;
+				   });
+	for (; it != priv_->index_.end() &&
+		       it->first.compare(0, flat.size(), flat) == 0; ++it) {
+
+		const auto contact{it->second};
+		if (!contact)
+			continue; // cleared
+		if (!seen.emplace(contact).second)
+			continue; // already seen this one
+		if (filter && !filter(*contact))
+			continue;
 
-	for (auto&& rx : priv_->personal_rx_) {
-		std::smatch m; // perhaps cache addr in personal_plain_?
-		if (std::regex_match(addr, m, rx))
-			return true;
+		if (heap.size() < maxnum) {
+			heap.emplace_back(contact);
+			std::push_heap(heap.begin(), heap.end(), heap_cmp);
+		} else if (less_than(*heap.front(), *contact)) {
+			std::pop_heap(heap.begin(), heap.end(), heap_cmp);
+			heap.back() = contact;
+			std::push_heap(heap.begin(), heap.end(), heap_cmp);
+		}
 	}
 
-	return false;
+	// most relevant first.
+	std::sort_heap(heap.begin(), heap.end(), heap_cmp);
+
+	std::vector<Contact> contacts;
+	contacts.reserve(heap.size());
+	for (auto&& contact : heap)
+		contacts.emplace_back(*contact);
+
+	return contacts;
+}
+
+bool
+ContactsCache::Private::is_personal(const std::string& addr)
+{
+	const auto lower{ascii_lower(addr)};
+	if (personal_plain_.find(lower) != personal_plain_.end())
+		return true;
+	else if (personal_rx_.empty())
+		return false;
+
+	// the regular expressions are relatively expensive, so remember what
+	// they said for each address.
+	std::lock_guard<std::mutex> l_{personal_mtx_};
+	if (const auto it = personal_verdicts_.find(lower); it != personal_verdicts_.end())
+		return it->second;
+
+	const auto personal = std::any_of(personal_rx_.begin(), personal_rx_.end(),
+					  [&](auto&& rx) {
+						  std::smatch m;
+						  return std::regex_match(addr, m, rx);
+					  });
+	personal_verdicts_.emplace(lower, personal);
+
+	return personal;
+}
+
+bool
+ContactsCache::is_personal(const std::string& addr) const
+{
+	return priv_->is_personal(addr);
 }
 
 #ifdef BUILD_TESTS
@@ -447,6 +1019,305 @@ test_mu_contacts_cache_sort()
 	}
 }
 
+static void
+test_mu_contacts_cache_complete()
+{
+	const auto now{std::time({})};
+
+	Mu::ContactsCache ccache("");
+	ccache.add(Mu::Contact{"john.doe@example.com", "John Doe", now, true, 10, 0});
+	ccache.add(Mu::Contact{"jane@example.com", "Jane Jones", now, false, 5, 0});
+	ccache.add(Mu::Contact{"jo@example.com", "Jörg Müller", now - 1, true, 1, 0});
+	ccache.add(Mu::Contact{"bob@example.com", "Bob", now, false, 100, 0});
+
+	const auto users=[](const std::vector<Mu::Contact>& contacts) {
+		std::string str;
+		for (auto&& contact: contacts)
+			str += contact.email.substr(0, contact.email.find('@')) + " ";
+		return str;
+	};
+
+	assert_equal(users(ccache.complete("jo", 0)), "john.doe jo jane ");
+	assert_equal(users(ccache.complete("JO", 2)), "john.doe jo ");
+	assert_equal(users(ccache.complete("mull", 0)), "jo ");
+	assert_equal(users(ccache.complete("example", 1)), "john.doe ");
+	assert_equal(users(ccache.complete("doe@", 0)), "");
+	assert_equal(users(ccache.complete("john.doe@", 0)), "john.doe ");
+	g_assert_true(ccache.complete("xyz", 0).empty());
+
+	assert_equal(users(ccache.complete("jo", 0, [](auto&& contact) {
+		return !contact.personal; })), "jane ");
+
+	// the index gets updated.
+	ccache.add(Mu::Contact{"bob@example.com", "Robert Bobson", now + 1, false, 100, 0});
+	ccache.add(Mu::Contact{"joe@example.com", "", now, false, 1, 0});
+	assert_equal(users(ccache.complete("rob", 0)), "bob ");
+	g_assert_cmpuint(ccache.complete("jo", 0).size(), ==, 4);
+
+	// ... also for the words that are gone.
+	ccache.add(Mu::Contact{"jane@example.com", "Jane Smith", now + 1, false, 5, 0});
+	assert_equal(users(ccache.complete("jones", 0)), "");
+	assert_equal(users(ccache.complete("smi", 0)), "jane ");
+	assert_equal(users(ccache.complete("jane", 0)), "jane ");
+	ccache.add(Mu::Contact{"jane@example.com", "Jane Doe", now + 2, false, 5, 0});
+	ccache.add(Mu::Contact{"jane@example.com", "Jane Jones", now + 3, false, 5, 0});
+	assert_equal(users(ccache.complete("smi", 0)), "");
+	assert_equal(users(ccache.complete("doe", 0)), "john.doe ");
+	assert_equal(users(ccache.complete("jones", 0)), "jane ");
+
+	ccache.clear();
+	g_assert_true(ccache.complete("", 0).empty());
+}
+
+using Storage = std::unordered_map<std::string, std::string>;
+
+static size_t
+save_to(Storage& storage, const Mu::ContactsCache& ccache)
+{
+	return ccache.serialize([&](auto&& key, auto&& val) {
+		if (val.empty())
+			storage.erase(key);
+		else
+			storage[key] = val;
+	});
+}
+
+static Mu::ContactsCache::LoadFunc
+load_from(const Storage& storage)
+{
+	return [&](const std::string& key) -> std::string {
+		const auto it = storage.find(key);
+		return it == storage.end() ? "" : it->second;
+	};
+}
+
+static void
+test_mu_contacts_cache_serialize()
+{
+	Storage storage;
+	{
+		Mu::ContactsCache ccache("");
+		ccache.add(Mu::Contact{"a@example.com", "Aa", 12345, true, 10, 0});
+		ccache.add(Mu::Contact{"b@example.com", "", -100, false, 1, 0});
+		ccache.add(Mu::Contact{"c@example.com", "Cc Cuux", 0, false, 7, 0});
+		g_assert_cmpuint(ccache.dirty(), >, 0);
+		g_assert_cmpuint(save_to(storage, ccache), >=, 2);
+		g_assert_cmpuint(ccache.dirty(), ==, 0);
+		// nothing changed; so nothing to write.
+		g_assert_cmpuint(save_to(storage, ccache), ==, 0);
+		// one change; one shard + the version + the sequence number.
+		ccache.add(Mu::Contact{"a@example.com", "Aa", 12346, true, 1, 0});
+		g_assert_cmpuint(save_to(storage, ccache), ==, 3);
+	}
+
+	Mu::ContactsCache ccache(load_from(storage));
+	g_assert_cmpuint(ccache.size(), ==, 3);
+	g_assert_cmpuint(ccache.dirty(), ==, 0);
+
+	const auto a = ccache._find("A@example.com");
+	g_assert_true(!!a);
+	assert_equal(a->name, "Aa");
+	g_assert_cmpint(a->message_date, ==, 12346);
+	g_assert_true(a->personal);
+	g_assert_cmpuint(a->frequency, ==, 11);
+
+	const auto b = ccache._find("b@example.com");
+	g_assert_true(!!b);
+	g_assert_cmpint(b->message_date, ==, -100);
+	g_assert_false(b->personal);
+
+	const auto c = ccache._find("c@example.com");
+	g_assert_true(!!c);
+	assert_equal(c->name, "Cc Cuux");
+	g_assert_cmpuint(c->frequency, ==, 7);
+
+	// corrupt data should not crash us.
+	for (auto&& item: storage)
+		if (item.first != "contacts-version" && item.first != "contacts-seq")
+			item.second.resize(item.second.size() - 1);
+	Mu::ContactsCache ccache2(load_from(storage));
+	g_assert_cmpuint(ccache2.size(), <, 3);
+}
+
+static void
+test_mu_contacts_cache_migrate()
+{
+	Storage storage;
+	storage["contacts"] =
+		"Foo <foo@example.com>\xff" "foo@example.com\xff" "Foo\xff" "1\xff" "1234\xff" "5\n"
+		"bar@example.com\xff" "bar@example.com\xff" "\xff" "0\xff" "4321\xff" "2\n";
+
+	{
+		Mu::ContactsCache ccache(load_from(storage));
+		g_assert_cmpuint(ccache.size(), ==, 2);
+		g_assert_cmpuint(ccache.dirty(), >, 0);
+		save_to(storage, ccache);
+		g_assert_true(storage.find("contacts") == storage.end());
+		g_assert_true(storage.find("contacts-version") != storage.end());
+	}
+
+	Mu::ContactsCache ccache(load_from(storage));
+	g_assert_cmpuint(ccache.size(), ==, 2);
+	const auto foo = ccache._find("foo@example.com");
+	g_assert_true(!!foo);
+	assert_equal(foo->name, "Foo");
+	g_assert_true(foo->personal);
+	g_assert_cmpint(foo->message_date, ==, 1234);
+	g_assert_cmpuint(foo->frequency, ==, 5);
+}
+
+static void
+test_mu_contacts_cache_changes()
+{
+	Mu::ContactsCache ccache("");
+	g_assert_cmpint(ccache.seq(), ==, 0);
+
+	const auto changes = [&](int64_t seq) {
+		std::string str;
+		if (!ccache.for_each_since(seq, [&](auto&& contact) {
+			str += contact.email.substr(0, 1);
+		}))
+			return std::string{"<full>"};
+		return str;
+	};
+
+	ccache.add(Mu::Contact{"a@example.com", "a", 1000, false, 1, 0});
+	ccache.add(Mu::Contact{"b@example.com", "b", 1000, false, 1, 0});
+	ccache.add(Mu::Contact{"c@example.com", "c", 1000, false, 1, 0});
+	const auto seq1{ccache.seq()};
+	g_assert_cmpint(seq1, ==, 3);
+
+	assert_equal(changes(0), "abc");
+	assert_equal(changes(1), "bc");
+	assert_equal(changes(seq1), "");
+	assert_equal(changes(seq1 + 1), "<full>");
+
+	// an existing contact changes; it moves to the end.
+	ccache.add(Mu::Contact{"A@example.com", "a", 2000, false, 1, 0});
+	assert_equal(changes(0), "bcA");
+	assert_equal(changes(seq1), "A");
+
+	// ranks are stable
+	const auto b{ccache._find("b@example.com")};
+	const auto rel{Mu::ContactsCache::relevance(*b)};
+	ccache.add(Mu::Contact{"d@example.com", "d", 3000, true, 1, 0});
+	g_assert_cmpint(Mu::ContactsCache::relevance(*b), ==, rel);
+	g_assert_cmpint(Mu::ContactsCache::relevance(*ccache._find("d@example.com")), >, rel);
+
+	// it only depends on the contact: more recent or more frequent is
+	// more relevant.
+	const auto relevance = [](time_t date, size_t freq) {
+		return Mu::ContactsCache::relevance(
+		    Mu::Contact{"e@example.com", "e", date, false, freq, 0});
+	};
+	g_assert_cmpint(relevance(100 * 24 * 3600, 1), >, relevance(10 * 24 * 3600, 1));
+	g_assert_cmpint(relevance(10 * 24 * 3600, 8), >, relevance(10 * 24 * 3600, 1));
+
+	// the sequence numbers are persisted.
+	Storage storage;
+	save_to(storage, ccache);
+	Mu::ContactsCache ccache2(load_from(storage));
+	g_assert_cmpint(ccache2.seq(), ==, ccache.seq());
+	std::string str;
+	g_assert_true(ccache2.for_each_since(seq1, [&](auto&& contact) {
+		str += contact.email.substr(0, 1);
+	}));
+	assert_equal(str, "Ad");
+
+	// after clearing, we can't tell anymore.
+	const auto seq2{ccache.seq()};
+	ccache.clear();
+	assert_equal(changes(seq2), "<full>");
+	ccache.add(Mu::Contact{"e@example.com", "e", 1000, false, 1, 0});
+	assert_equal(changes(ccache.seq() - 1), "e");
+}
+
+static void
+test_mu_contacts_cache_perf()
+{
+	for (auto&& n: {10000, 100000, 1000000}) {
+		Storage           storage;
+		Mu::ContactsCache ccache("");
+		for (auto i = 0; i != n; ++i)
+			ccache.add(Mu::Contact{Mu::format("user%d@example%d.com", i, i % 97),
+					       Mu::format("User %d", i), i, false, 1, 0});
+		g_test_timer_start();
+		save_to(storage, ccache);
+		const auto full{g_test_timer_elapsed()};
+
+		ccache.add(Mu::Contact{"someone@example.com", "Some One", n, false, 1, 0});
+		g_test_timer_start();
+		save_to(storage, ccache);
+		const auto incremental{g_test_timer_elapsed()};
+
+		g_test_timer_start();
+		Mu::ContactsCache ccache2(load_from(storage));
+		const auto load{g_test_timer_elapsed()};
+		g_assert_cmpuint(ccache2.size(), ==, n + 1);
+
+		g_test_message("%d contacts: save %.3fs; incremental save %.3fs; load %.3fs",
+			       n, full, incremental, load);
+	}
+}
+
+static void
+add_contacts_threaded(Mu::ContactsCache& ccache, size_t threads, size_t n)
+{
+	std::vector<std::thread> workers;
+	for (auto t = 0U; t != threads; ++t)
+		workers.emplace_back([&, t] {
+			for (auto i = 0U; i != n; ++i)
+				ccache.add(Mu::Contact{
+					Mu::format("user%u@example%u.com", i % 1000, t % 2),
+					Mu::format("User %u", i), static_cast<time_t>(i),
+					false, 1, 0});
+		});
+	for (auto&& worker : workers)
+		worker.join();
+}
+
+static void
+test_mu_contacts_cache_threads()
+{
+	Mu::StringVec     personal = {"/user1.*@example0.com/"};
+	Mu::ContactsCache ccache{"", personal};
+
+	add_contacts_threaded(ccache, 4, 5000);
+	g_assert_true(ccache.dirty());
+	g_assert_cmpuint(ccache.size(), ==, 2000);
+
+	size_t freq{};
+	ccache.for_each([&](auto&& contact) { freq += contact.frequency; });
+	g_assert_cmpuint(freq, ==, 4 * 5000);
+
+	const auto c1{ccache._find("user123@example0.com")};
+	g_assert_true(!!c1);
+	g_assert_true(c1->personal);
+	g_assert_cmpint(c1->message_date, ==, 4123);
+	g_assert_cmpuint(c1->frequency, ==, 10);
+	g_assert_false(ccache._find("user123@example1.com")->personal);
+	g_assert_false(ccache._find("user23@example0.com")->personal);
+}
+
+static void
+test_mu_contacts_cache_add_perf()
+{
+	constexpr size_t n{200000};
+	for (auto&& threads : {1, 4, 16}) {
+		Mu::StringVec     personal = {"/.*@example1.com/", "foo@example.com"};
+		Mu::ContactsCache ccache{"", personal};
+
+		g_test_timer_start();
+		add_contacts_threaded(ccache, threads, n);
+		const auto added{g_test_timer_elapsed()};
+		g_test_timer_start();
+		g_assert_cmpuint(ccache.size(), >, 0); /* merges */
+		const auto merged{g_test_timer_elapsed()};
+
+		g_test_message("%d thread(s): %.0f adds/s; merge %.3fs",
+			       threads, threads * n / added, merged);
+	}
+}
 
 int
 main(int argc, char* argv[])
@@ -456,6 +1327,15 @@ main(int argc, char* argv[])
 	g_test_add_func("/lib/contacts-cache/base", test_mu_contacts_cache_base);
 	g_test_add_func("/lib/contacts-cache/personal", test_mu_contacts_cache_personal);
 	g_test_add_func("/lib/contacts-cache/sort", test_mu_contacts_cache_sort);
+	g_test_add_func("/lib/contacts-cache/complete", test_mu_contacts_cache_complete);
+	g_test_add_func("/lib/contacts-cache/serialize", test_mu_contacts_cache_serialize);
+	g_test_add_func("/lib/contacts-cache/migrate", test_mu_contacts_cache_migrate);
+	g_test_add_func("/lib/contacts-cache/changes", test_mu_contacts_cache_changes);
+	g_test_add_func("/lib/contacts-cache/threads", test_mu_contacts_cache_threads);
+	if (g_test_perf()) {
+		g_test_add_func("/lib/contacts-cache/perf", test_mu_contacts_cache_perf);
+		g_test_add_func("/lib/contacts-cache/add-perf", test_mu_contacts_cache_add_perf);
+	}
 
 	g_log_set_handler(
 	    NULL,
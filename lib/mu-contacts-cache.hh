@@ -26,6 +26,7 @@
 #include <functional>
 #include <chrono>
 #include <string>
+#include <vector>
 #include <time.h>
 #include <inttypes.h>
 #include <utils/mu-utils.hh>
@@ -39,11 +40,41 @@ public:
 	/**
 	 * Construct a new ContactsCache object
 	 *
-	 * @param serialized serialized contacts
+	 * @param serialized serialized contacts, in the (old) text format
 	 * @param personal personal addresses
 	 */
 	ContactsCache(const std::string& serialized = "", const StringVec& personal = {});
 
+	/**
+	 * Prototype for a function to get the value for some key from
+	 * persistent storage (such as the store's metadata).
+	 *
+	 * @param key the key
+	 *
+	 * @return the value, or empty if not found.
+	 */
+	using LoadFunc = std::function<std::string(const std::string& key)>;
+
+	/**
+	 * Prototype for a function to write a value for some key to persistent
+	 * storage. An empty value means the key should be removed.
+	 *
+	 * @param key the key
+	 * @param val the value
+	 */
+	using SaveFunc = std::function<void(const std::string& key, const std::string& val)>;
+
+	/**
+	 * Construct a new ContactsCache object from the contacts in persistent
+	 * storage, as written by serialize(const SaveFunc&). If the storage
+	 * only has contacts in the old text format, those are used instead, and
+	 * they are converted at the next serialize().
+	 *
+	 * @param load function to load data from storage
+	 * @param personal personal addresses
+	 */
+	ContactsCache(const LoadFunc& load, const StringVec& personal = {});
+
 	/**
 	 * DTOR
 	 *
@@ -92,12 +123,16 @@ public:
 	bool empty() const { return size() == 0; }
 
 	/**
-	 * Get the contacts, serialized. This all marks the data as
-	 * non-dirty (see dirty())
+	 * Write the contacts that changed since the last call to serialize()
+	 * to persistent storage, in a compact binary format. The contacts are
+	 * divided over a number of shards, and only the shards with changes
+	 * are written. This marks the data as non-dirty (see dirty())
 	 *
-	 * @return serialized contacts
+	 * @param save function to save data to storage
+	 *
+	 * @return the number of keys written
 	 */
-	std::string serialize() const;
+	size_t serialize(const SaveFunc& save) const;
 
 	/**
 	 * Has the contacts database change since the last
@@ -140,6 +175,67 @@ public:
 	 */
 	void for_each(const EachContactFunc& each_contact) const;
 
+	/**
+	 * Get the current change-sequence number. Each change to a contact
+	 * gives it a new, higher sequence number (in its tstamp), which is
+	 * persisted with the contacts.
+	 *
+	 * @return the sequence number
+	 */
+	int64_t seq() const;
+
+	/**
+	 * Invoke some callable for each contact that changed after sequence
+	 * number seq, in order of change. This takes time proportional to the
+	 * number of changes, not the number of contacts.
+	 *
+	 * @param seq a sequence number, as returned by seq()
+	 * @param each_contact
+	 *
+	 * @return true if that worked; false if we cannot tell what changed
+	 * since seq (e.g. when it is from before a clear()), in which case
+	 * each_contact is not invoked, and the caller should use for_each().
+	 */
+	bool for_each_since(int64_t seq, const EachContactFunc& each_contact) const;
+
+	/**
+	 * Get a number for the relevance of some contact; a higher number means
+	 * more relevant, roughly as in the order of for_each(). Unlike the
+	 * position in for_each(), this only depends on the contact itself, so
+	 * it does not change unless the contact does.
+	 *
+	 * @param contact some contact
+	 *
+	 * @return the relevance
+	 */
+	static int relevance(const Contact& contact);
+
+	/**
+	 * Prototype for a callable that decides whether some contact is
+	 * acceptable.
+	 *
+	 * @param contact some contact
+	 *
+	 * @return true or false
+	 */
+	using ContactFilterFunc = std::function<bool(const Contact& contact_info)>;
+
+	/**
+	 * Get the most relevant contacts where some word in the name or e-mail
+	 * address starts with the given prefix, ignoring case and accents.
+	 *
+	 * This uses an index which is updated incrementally, so it's much
+	 * faster than going through all contacts with for_each().
+	 *
+	 * @param prefix the prefix; if empty, all contacts match
+	 * @param maxnum maximum number of contacts to return, or 0 for no limit
+	 * @param filter optional filter for the contacts
+	 *
+	 * @return the matching contacts, most relevant first.
+	 */
+	std::vector<Contact> complete(const std::string& prefix, size_t maxnum,
+				      const ContactFilterFunc& filter = {}) const;
+
 private:
 	struct Private;
 	std::unique_ptr<Private> priv_;
@@ -334,6 +334,16 @@ Mu::mu_maildir_flags_from_path(const std::string& path)
 }
 
 
+std::string
+Mu::mu_maildir_base_name(const std::string& path)
+{
+	char *basename{g_path_get_basename(path.c_str())};
+	auto parts{message_file_parts(basename)};
+	g_free(basename);
+
+	return std::move(parts.base);
+}
+
 static size_t
 get_file_size(const std::string& path)
 {
@@ -83,6 +83,19 @@ Result<void> mu_maildir_clear_links(const std::string& dir);
  */
 Result<Flags> mu_maildir_flags_from_path(const std::string& pathname);
 
+/**
+ * Get the base name for a message file, i.e., its file name without the
+ * directory and without the flags-suffix (such as ":2,RS"). The base name
+ * stays the same when a message moves from new/ to cur/ or when its flags
+ * change.
+ *
+ * @param path path for some message; it does not have to refer to an actual
+ * message
+ *
+ * @return the base name
+ */
+std::string mu_maildir_base_name(const std::string& path);
+
 /**
  * get the maildir for a certain message path, ie, the path *before*
  * cur/ or new/
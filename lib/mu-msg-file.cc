@@ -21,6 +21,8 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -116,23 +118,30 @@ init_file_metadata(MuMsgFile* self, const char* path, const gchar* mdir, GError*
 }
 
 static char*
-calculate_sha1(FILE* file)
+calculate_sha1(GMimeStream* stream, size_t& bytes_read)
 {
-	std::array<uint8_t, 4096> buf{};
-	char*                     sha1{};
-	GChecksum*                checksum{g_checksum_new(G_CHECKSUM_SHA256)};
-
-	while (true) {
-		const auto n = ::fread(buf.data(), 1, buf.size(), file);
-		if (n == 0)
-			break;
-		g_checksum_update(checksum, buf.data(), n);
-	}
-
-	if (::ferror(file))
-		g_warning("error reading file");
-	else
+	char*      sha1{};
+	GChecksum* checksum{g_checksum_new(G_CHECKSUM_SHA256)};
+
+	if (GMIME_IS_STREAM_MMAP(stream)) {
+		// we already have the whole message in memory.
+		const auto mstream{GMIME_STREAM_MMAP(stream)};
+		g_checksum_update(checksum, reinterpret_cast<guchar*>(mstream->map),
+				  static_cast<gssize>(mstream->maplen));
 		sha1 = g_strdup(g_checksum_get_string(checksum));
+	} else if (g_mime_stream_reset(stream) == 0) {
+		std::array<char, 4096> buf{};
+		ssize_t                n{};
+		while ((n = g_mime_stream_read(stream, buf.data(), buf.size())) > 0) {
+			g_checksum_update(checksum, reinterpret_cast<guchar*>(buf.data()),
+					  static_cast<gssize>(n));
+			bytes_read += static_cast<size_t>(n);
+		}
+		if (n < 0)
+			g_warning("error reading file");
+		else
+			sha1 = g_strdup(g_checksum_get_string(checksum));
+	}
 
 	g_checksum_free(checksum);
 
@@ -142,11 +151,10 @@ calculate_sha1(FILE* file)
 static GMimeStream*
 get_mime_stream(MuMsgFile* self, const char* path, GError** err)
 {
-	FILE*        file;
-	GMimeStream* stream;
+	GMimeStream* stream{};
 
-	file = fopen(path, "r");
-	if (!file) {
+	const auto fd{::open(path, O_RDONLY | O_CLOEXEC)};
+	if (fd < 0) {
 		g_set_error(err,
 			    MU_ERROR_DOMAIN,
 			    MU_ERROR_FILE,
@@ -156,25 +164,20 @@ get_mime_stream(MuMsgFile* self, const char* path, GError** err)
 		return NULL;
 	}
 
-	stream = g_mime_stream_file_new(file);
+	// map the message into memory, so both the parser and the checksum
+	// (if needed) can use it without copying or reading the file again.
+	// mmap does not work for empty files.
+	if (self->_size > 0)
+		stream = g_mime_stream_mmap_new(fd, PROT_READ, MAP_PRIVATE);
+	if (!stream)
+		stream = g_mime_stream_fs_new(fd);
 	if (!stream) {
 		g_set_error(err,
 			    MU_ERROR_DOMAIN,
 			    MU_ERROR_GMIME,
 			    "cannot create mime stream for %s",
 			    path);
-		fclose(file);
-		return NULL;
-	}
-
-	self->_sha1 = calculate_sha1(file);
-	if (!self->_sha1) {
-		::fclose(file);
-		g_set_error(err,
-			    MU_ERROR_DOMAIN,
-			    MU_ERROR_FILE,
-			    "failed to get sha-1 for %s",
-			    path);
+		::close(fd);
 		return NULL;
 	}
 
@@ -192,8 +195,8 @@ init_mime_msg(MuMsgFile* self, const char* path, GError** err)
 		return FALSE;
 
 	parser = g_mime_parser_new_with_stream(stream);
-	g_object_unref(stream);
 	if (!parser) {
+		g_object_unref(stream);
 		g_set_error(err,
 			    MU_ERROR_DOMAIN,
 			    MU_ERROR_GMIME,
@@ -204,7 +207,17 @@ init_mime_msg(MuMsgFile* self, const char* path, GError** err)
 
 	self->_mime_msg = g_mime_parser_construct_message(parser, NULL);
 	g_object_unref(parser);
+
+	// what the parser got from disk: all of the mapped message, or as
+	// far as it read in the file.
+	if (GMIME_IS_STREAM_MMAP(stream))
+		self->_bytes_read = GMIME_STREAM_MMAP(stream)->maplen;
+	else {
+		const auto pos{g_mime_stream_tell(stream)};
+		self->_bytes_read = pos > 0 ? static_cast<size_t>(pos) : 0;
+	}
 	if (!self->_mime_msg) {
+		g_object_unref(stream);
 		g_set_error(err,
 			    MU_ERROR_DOMAIN,
 			    MU_ERROR_GMIME,
@@ -213,6 +226,23 @@ init_mime_msg(MuMsgFile* self, const char* path, GError** err)
 		return FALSE;
 	}
 
+	// the checksum is only needed when we need to synthesize a message-id
+	// (see get_msgid())
+	const char* msgid{g_mime_message_get_message_id(self->_mime_msg)};
+	const auto  need_sha1{!msgid || strlen(msgid) >= Store::MaxTermLength};
+	if (need_sha1)
+		self->_sha1 = calculate_sha1(stream, self->_bytes_read);
+	g_object_unref(stream);
+
+	if (need_sha1 && !self->_sha1) {
+		g_set_error(err,
+			    MU_ERROR_DOMAIN,
+			    MU_ERROR_FILE,
+			    "failed to get sha-1 for %s",
+			    path);
+		return FALSE;
+	}
+
 	return TRUE;
 }
 
@@ -37,6 +37,7 @@ struct MuMsgFile {
 	char*         _path;
 	char*         _maildir;
 	char*         _sha1;
+	size_t        _bytes_read; /* bytes read (or mapped) from disk, for statistics */
 };
 
 /* we put the the MuMsg definition in this separate -priv file, so we
@@ -435,6 +435,13 @@ Mu::mu_msg_get_size(MuMsg* self)
 	return (size_t)get_num_field(self, Field::Id::Size);
 }
 
+size_t
+Mu::mu_msg_get_bytes_read(MuMsg* self)
+{
+	g_return_val_if_fail(self, 0);
+	return self->_file ? self->_file->_bytes_read : 0;
+}
+
 Mu::Priority
 Mu::mu_msg_get_prio(MuMsg* self)
 {
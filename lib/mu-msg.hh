@@ -309,6 +309,16 @@ Flags mu_msg_get_flags(MuMsg* msg);
  */
 size_t mu_msg_get_size(MuMsg* msg);
 
+/**
+ * get the number of bytes read (or memory-mapped) from disk for creating
+ * this message; this is 0 for messages that did not come from a file.
+ *
+ * @param msg a valid MuMsg* instance
+ *
+ * @return the number of bytes
+ */
+size_t mu_msg_get_bytes_read(MuMsg* msg);
+
 /**
  * get some field value as string
  *
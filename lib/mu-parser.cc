@@ -59,7 +59,7 @@ struct FieldInfo {
 };
 using FieldInfoVec = std::vector<FieldInfo>;
 struct Parser::Private {
-	Private(const Store& store, Parser::Flags flags) : store_{store}, flags_{flags} {}
+	Private(const Xapian::Database& db, Parser::Flags flags) : db_{db}, flags_{flags} {}
 
 	std::vector<std::string> process_regex(const std::string& field,
 					       const std::regex&  rx) const;
@@ -85,8 +85,8 @@ struct Parser::Private {
 		       WarningVec&         warnings) const;
 
       private:
-	const Store& store_;
-	const Parser::Flags  flags_;
+	const Xapian::Database& db_;
+	const Parser::Flags     flags_;
 };
 
 static std::string
@@ -196,11 +196,11 @@ Parser::Private::process_regex(const std::string& field_str,
 
 	const auto prefix{field_opt->xapian_term()};
 	std::vector<std::string> terms;
-	store_.for_each_term(field_opt->id, [&](auto&& str) {
+	for (auto it = db_.allterms_begin(prefix); it != db_.allterms_end(prefix); ++it) {
+		const auto& str{*it};
 		if (std::regex_search(str.c_str() + 1, rx)) // avoid copy
 			terms.emplace_back(str);
-		return true;
-	});
+	}
 
 	return terms;
 }
@@ -487,7 +487,12 @@ Parser::Private::term_1(Mu::Tokens& tokens, WarningVec& warnings) const
 }
 
 Mu::Parser::Parser(const Store& store, Parser::Flags flags) :
-	priv_{std::make_unique<Private>(store, flags)}
+	priv_{std::make_unique<Private>(store.database(), flags)}
+{
+}
+
+Mu::Parser::Parser(const Xapian::Database& db, Parser::Flags flags) :
+	priv_{std::make_unique<Private>(db, flags)}
 {
 }
 
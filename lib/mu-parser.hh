@@ -78,6 +78,14 @@ class Parser {
 	 * @param store a store object ptr, or none
 	 */
 	Parser(const Store& store, Flags = Flags::None);
+
+	/**
+	 * Construct a query parser object for some specific database, such
+	 * as a snapshot of the store (see Store::snapshot()).
+	 *
+	 * @param db the database to use for expanding regular expressions
+	 */
+	Parser(const Xapian::Database& db, Flags = Flags::None);
 	/**
 	 * DTOR
 	 *
@@ -54,12 +54,36 @@ struct MatchDecider : public Xapian::MatchDecider {
 			qm.flags |= QueryMatch::Flags::Duplicate;
 
 		const auto path{opt_string(doc, Field::Id::Path)};
-		if (!path || ::access(path->c_str(), R_OK) != 0)
+		if (!path || !is_readable(*path))
 			qm.flags |= QueryMatch::Flags::Unreadable;
 
 		return qm;
 	}
 
+	/**
+	 * Is the message file readable? If we have a tracker (which is
+	 * tracking), ask it; otherwise, with LazyUnreadable, assume it is, and
+	 * leave the checking for the results; otherwise, check the
+	 * file-system.
+	 *
+	 * @param path path to the message file
+	 *
+	 * @return true or false
+	 */
+	bool is_readable(const std::string& path) const
+	{
+		if (decider_info_.readability) {
+			if (const auto readable{decider_info_.readability->is_readable(path)};
+			    readable)
+				return *readable;
+		}
+
+		if (any_of(qflags_ & QueryFlags::LazyUnreadable))
+			return true;
+
+		return ::access(path.c_str(), R_OK) == 0;
+	}
+
 	/**
 	 * Should this message be included in the results?
 	 *
@@ -175,6 +199,8 @@ struct MatchDeciderRelated final : public MatchDecider {
 	 */
 	bool operator()(const Xapian::Document& doc) const override
 	{
+		++decider_info_.related_examined;
+
 		// we may have seen this match in the "Leader" query.
 		const auto it = decider_info_.matches.find(doc.get_docid());
 		if (it != decider_info_.matches.end())
@@ -195,32 +221,3 @@ Mu::make_related_decider(QueryFlags qflags, DeciderInfo& info)
 {
 	return std::make_unique<MatchDeciderRelated>(qflags, info);
 }
-
-struct MatchDeciderThread final : public MatchDecider {
-	MatchDeciderThread(QueryFlags qflags, DeciderInfo& info) : MatchDecider{qflags, info} {}
-	/**
-	 * operator()
-	 *
-	 * This receives the documents considered during a Xapian query, and
-	 * is to return either true (keep) or false (ignore)
-	 *
-	 * Only include documents that earlier checks have decided to include.
-	 *
-	 * @param doc xapian document
-	 *
-	 * @return true or false
-	 */
-	bool operator()(const Xapian::Document& doc) const override
-	{
-		// we may have seen this match in the "Leader" query,
-		// or in the second (unbuounded) related query;
-		const auto it{decider_info_.matches.find(doc.get_docid())};
-		return it != decider_info_.matches.end() && !it->second.thread_path.empty();
-	}
-};
-
-std::unique_ptr<Xapian::MatchDecider>
-Mu::make_thread_decider(QueryFlags qflags, DeciderInfo& info)
-{
-	return std::make_unique<MatchDeciderThread>(qflags, info);
-}
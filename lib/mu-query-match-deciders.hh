@@ -27,6 +27,7 @@
 #include <xapian.h>
 
 #include "mu-query-results.hh"
+#include "mu-readability-tracker.hh"
 
 namespace Mu {
 using StringSet = std::unordered_set<std::string>;
@@ -35,6 +36,8 @@ struct DeciderInfo {
 	QueryMatches matches;
 	StringSet    thread_ids;
 	StringSet    message_ids;
+	size_t       related_examined{}; /**< documents seen by the related decider */
+	const ReadabilityTracker* readability{}; /**< if set, use instead of the file-system */
 };
 
 /**
@@ -60,17 +63,6 @@ std::unique_ptr<Xapian::MatchDecider> make_leader_decider(QueryFlags qflags, Dec
  */
 std::unique_ptr<Xapian::MatchDecider> make_related_decider(QueryFlags qflags, DeciderInfo& info);
 
-/**
- * Make a "thread" decider, that is, a MatchDecider that removes all but the
- * document excepts for the ones found during initial/related searches.
- *
- * @param qflags     query flags
- * @param match_info receives information about the matches.
- *
- * @return a unique_ptr to a match decider.
- */
-std::unique_ptr<Xapian::MatchDecider> make_thread_decider(QueryFlags qflags, DeciderInfo& info);
-
 } // namespace Mu
 
 #endif /* MU_QUERY_MATCH_DECIDERS_HH__ */
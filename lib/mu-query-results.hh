@@ -22,9 +22,11 @@
 
 #include <algorithm>
 #include <limits>
+#include <numeric>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <limits>
 #include <ostream>
 #include <cmath>
@@ -57,8 +59,9 @@ enum struct QueryFlags {
 	SkipDuplicates = 1 << 2, /**< skip duplicate msgs */
 	IncludeRelated = 1 << 3, /**< include related msgs */
 	Threading      = 1 << 4, /**< calculate threading info */
+	LazyUnreadable = 1 << 5, /**< only check the results for unreadable msgs */
 	// internal
-	Leader = 1 << 5, /**< This is the leader query (for internal use
+	Leader = 1 << 6, /**< This is the leader query (for internal use
 			  * only)*/
 };
 MU_ENABLE_BITOPS(QueryFlags);
@@ -150,6 +153,14 @@ operator<<(std::ostream& os, const QueryMatch& qmatch)
 	return os;
 }
 
+/// The order of query results, as positions in the Xapian::MSet
+using QueryOrder = std::vector<size_t>;
+
+/// Statistics about running a query
+struct QueryStats {
+	size_t related_examined{}; /**< Number of related documents examined */
+};
+
 ///
 /// This is a view over the Xapian::MSet, which can optionally filter unreadable
 /// / duplicate messages.
@@ -169,6 +180,23 @@ public:
 	    : mset_it_{mset_it}, query_matches_{query_matches}
 	{
 	}
+	/**
+	 * Construct an iterator over the MSet, in the given order
+	 *
+	 * @param mset the MSet
+	 * @param order_it the iterator to the current position in the order
+	 * @param order_end the end of the order
+	 * @param query_matches the query-matches
+	 */
+	QueryResultsIterator(const Xapian::MSet&        mset,
+			     QueryOrder::const_iterator order_it,
+			     QueryOrder::const_iterator order_end,
+			     QueryMatches&              query_matches)
+	    : mset_{&mset}, order_it_{order_it}, order_end_{order_end},
+	      query_matches_{query_matches}
+	{
+		update_mset_it();
+	}
 	~QueryResultsIterator() { g_clear_pointer(&msg_, mu_msg_unref); }
 
 	/**
@@ -178,7 +206,11 @@ public:
 	 */
 	QueryResultsIterator& operator++()
 	{
-		++mset_it_;
+		if (mset_) {
+			++order_it_;
+			update_mset_it();
+		} else
+			++mset_it_;
 		return *this;
 	}
 
@@ -233,6 +265,17 @@ public:
 		return opt_string(Field::Id::ThreadId);
 	}
 
+	/**
+	 * Get the thread-path (as determined by the store) for the document
+	 * (message) this iterator is pointing at, or Nothing.
+	 *
+	 * @return a thread-path
+	 */
+	Option<std::string> thread_path() const noexcept
+	{
+		return opt_string(Field::Id::ThreadPath);
+	}
+
 	/**
 	 * Get the file-system path for the document (message) this iterator is
 	 * pointing at, or Nothing.
@@ -331,9 +374,18 @@ public:
 	}
 
 private:
-	Xapian::MSetIterator mset_it_;
-	QueryMatches&        query_matches_;
-	MuMsg*               msg_{};
+	void update_mset_it()
+	{
+		mset_it_ = order_it_ == order_end_
+			       ? mset_->end()
+			       : (*mset_)[static_cast<Xapian::doccount>(*order_it_)];
+	}
+
+	Xapian::MSetIterator       mset_it_;
+	const Xapian::MSet*        mset_{}; // only when ordered
+	QueryOrder::const_iterator order_it_, order_end_;
+	QueryMatches&              query_matches_;
+	MuMsg*                     msg_{};
 };
 
 constexpr auto MaxQueryResultsSize = std::numeric_limits<size_t>::max();
@@ -353,35 +405,60 @@ public:
 	    : mset_{mset}, query_matches_{std::move(query_matches)}
 	{
 	}
+	/**
+	 * Construct a QueryResults object with (some of) the matches in the
+	 * MSet, in the given order.
+	 *
+	 * @param mset an Xapian::MSet with matches
+	 * @param query_matches the query-matches
+	 * @param order the positions of the matches to include, in order
+	 */
+	QueryResults(const Xapian::MSet& mset, QueryMatches&& query_matches, QueryOrder&& order)
+	    : mset_{mset}, query_matches_{std::move(query_matches)}, order_{std::move(order)}
+	{
+	}
+
 	/**
 	 * Is this QueryResults object empty (ie., no matches)?
 	 *
 	 * @return true are false
 	 */
-	bool empty() const { return mset_.empty(); }
+	bool empty() const { return size() == 0; }
 
 	/**
 	 * Get the number of matches in this QueryResult
 	 *
 	 * @return number of matches
 	 */
-	size_t size() const { return mset_.size(); }
+	size_t size() const { return order_ ? order_->size() : mset_.size(); }
 
 	/**
 	 * Get the begin iterator to the results.
 	 *
 	 * @return iterator
 	 */
-	iterator       begin() { return QueryResultsIterator(mset_.begin(), query_matches_); }
-	const iterator begin() const { return QueryResultsIterator(mset_.begin(), query_matches_); }
+	iterator begin() const
+	{
+		if (order_)
+			return QueryResultsIterator(mset_, order_->begin(), order_->end(),
+						    query_matches_);
+		else
+			return QueryResultsIterator(mset_.begin(), query_matches_);
+	}
 
 	/**
 	 * Get the end iterator to the results.
 	 *
 	 * @return iterator
 	 */
-	iterator       end() { return QueryResultsIterator(mset_.end(), query_matches_); }
-	const_iterator end() const { return QueryResultsIterator(mset_.end(), query_matches_); }
+	iterator end() const
+	{
+		if (order_)
+			return QueryResultsIterator(mset_, order_->end(), order_->end(),
+						    query_matches_);
+		else
+			return QueryResultsIterator(mset_.end(), query_matches_);
+	}
 
 	/**
 	 * Get the query-matches for these QueryResults. The non-const
@@ -393,9 +470,50 @@ public:
 	const QueryMatches& query_matches() const { return query_matches_; }
 	QueryMatches&       query_matches() { return query_matches_; }
 
+	/**
+	 * Get the statistics about running the query for these QueryResults.
+	 *
+	 * @return query statistics
+	 */
+	const QueryStats& stats() const { return stats_; }
+	QueryStats&       stats() { return stats_; }
+
+	/**
+	 * Get the position in the MSet of the match at some position in
+	 * these results; these differ after remove_if().
+	 *
+	 * @param pos a position in these results
+	 *
+	 * @return the position in the MSet
+	 */
+	size_t mset_position(size_t pos) const { return order_ ? order_->at(pos) : pos; }
+
+	/**
+	 * Remove the matches for which some predicate is true; the remaining
+	 * ones keep their order.
+	 *
+	 * @param pred a predicate, taking a const QueryMatch&
+	 */
+	template <typename Pred> void remove_if(Pred&& pred)
+	{
+		if (!order_) {
+			order_ = QueryOrder(mset_.size());
+			std::iota(order_->begin(), order_->end(), 0);
+		}
+		order_->erase(std::remove_if(order_->begin(), order_->end(),
+					     [&](size_t pos) {
+						     const auto docid{
+							 *mset_[static_cast<Xapian::doccount>(pos)]};
+						     return pred(query_matches_.at(docid));
+					     }),
+			      order_->end());
+	}
+
 private:
-	const Xapian::MSet   mset_;
-	mutable QueryMatches query_matches_;
+	const Xapian::MSet       mset_;
+	mutable QueryMatches     query_matches_;
+	Option<QueryOrder>       order_;
+	QueryStats               stats_;
 };
 
 } // namespace Mu
@@ -20,228 +20,381 @@
 #include "mu-query-threads.hh"
 #include <message/mu-message.hh>
 
-#include <set>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
-#include <list>
+#include <tuple>
+#include <limits>
 #include <cassert>
+#include <cmath>
 #include <cstring>
 #include <iostream>
-#include <iomanip>
 
 #include <utils/mu-option.hh>
 
 using namespace Mu;
 
+/*
+ * The threader works on a flat arena of containers (see Threader), which link
+ * to each other through their index in the arena; message-ids are interned, so
+ * each maps to one container index. Whether two containers are in the same
+ * tree (for loop-detection) is tracked with union-find, rather than walking up
+ * to the root each time.
+ */
+using Idx           = uint32_t;
+constexpr Idx NoIdx = std::numeric_limits<Idx>::max();
+static const std::string EmptyKey;
+
+// union-find over indices; the smallest index of each set represents it.
+struct DisjointSets {
+	explicit DisjointSets(size_t n = 0)
+	{
+		sets_.reserve(n);
+		for (auto idx = Idx{0}; idx != n; ++idx)
+			sets_.emplace_back(idx);
+	}
+
+	Idx add()
+	{
+		const auto idx{static_cast<Idx>(sets_.size())};
+		sets_.emplace_back(idx);
+		return idx;
+	}
+
+	Idx find(Idx idx)
+	{
+		while (sets_[idx] != idx) {
+			sets_[idx] = sets_[sets_[idx]]; // path-halving
+			idx        = sets_[idx];
+		}
+		return idx;
+	}
+
+	void join(Idx idx1, Idx idx2)
+	{
+		const auto set1{find(idx1)}, set2{find(idx2)};
+		if (set1 < set2)
+			sets_[set2] = set1;
+		else
+			sets_[set1] = set2;
+	}
+
+	void reserve(size_t n) { sets_.reserve(n); }
+
+private:
+	std::vector<Idx> sets_;
+};
+
 struct Container {
-	using Containers = std::vector<Container*>;
+	QueryMatch* query_match{}; // nullptr for empty containers
+	Idx         position{NoIdx}; // of the query-match in the results
+	bool        is_nuked{};
+
+	Idx parent{NoIdx};
+	Idx first_child{NoIdx};
+	Idx last_child{NoIdx};
+	Idx prev_sibling{NoIdx};
+	Idx next_sibling{NoIdx};
+
+	// During sorting, this is the (recursive) date-key of this container
+	// -- ie.. either the one from the newest of its children, or from its
+	// query-match, if it has no children; nullptr for empty.
+	//
+	// Note that the sub-root-levels of threads are always sorted by date,
+	// in ascending order, regardless of whatever sorting was specified for
+	// the root-level.
+	const std::string* thread_date_key{};
 
-	Container() = default;
-	Container(Option<QueryMatch&> msg) : query_match{msg} {}
-	Container(const Container&) = delete;
-	Container(Container&&)      = default;
+	bool               has_children() const { return first_child != NoIdx; }
+	const std::string& date_key() const
+	{
+		return thread_date_key ? *thread_date_key : EmptyKey;
+	}
+};
 
-	void add_child(Container& new_child)
+struct Threader {
+	explicit Threader(size_t n = 0) { reserve(n); }
+
+	void reserve(size_t n)
 	{
-		new_child.parent = this;
-		children.emplace_back(&new_child);
+		containers_.reserve(n);
+		sets_.reserve(n);
+		ids_.reserve(n);
 	}
-	void remove_child(Container& child)
+
+	Container&       operator[](Idx idx) { return containers_[idx]; }
+	const Container& operator[](Idx idx) const { return containers_[idx]; }
+	size_t           size() const { return containers_.size(); }
+
+	Idx add_container(QueryMatch* qmatch = {}, Idx position = NoIdx)
 	{
-		children.erase(find_child(child));
-		assert(!has_child(child));
+		const auto idx{static_cast<Idx>(containers_.size())};
+		auto&      container{containers_.emplace_back()};
+		container.query_match = qmatch;
+		container.position    = position;
+		sets_.add();
+		return idx;
 	}
 
-	Containers::iterator find_child(Container& child)
+	// get the container for the given message-id, creating an empty one
+	// if needed.
+	Idx intern(const std::string& msgid)
 	{
-		return std::find_if(children.begin(), children.end(), [&](auto&& c) {
-			return c == &child;
-		});
+		if (const auto it = ids_.find(msgid); it != ids_.end())
+			return it->second;
+		const auto idx{add_container()};
+		ids_.emplace(msgid, idx);
+		return idx;
 	}
-	Containers::const_iterator find_child(Container& child) const
+
+	Option<Idx> find_id(const std::string& msgid) const
 	{
-		return std::find_if(children.begin(), children.end(), [&](auto&& c) {
-			return c == &child;
-		});
+		if (const auto it = ids_.find(msgid); it != ids_.end())
+			return it->second;
+		else
+			return Nothing;
 	}
-	bool has_child(Container& child) const { return find_child(child) != children.cend(); }
 
-	bool is_reachable(Container* other) const
+	// are both containers in the same tree?
+	bool is_reachable(Idx idx1, Idx idx2) { return sets_.find(idx1) == sets_.find(idx2); }
+
+	void add_child(Idx parent, Idx child)
 	{
-		auto up{ur_parent()};
-		return up && up == other->ur_parent();
+		append_child(parent, child);
+		sets_.join(parent, child);
 	}
-	template <typename Func> void for_each_child(Func&& func)
+
+	// append child at the end of parent's children; does not update the
+	// sets, only for re-linking containers within the same tree.
+	void append_child(Idx parent, Idx child)
 	{
-		auto it{children.rbegin()};
-		while (it != children.rend()) {
-			auto next = std::next(it);
-			func(*it);
-			it = next;
-		}
+		auto& c{containers_[child]};
+		auto& p{containers_[parent]};
+
+		c.parent       = parent;
+		c.prev_sibling = p.last_child;
+		c.next_sibling = NoIdx;
+		if (p.last_child != NoIdx)
+			containers_[p.last_child].next_sibling = child;
+		else
+			p.first_child = child;
+		p.last_child = child;
 	}
-	// During sorting, this is the cached value for the (recursive) date-key
-	// of this container -- ie.. either the one from the first of its
-	// children, or from its query-match, if it has no children.
-	//
-	// Note that the sub-root-levels of threads are always sorted by date,
-	// in ascending order, regardless of whatever sorting was specified for
-	// the root-level.
 
-	std::string thread_date_key;
+	void remove_child(Idx parent, Idx child)
+	{
+		auto& c{containers_[child]};
+		auto& p{containers_[parent]};
+		assert(c.parent == parent);
 
-	Option<QueryMatch&> query_match;
-	bool                is_nuked{};
-	Container*          parent{};
-	Containers          children;
+		if (c.prev_sibling != NoIdx)
+			containers_[c.prev_sibling].next_sibling = c.next_sibling;
+		else
+			p.first_child = c.next_sibling;
+		if (c.next_sibling != NoIdx)
+			containers_[c.next_sibling].prev_sibling = c.prev_sibling;
+		else
+			p.last_child = c.prev_sibling;
 
-	using ContainerVec = std::vector<Container*>;
+		c.parent = c.prev_sibling = c.next_sibling = NoIdx;
+	}
 
-      private:
-	const Container* ur_parent() const
+	template <typename Func> void for_each_child(Idx parent, Func&& func) const
 	{
-		assert(this->parent != this);
-		return parent ? parent->ur_parent() : this;
+		for (auto idx = containers_[parent].first_child; idx != NoIdx;) {
+			const auto next{containers_[idx].next_sibling}; // func may unlink
+			func(idx);
+			idx = next;
+		}
 	}
-};
 
-using Containers   = Container::Containers;
-using ContainerVec = Container::ContainerVec;
+	// the containers without parents.
+	std::vector<Idx> roots() const
+	{
+		std::vector<Idx> roots;
+		for (auto idx = Idx{0}; idx != containers_.size(); ++idx)
+			if (containers_[idx].parent == NoIdx && !containers_[idx].is_nuked)
+				roots.emplace_back(idx);
+		return roots;
+	}
 
-static std::ostream&
-operator<<(std::ostream& os, const Container& container)
-{
-	os << "container: " << std::right << std::setw(10) << &container
-	   << ": parent: " << std::right << std::setw(10) << container.parent << " ["
-	   << container.thread_date_key << "]"
-	   << "\n  children: ";
+	// visit the containers in the tree under @p root (exclusive), children
+	// before parents.
+	template <typename Func> void for_each_post_order(Idx root, Func&& func)
+	{
+		std::vector<std::pair<Idx, bool>> stack{{root, false}};
+		while (!stack.empty()) {
+			auto& [idx, expanded] = stack.back();
+			if (!expanded) {
+				expanded       = true;
+				const auto cur = idx; // stack may re-allocate.
+				for_each_child(cur, [&](Idx child) { stack.emplace_back(child, false); });
+				continue;
+			}
+			const auto cur{idx};
+			stack.pop_back();
+			if (cur != root)
+				func(cur);
+		}
+	}
 
-	for (auto&& c : container.children)
-		os << std::right << std::setw(10) << c << " ";
+	// visit the containers in the tree under @p root (inclusive), parents
+	// before children.
+	template <typename Func> void for_each_pre_order(Idx root, Func&& func) const
+	{
+		func(root);
+		auto idx{containers_[root].first_child};
+		while (idx != NoIdx) {
+			func(idx);
+			if (containers_[idx].first_child != NoIdx) {
+				idx = containers_[idx].first_child;
+				continue;
+			}
+			while (idx != root && containers_[idx].next_sibling == NoIdx)
+				idx = containers_[idx].parent;
+			idx = idx == root ? NoIdx : containers_[idx].next_sibling;
+		}
+	}
 
-	os << (container.is_nuked ? " nuked" : "");
+	std::ostream& dump(std::ostream& os) const;
 
-	if (container.query_match)
-		os << "\n  " << container.query_match.value();
+private:
+	std::vector<Container>               containers_;
+	DisjointSets                         sets_; // the trees
+	std::unordered_map<std::string, Idx> ids_;  // message-id -> container
+};
+
+std::ostream&
+Threader::dump(std::ostream& os) const
+{
+	const auto idx_str = [](Idx idx) {
+		return idx == NoIdx ? std::string{"-"} : std::to_string(idx);
+	};
+
+	os << "------------------------------------------------\n";
+	for (auto&& item : ids_) {
+		const auto& c{containers_[item.second]};
+		os << item.first << " => container " << item.second << ": parent "
+		   << idx_str(c.parent) << " [" << c.date_key() << "]"
+		   << (c.is_nuked ? " nuked" : "") << "\n  children:";
+		for_each_child(item.second, [&](Idx child) { os << " " << child; });
+		if (c.query_match)
+			os << "\n  " << *c.query_match;
+		os << "\n";
+	}
+	os << "------------------------------------------------\n";
 
 	return os;
 }
 
-using IdTable  = std::unordered_map<std::string, Container>;
-using DupTable = std::multimap<std::string, Container>;
+struct Duplicate {
+	std::string message_id;
+	QueryMatch* query_match;
+	Idx         position;
+};
 
 static void
-handle_duplicates(IdTable& id_table, DupTable& dup_table)
+handle_duplicates(Threader& threader, const std::vector<Duplicate>& dups)
 {
-	size_t n{};
+	for (auto&& dup : dups) {
+		// add duplicates as fake children
+		if (const auto idx{threader.find_id(dup.message_id)}; idx)
+			threader.add_child(*idx,
+					   threader.add_container(dup.query_match, dup.position));
+	}
+}
 
-	for (auto&& dup : dup_table) {
-		const auto msgid{dup.first};
-		auto       it = id_table.find(msgid);
-		if (it == id_table.end())
-			continue;
+// add a (non-duplicate) message to the threader.
+static void
+add_message(Threader&                       threader,
+	    QueryMatch&                     query_match,
+	    Idx                             position,
+	    const std::string&              msgid,
+	    std::string&&                   date,
+	    std::string&&                   subject,
+	    const std::vector<std::string>& references)
+{
+	// 1.A If id_table contains an empty Container for this ID:
+	// Store this query_match (query_match) in the Container's query_match (value) slot.
+	// Else:
+	//   Create a new Container object holding this query_match (query-match);
+	//  Index the Container by Query_Match-ID
+	const auto idx{threader.intern(msgid)};
+	if (!threader[idx].query_match) { // hmm, dup?
+		threader[idx].query_match = &query_match;
+		threader[idx].position    = position;
+	}
 
-		// add duplicates as fake children
-		char buf[32];
-		::snprintf(buf, sizeof(buf), "dup-%zu", ++n);
-		it->second.add_child(id_table.emplace(buf, std::move(dup.second)).first->second);
+	// We sort by date (ascending), *except* for the root; we don't
+	// know what query_matchs will be at the root level yet, so remember
+	// both. Moreover, even when sorting the top-level in descending
+	// order, still sort the thread levels below that in ascending
+	// order.
+	auto& qmatch{*threader[idx].query_match};
+	qmatch.date_key = std::move(date);
+	// initial guess for the thread-date; might be updated
+	// later.
+	threader[idx].thread_date_key = &qmatch.date_key;
+
+	// remember the subject, we use it to determine the (sub)thread subject
+	qmatch.subject = std::move(subject);
+
+	// 1.B
+	// For each element in the query_match's References field:
+	Idx parent_ref{NoIdx};
+	for (const auto& ref : references) {
+		//   grand_<n>-parent -> grand_<n-1>-parent -> ... -> parent.
+
+		// Find a Container object for the given Query_Match-ID; If it exists, use
+		// it; otherwise make one with a null Query_Match.
+		const auto ref_idx{threader.intern(ref)};
+
+		// Link the References field's Containers together in the order implied
+		// by the References header.
+		// * If they are already linked, don't change the existing links.
+		//
+		// * Do not add a link if adding that link would introduce a loop: that is,
+		//   before asserting A->B, search down the children of B to see if A is
+		//   reachable, and also search down the children of A to see if B is
+		//   reachable. If either is already reachable as a child of the other,
+		//   don't add the link.
+		if (parent_ref != NoIdx && threader[ref_idx].parent == NoIdx &&
+		    !threader.is_reachable(parent_ref, ref_idx))
+			threader.add_child(parent_ref, ref_idx);
+
+		parent_ref = ref_idx;
 	}
+
+	// Add the query_match to the chain.
+	if (parent_ref != NoIdx && threader[idx].parent == NoIdx &&
+	    !threader.is_reachable(parent_ref, idx))
+		threader.add_child(parent_ref, idx);
 }
 
 template <typename QueryResultsType>
-static IdTable
-determine_id_table(QueryResultsType& qres)
+static void
+determine_id_table(Threader& threader, QueryResultsType& qres)
 {
+	std::vector<Duplicate> dups;
+
 	// 1. For each query_match
-	IdTable  id_table;
-	DupTable dups;
+	Idx position{0};
 	for (auto&& mi : qres) {
 		const auto msgid{mi.message_id().value_or(*mi.path())};
 		// Step 0 (non-JWZ): filter out dups, handle those at the end
-		if (mi.query_match().has_flag(QueryMatch::Flags::Duplicate)) {
-			dups.emplace(msgid, mi.query_match());
-			continue;
-		}
-		// 1.A If id_table contains an empty Container for this ID:
-		// Store this query_match (query_match) in the Container's query_match (value) slot.
-		// Else:
-		//   Create a new Container object holding this query_match (query-match);
-		//  Index the Container by Query_Match-ID
-		auto  c_it      = id_table.find(msgid);
-		auto& container = [&]() -> Container& {
-			if (c_it != id_table.end()) {
-				if (!c_it->second.query_match) // hmm, dup?
-					c_it->second.query_match = mi.query_match();
-				return c_it->second;
-			} else {
-				// Else:
-				// Create a new Container object holding this query_match
-				// (query-match); Index the Container by Query_Match-ID
-				return id_table.emplace(msgid, mi.query_match()).first->second;
-			}
-		}();
-
-		// We sort by date (ascending), *except* for the root; we don't
-		// know what query_matchs will be at the root level yet, so remember
-		// both. Moreover, even when sorting the top-level in descending
-		// order, still sort the thread levels below that in ascending
-		// order.
-		container.thread_date_key = container.query_match->date_key =
-		    mi.date().value_or("");
-		// initial guess for the thread-date; might be updated
-		// later.
-
-		// remember the subject, we use it to determine the (sub)thread subject
-		container.query_match->subject = mi.subject().value_or("");
-
-		// 1.B
-		// For each element in the query_match's References field:
-		Container* parent_ref_container{};
-		for (const auto& ref : mi.references()) {
-			//   grand_<n>-parent -> grand_<n-1>-parent -> ... -> parent.
-
-			// Find a Container object for the given Query_Match-ID; If it exists, use
-			// it; otherwise make one with a null Query_Match.
-			auto ref_container = [&]() -> Container* {
-				auto ref_it = id_table.find(ref);
-				if (ref_it == id_table.end())
-					ref_it = id_table.emplace(ref, Nothing).first;
-				return &ref_it->second;
-			}();
-
-			// Link the References field's Containers together in the order implied
-			// by the References header.
-			// * If they are already linked, don't change the existing links.
-			//
-			// * Do not add a link if adding that link would introduce a loop: that is,
-			//   before asserting A->B, search down the children of B to see if A is
-			//   reachable, and also search down the children of A to see if B is
-			//   reachable. If either is already reachable as a child of the other,
-			//   don't add the link.
-			if (parent_ref_container && !ref_container->parent) {
-				if (!parent_ref_container->is_reachable(ref_container))
-					parent_ref_container->add_child(*ref_container);
-				// else
-				//         g_message ("%u: reachable %s -> %s", __LINE__,
-				//         msgid.c_str(), ref.c_str());
-			}
-
-			parent_ref_container = ref_container;
-		}
-
-		// Add the query_match to the chain.
-		if (parent_ref_container && !container.parent) {
-			if (!parent_ref_container->is_reachable(&container))
-				parent_ref_container->add_child(container);
-			// else
-			//         g_message ("%u: reachable %s -> parent", __LINE__,
-			//         msgid.c_str());
-		}
+		if (mi.query_match().has_flag(QueryMatch::Flags::Duplicate))
+			dups.emplace_back(Duplicate{msgid, &mi.query_match(), position});
+		else
+			add_message(threader, mi.query_match(), position, msgid,
+				    mi.date().value_or(""), mi.subject().value_or(""),
+				    mi.references());
+		++position;
 	}
 
 	// non-JWZ: add duplicate messages.
-	handle_duplicates(id_table, dups);
-
-	return id_table;
+	handle_duplicates(threader, dups);
 }
 
 /// Recursively walk all containers under the root set.
@@ -282,35 +435,30 @@ determine_id_table(QueryResultsType& qres)
 ///     set -- unless there is only one child, in which case, do.
 
 static void
-prune(Container* child)
+prune(Threader& threader, Idx child)
 {
-	Container* container{child->parent};
+	const auto parent{threader[child].parent};
 
-	for (auto& grandchild : child->children) {
-		grandchild->parent = container;
-		if (container)
-			container->children.emplace_back(grandchild);
-	}
+	threader.for_each_child(child, [&](Idx grandchild) {
+		if (parent != NoIdx)
+			threader.append_child(parent, grandchild);
+		else
+			threader[grandchild].parent = threader[grandchild].prev_sibling =
+			    threader[grandchild].next_sibling = NoIdx;
+	});
 
-	child->children.clear();
-	child->is_nuked = true;
+	threader[child].first_child = threader[child].last_child = NoIdx;
+	threader[child].is_nuked                                = true;
 
-	if (container)
-		container->remove_child(*child);
+	if (parent != NoIdx)
+		threader.remove_child(parent, child);
 }
 
+// should we nuke this container (after handling its children)?
 static bool
-prune_empty_containers(Container& container)
+is_prunable(const Threader& threader, Idx idx)
 {
-	Containers to_prune;
-
-	container.for_each_child([&](auto& child) {
-		if (prune_empty_containers(*child))
-			to_prune.emplace_back(child);
-	});
-
-	for (auto& child : to_prune)
-		prune(child);
+	const auto& container{threader[idx]};
 
 	// Never nuke these.
 	if (container.query_match)
@@ -324,23 +472,19 @@ prune_empty_containers(Container& container)
 	//
 	// Do not promote the children if doing so would promote them to the root
 	// set -- unless there is only one child, in which case, do.
-	// const auto rootset_child{!container.parent->parent};
-	if (container.parent || container.children.size() <= 1)
-		return true; // splice/nuke it.
-
-	return false;
+	return container.parent != NoIdx || container.first_child == container.last_child;
 }
 
 static void
-prune_empty_containers(IdTable& id_table)
+prune_empty_containers(Threader& threader)
 {
-	for (auto&& item : id_table) {
-		auto& child(item.second);
-		if (child.parent)
-			continue; // not a root child.
-
-		if (prune_empty_containers(item.second))
-			prune(&child);
+	for (auto&& root : threader.roots()) {
+		threader.for_each_post_order(root, [&](Idx idx) {
+			if (is_prunable(threader, idx))
+				prune(threader, idx);
+		});
+		if (is_prunable(threader, root))
+			prune(threader, root);
 	}
 }
 
@@ -354,13 +498,18 @@ using ThreadPath = std::vector<unsigned>;
 inline std::string
 to_string(const ThreadPath& tpath, size_t digits)
 {
+	static constexpr auto hexdigits{"0123456789abcdef"};
+	digits = std::max(digits, size_t{1});
+
 	std::string str;
-	str.reserve(tpath.size() * digits);
+	str.reserve(tpath.size() * (digits + 1));
 
-	bool first{true};
+	// i.e., "%0*x" for each segment, ':'-separated
 	for (auto&& segm : tpath) {
-		str += format("%s%0*x", first ? "" : ":", (int)digits, segm);
-		first = false;
+		if (!str.empty())
+			str += ':';
+		for (auto d = digits; d != 0; --d)
+			str += hexdigits[(segm >> (4 * (d - 1))) & 0xf];
 	}
 
 	return str;
@@ -384,38 +533,38 @@ subject_matches(const std::string& sub1, const std::string& sub2)
 }
 
 static bool
-update_container(Container&         container,
+update_container(Threader&          threader,
+		 Idx                idx,
 		 bool               descending,
 		 ThreadPath&        tpath,
 		 size_t             seg_size,
 		 const std::string& prev_subject = "")
 {
-	if (!container.children.empty()) {
-		Container* first = container.children.front();
-		if (first->query_match)
-			first->query_match->flags |= QueryMatch::Flags::First;
-		Container* last = container.children.back();
-		if (last->query_match)
-			last->query_match->flags |= QueryMatch::Flags::Last;
+	auto& container{threader[idx]};
+	if (container.has_children()) {
+		if (auto first{threader[container.first_child].query_match}; first)
+			first->flags |= QueryMatch::Flags::First;
+		if (auto last{threader[container.last_child].query_match}; last)
+			last->flags |= QueryMatch::Flags::Last;
 	}
 
 	if (!container.query_match)
 		return false; // nothing else to do.
 
 	auto& qmatch(*container.query_match);
-	if (!container.parent)
+	if (container.parent == NoIdx)
 		qmatch.flags |= QueryMatch::Flags::Root;
-	else if (!container.parent->query_match)
+	else if (!threader[container.parent].query_match)
 		qmatch.flags |= QueryMatch::Flags::Orphan;
 
-	if (!container.children.empty())
+	if (container.has_children())
 		qmatch.flags |= QueryMatch::Flags::HasChild;
 
 	if (qmatch.has_flag(QueryMatch::Flags::Root) || prev_subject.empty() ||
 	    !subject_matches(prev_subject, qmatch.subject))
 		qmatch.flags |= QueryMatch::Flags::ThreadSubject;
 
-	if (descending && container.parent) {
+	if (descending && container.parent != NoIdx) {
 		// trick xapian by giving it "inverse" sorting key so our
 		// ascending-date sorted threads stay in that order
 		tpath.back() = ((1U << (4 * seg_size)) - 1) - tpath.back();
@@ -431,87 +580,148 @@ update_container(Container&         container,
 	return true;
 }
 
+// update the containers below @p root, depth-first.
 static void
-update_containers(Containers&  children,
+update_containers(Threader&    threader,
+		  Idx          root,
 		  bool         descending,
 		  ThreadPath&  tpath,
 		  size_t       seg_size,
 		  std::string& prev_subject)
 {
-	size_t idx{0};
+	// tpath gets updated by update_container(), so keep track of the
+	// sibling-indices separately.
+	std::vector<unsigned> sibling_idx;
+	const auto            visit = [&](Idx idx) {
+		if (auto&& qmatch{threader[idx].query_match}; qmatch) {
+			update_container(threader, idx, descending, tpath, seg_size,
+					 prev_subject);
+			prev_subject = qmatch->subject;
+		}
+	};
 
-	for (auto&& c : children) {
-		tpath.emplace_back(idx++);
-		if (c->query_match) {
-			update_container(*c, descending, tpath, seg_size, prev_subject);
-			prev_subject = c->query_match->subject;
+	auto idx{threader[root].first_child};
+	if (idx == NoIdx)
+		return;
+
+	tpath.emplace_back(0);
+	sibling_idx.emplace_back(0);
+	visit(idx);
+
+	while (true) {
+		if (const auto child{threader[idx].first_child}; child != NoIdx) {
+			idx = child;
+			tpath.emplace_back(0);
+			sibling_idx.emplace_back(0);
+		} else {
+			while (threader[idx].next_sibling == NoIdx) {
+				idx = threader[idx].parent;
+				tpath.pop_back();
+				sibling_idx.pop_back();
+				if (idx == root)
+					return;
+			}
+			idx          = threader[idx].next_sibling;
+			tpath.back() = ++sibling_idx.back();
 		}
-		update_containers(c->children, descending, tpath, seg_size, prev_subject);
-		tpath.pop_back();
+		visit(idx);
 	}
 }
 
+// the number of hex-digits per thread-path segment for @p n containers, so we
+// can lexically compare them.
+static size_t
+segment_size(size_t n)
+{
+	return static_cast<size_t>(std::ceil(std::log2(n) / 4.0));
+	/*note: 4 == std::log2(16)*/
+}
+
+// update the thread with @p root, which is number @p root_num in the
+// (sorted) root set.
+static void
+update_thread(Threader&   threader,
+	      Idx         root,
+	      size_t      root_num,
+	      bool        descending,
+	      ThreadPath& tpath,
+	      size_t      seg_size)
+{
+	tpath.emplace_back(root_num);
+	std::string prev_subject;
+	if (update_container(threader, root, descending, tpath, seg_size))
+		prev_subject = threader[root].query_match->subject;
+	update_containers(threader, root, descending, tpath, seg_size, prev_subject);
+	tpath.pop_back();
+}
+
 static void
-update_containers(ContainerVec& root_vec, bool descending, size_t n)
+update_containers(Threader&               threader,
+		  const std::vector<Idx>& root_vec,
+		  bool                    descending,
+		  size_t                  n)
 {
 	ThreadPath tpath;
 	tpath.reserve(n);
 
-	const auto seg_size = static_cast<size_t>(std::ceil(std::log2(n) / 4.0));
-	/*note: 4 == std::log2(16)*/
-
-	size_t idx{0};
-	for (auto&& c : root_vec) {
-		tpath.emplace_back(idx++);
-		std::string prev_subject;
-		if (update_container(*c, descending, tpath, seg_size))
-			prev_subject = c->query_match->subject;
-		update_containers(c->children, descending, tpath, seg_size, prev_subject);
-		tpath.pop_back();
-	}
+	const auto seg_size{segment_size(n)};
+	for (size_t idx{0}; idx != root_vec.size(); ++idx)
+		update_thread(threader, root_vec[idx], idx, descending, tpath, seg_size);
 }
 
 static void
-sort_container(Container& container)
+sort_container(Threader& threader, Idx idx, std::vector<Idx>& children)
 {
+	auto& container{threader[idx]};
+
 	// 1. childless container.
-	if (container.children.empty())
+	if (!container.has_children())
 		return; // no children;  nothing to sort.
 
-	// 2. container with children.
-	// recurse, depth-first: sort the children
-	for (auto& child : container.children)
-		sort_container(*child);
-
-	// now sort this level.
-	std::sort(container.children.begin(), container.children.end(), [&](auto&& c1, auto&& c2) {
-		return c1->thread_date_key < c2->thread_date_key;
+	// 2. container with children; these are already sorted (see
+	// sort_siblings()), so sort this level.
+	children.clear();
+	threader.for_each_child(idx, [&](Idx child) { children.emplace_back(child); });
+	std::stable_sort(children.begin(), children.end(), [&](auto&& c1, auto&& c2) {
+		return threader[c1].date_key() < threader[c2].date_key();
 	});
+	container.first_child = container.last_child = NoIdx;
+	for (auto&& child : children)
+		threader.append_child(idx, child);
 
 	// and 'bubble up' the date of the *newest* message with a date. We
 	// reasonably assume that it's later than its parent.
-	const auto& newest_date = container.children.back()->thread_date_key;
-	if (!newest_date.empty())
-		container.thread_date_key = newest_date;
+	if (const auto& newest{threader[container.last_child]}; !newest.date_key().empty())
+		container.thread_date_key = newest.thread_date_key;
 }
 
-static void
-sort_siblings(IdTable& id_table, bool descending)
+// sort all threads _under_ the root set (by date/ascending), depth-first;
+// return the (still unsorted) root set.
+static std::vector<Idx>
+sort_children(Threader& threader)
 {
-	if (id_table.empty())
-		return;
-
 	// unsorted vec of root containers. We can
 	// only sort these _after_ sorting the children.
-	ContainerVec root_vec;
-	for (auto&& item : id_table) {
-		if (!item.second.parent && !item.second.is_nuked)
-			root_vec.emplace_back(&item.second);
+	auto root_vec{threader.roots()};
+
+	std::vector<Idx> children;
+	for (auto&& c : root_vec) {
+		threader.for_each_post_order(
+		    c, [&](Idx idx) { sort_container(threader, idx, children); });
+		sort_container(threader, c, children);
 	}
 
-	// now sort all threads _under_ the root set (by date/ascending)
-	for (auto&& c : root_vec)
-		sort_container(*c);
+	return root_vec;
+}
+
+// returns the sorted root set.
+static std::vector<Idx>
+sort_siblings(Threader& threader, bool descending)
+{
+	if (threader.size() == 0)
+		return {};
+
+	auto root_vec{sort_children(threader)};
 
 	// and then sort the root set.
 	//
@@ -519,63 +729,79 @@ sort_siblings(IdTable& id_table, bool descending)
 	// we can sort either in ascending or descending order, while on the
 	// subroot level it's always in ascending order.
 	//
-	// Note that unless we're testing, _xapian_ will handle
-	// the ascending/descending of the top level.
-	std::sort(root_vec.begin(), root_vec.end(), [&](auto&& c1, auto&& c2) {
+	// Note that unless we're testing, the ascending/descending of the top
+	// level is handled when ordering the threads (see display_order()).
+	std::stable_sort(root_vec.begin(), root_vec.end(), [&](auto&& c1, auto&& c2) {
 #ifdef BUILD_TESTS
 		if (descending)
-			return c2->thread_date_key < c1->thread_date_key;
+			return threader[c2].date_key() < threader[c1].date_key();
 		else
 #endif /*BUILD_TESTS*/
-			return c1->thread_date_key < c2->thread_date_key;
+			return threader[c1].date_key() < threader[c2].date_key();
 	});
 
 	// now all is sorted... final step is to determine thread paths and
 	// other flags.
-	update_containers(root_vec, descending, id_table.size());
+	update_containers(threader, root_vec, descending, threader.size());
+
+	return root_vec;
 }
 
-static std::ostream&
-operator<<(std::ostream& os, const IdTable& id_table)
+// put the (sorted) root set in the order in which the threads are shown.
+template <typename Roots>
+static void
+display_order(Roots& roots, bool descending)
 {
-	os << "------------------------------------------------\n";
-	for (auto&& item : id_table) {
-		os << item.first << " => " << item.second << "\n";
-	}
-	os << "------------------------------------------------\n";
+	// the thread-paths are such that, when sorted in descending order,
+	// only the threads are reversed, not the messages in them. When
+	// testing, sort_siblings() already sorted the root set in descending
+	// order.
+#ifdef BUILD_TESTS
+	constexpr auto reverse_roots{false};
+#else
+	constexpr auto reverse_roots{true};
+#endif /*BUILD_TESTS*/
+	if (descending && reverse_roots)
+		std::reverse(roots.begin(), roots.end());
+}
 
-	std::set<std::string> ids;
-	for (auto&& item : id_table) {
-		if (item.second.query_match)
-			ids.emplace(item.second.query_match->thread_path);
-	}
+// add the positions of the query-matches in the thread with @p root.
+static void
+add_thread_order(const Threader& threader, Idx root, ThreadOrder& order)
+{
+	threader.for_each_pre_order(root, [&](Idx idx) {
+		if (threader[idx].position != NoIdx)
+			order.positions.emplace_back(threader[idx].position);
+	});
+	order.thread_ends.emplace_back(order.positions.size());
+}
 
-	for (auto&& id : ids) {
-		auto it = std::find_if(id_table.begin(), id_table.end(), [&](auto&& item) {
-			return item.second.query_match &&
-			       item.second.query_match->thread_path == id;
-		});
-		assert(it != id_table.end());
-		os << it->first << ": " << it->second << '\n';
+static void
+update_thread_dates(const Threader& threader)
+{
+	for (auto idx = Idx{0}; idx != threader.size(); ++idx) {
+		const auto& c{threader[idx]};
+		if (c.query_match)
+			c.query_match->thread_date = c.date_key();
 	}
-	return os;
 }
 
 template <typename Results>
-static void
+static ThreadOrder
 calculate_threads_real(Results& qres, bool descending)
 {
 	// Step 1: build the id_table
-	auto id_table{determine_id_table(qres)};
+	Threader threader{qres.size() * 2};
+	determine_id_table(threader, qres);
 
 	if (g_test_verbose())
-		std::cout << "*** id-table(1):\n" << id_table << "\n";
+		threader.dump(std::cout << "*** id-table(1):\n") << "\n";
 
 	// // Step 2: get the root set
 	// // Step 3: discard id_table
-	// Nope: id-table owns the containers.
+	// Nope: the threader owns the containers.
 	// Step 4: prune empty containers
-	prune_empty_containers(id_table);
+	prune_empty_containers(threader);
 
 	// Step 5: group root-set by subject.
 	// Not implemented.
@@ -584,25 +810,460 @@ calculate_threads_real(Results& qres, bool descending)
 
 	// Step 7: sort siblings. The segment-size is the number of hex-digits
 	// in the thread-path string (so we can lexically compare them.)
-	sort_siblings(id_table, descending);
+	auto root_vec{sort_siblings(threader, descending)};
 
 	// Step 7a:. update querymatches
-	for (auto&& item : id_table) {
-		Container& c{item.second};
-		if (c.query_match)
-			c.query_match->thread_date = c.thread_date_key;
-	}
-	// if (g_test_verbose())
-	//         std::cout << "*** id-table(2):\n" << id_table << "\n";
-}
+	update_thread_dates(threader);
 
-void
-Mu::calculate_threads(Mu::QueryResults& qres, bool descending)
-{
-	calculate_threads_real(qres, descending);
+	// Step 7b: determine the order
+	ThreadOrder order;
+	order.positions.reserve(qres.size());
+	display_order(root_vec, descending);
+	for (auto&& root : root_vec)
+		add_thread_order(threader, root, order);
+
+	return order;
 }
 
-#ifdef BUILD_TESTS
+//
+// Partitioned threading.
+//
+// Messages with different thread-ids (see update_threading_info() in the store)
+// normally end up in different threads, so we can thread the partitions with
+// the same thread-id independently, on multiple cores. Partitions that _are_
+// linked (through message-ids / references they share), are merged first. The
+// result is the same as that of calculate_threads_real().
+//
+
+// run func(0) ... func(n - 1) on (up to) @p workers threads.
+template <typename Func>
+static void
+for_each_parallel(size_t n, size_t workers, Func&& func)
+{
+	std::atomic<size_t> next{0};
+	const auto          work = [&] {
+		for (auto i = next++; i < n; i = next++)
+			func(i);
+	};
+
+	std::vector<std::thread> threads;
+	for (auto w = 1U; w < std::min(workers, n); ++w)
+		threads.emplace_back(work);
+	work();
+	for (auto&& thread : threads)
+		thread.join();
+}
+
+// what we need from a query-result for threading.
+struct MatchInfo {
+	QueryMatch*              query_match{};
+	std::string              message_id;
+	std::string              date;
+	std::string              subject;
+	std::vector<std::string> references;
+	Idx                      partition{};
+};
+
+// A batch of partitions, threaded together.
+struct Batch {
+	std::vector<size_t> matches; // indices into the MatchInfos, in order
+	Threader            threader;
+	// for each container, the index of the match that created it, to
+	// order the root-set as calculate_threads_real() would.
+	std::vector<size_t> ranks;
+	std::vector<Idx>    roots;
+	// roots with their number in the (sorted) root set
+	std::vector<std::pair<Idx, size_t>> numbered_roots;
+};
+
+static void
+thread_batch(Batch& batch, std::vector<MatchInfo>& infos)
+{
+	std::vector<Duplicate> dups;
+
+	auto& threader{batch.threader};
+	threader.reserve(batch.matches.size() * 2);
+	batch.ranks.reserve(batch.matches.size() * 2);
+
+	for (auto&& i : batch.matches) {
+		auto& info{infos[i]};
+		if (info.query_match->has_flag(QueryMatch::Flags::Duplicate))
+			dups.emplace_back(Duplicate{std::move(info.message_id), info.query_match,
+						    static_cast<Idx>(i)});
+		else {
+			add_message(threader, *info.query_match, static_cast<Idx>(i),
+				    info.message_id, std::move(info.date),
+				    std::move(info.subject), info.references);
+			batch.ranks.resize(threader.size(), i);
+		}
+	}
+	handle_duplicates(threader, dups);
+	batch.ranks.resize(threader.size(), infos.size());
+
+	prune_empty_containers(threader);
+	batch.roots = sort_children(threader);
+}
+
+template <typename Results>
+static ThreadOrder
+calculate_threads_partitioned(Results& qres, bool descending, size_t workers)
+{
+	// Step 1: gather the information from the results (which we cannot
+	// access from multiple threads), and partition them by thread-id.
+	//
+	// We only use hashes of the thread-ids and message-ids here; when
+	// those collide, we merge partitions we did not have to, which is
+	// slower, but gives the same results.
+	const std::hash<std::string>    hash;
+	std::unordered_map<size_t, Idx> partitions;
+	std::vector<MatchInfo>          infos;
+	infos.reserve(qres.size());
+	partitions.reserve(qres.size());
+
+	for (auto&& mi : qres) {
+		auto& info{infos.emplace_back()};
+		info.query_match = &mi.query_match();
+		info.message_id  = mi.message_id().value_or(*mi.path());
+		if (!info.query_match->has_flag(QueryMatch::Flags::Duplicate)) {
+			info.date       = mi.date().value_or("");
+			info.subject    = mi.subject().value_or("");
+			info.references = mi.references();
+		}
+		const auto thread_id{mi.thread_id().value_or(info.message_id)};
+		info.partition =
+		    partitions.emplace(hash(thread_id), partitions.size()).first->second;
+	}
+	if (infos.empty())
+		return {};
+
+	// Step 2: merge the partitions that share message-ids; the smallest
+	// partition-index (i.e., the first we saw) represents the merged one.
+	//
+	// To find the links, hash all the ids (in parallel), then let each
+	// worker look for links in its own shard of the hashes.
+	std::vector<size_t> offsets(infos.size() + 1);
+	for (auto i = 0U; i != infos.size(); ++i)
+		offsets[i + 1] = offsets[i] + 1 + infos[i].references.size();
+
+	std::vector<std::pair<size_t, Idx>> ids(offsets.back()); // hash, partition
+	for_each_parallel(workers, workers, [&](size_t w) {
+		for (auto i = infos.size() * w / workers; i != infos.size() * (w + 1) / workers;
+		     ++i) {
+			auto&& info{infos[i]};
+			auto   id{ids.begin() + offsets[i]};
+			*id++ = {hash(info.message_id), info.partition};
+			for (auto&& ref : info.references)
+				*id++ = {hash(ref), info.partition};
+		}
+	});
+
+	std::vector<std::vector<std::pair<Idx, Idx>>> links(workers);
+	for_each_parallel(workers, workers, [&](size_t w) {
+		std::unordered_map<size_t, Idx> owners;
+		owners.reserve(ids.size() / workers + 1);
+		for (auto&& [id_hash, partition] : ids) {
+			if (id_hash % workers != w)
+				continue;
+			const auto it{owners.emplace(id_hash, partition).first};
+			if (it->second != partition)
+				links[w].emplace_back(it->second, partition);
+		}
+	});
+
+	DisjointSets sets{partitions.size()};
+	for (auto&& shard_links : links)
+		for (auto&& [partition1, partition2] : shard_links)
+			sets.join(partition1, partition2);
+
+	// Step 3: divide the (merged) partitions over some batches of about
+	// the same size; in order, so the results are deterministic.
+	std::vector<size_t> sizes(partitions.size());
+	for (auto&& info : infos) {
+		info.partition = sets.find(info.partition);
+		++sizes[info.partition];
+	}
+
+	std::vector<Batch>  batches(std::min(workers * 4, infos.size()));
+	std::vector<size_t> batch_of(partitions.size());
+	const auto          batch_size{infos.size() / batches.size() + 1};
+	size_t              batch_idx{}, acc{};
+	for (auto part = Idx{0}; part != partitions.size(); ++part) {
+		if (sets.find(part) != part)
+			continue;
+		batch_of[part] = batch_idx;
+		if ((acc += sizes[part]) >= batch_size * (batch_idx + 1))
+			batch_idx = std::min(batch_idx + 1, batches.size() - 1);
+	}
+	for (auto i = 0U; i != infos.size(); ++i)
+		batches[batch_of[infos[i].partition]].matches.emplace_back(i);
+
+	// Step 4: thread the batches (i.e., JWZ steps 1-7 except for sorting
+	// the root set).
+	for_each_parallel(batches.size(), workers,
+			  [&](size_t b) { thread_batch(batches[b], infos); });
+
+	// Step 5: sort the root set, across all batches.
+	size_t                           n{};
+	std::vector<std::pair<Idx, Idx>> root_vec; // batch, root
+	for (auto b = Idx{0}; b != batches.size(); ++b) {
+		n += batches[b].threader.size();
+		for (auto&& root : batches[b].roots)
+			root_vec.emplace_back(b, root);
+	}
+	const auto root_key = [&](auto&& root) {
+		auto&& batch{batches[root.first]};
+		return std::make_tuple(batch.ranks[root.second], root.second);
+	};
+	std::sort(root_vec.begin(), root_vec.end(), [&](auto&& r1, auto&& r2) {
+		const auto& key1{batches[r1.first].threader[r1.second].date_key()};
+		const auto& key2{batches[r2.first].threader[r2.second].date_key()};
+		if (key1 != key2) {
+#ifdef BUILD_TESTS
+			if (descending)
+				return key2 < key1;
+			else
+#endif /*BUILD_TESTS*/
+				return key1 < key2;
+		}
+		return root_key(r1) < root_key(r2);
+	});
+	for (size_t num{0}; num != root_vec.size(); ++num)
+		batches[root_vec[num].first].numbered_roots.emplace_back(root_vec[num].second,
+									  num);
+
+	// Step 6: determine the thread-paths and other flags.
+	const auto seg_size{segment_size(n)};
+	for_each_parallel(batches.size(), workers, [&](size_t b) {
+		auto&      batch{batches[b]};
+		ThreadPath tpath;
+		for (auto&& [root, num] : batch.numbered_roots)
+			update_thread(batch.threader, root, num, descending, tpath, seg_size);
+		update_thread_dates(batch.threader);
+	});
+
+	// Step 7: determine the order
+	ThreadOrder order;
+	order.positions.reserve(infos.size());
+	display_order(root_vec, descending);
+	for (auto&& [b, root] : root_vec)
+		add_thread_order(batches[b].threader, root, order);
+
+	return order;
+}
+
+ThreadOrder
+Mu::calculate_threads(Mu::QueryResults& qres, bool descending)
+{
+	// only worth the trouble for bigger result sets
+	constexpr size_t min_partitioned_size{10000};
+	const auto       workers{std::thread::hardware_concurrency()};
+
+	if (qres.size() < min_partitioned_size || workers < 2)
+		return calculate_threads_real(qres, descending);
+	else
+		return calculate_threads_partitioned(qres, descending, workers);
+}
+
+// is path @p ancestor the thread-path of an ancestor of @p path?
+static bool
+is_ancestor_path(const std::string& ancestor, const std::string& path)
+{
+	return path.length() > ancestor.length() && path[ancestor.length()] == ':' &&
+	       path.compare(0, ancestor.length(), ancestor) == 0;
+}
+
+// "invert" the hex-digits in a thread-path, so it sorts in the opposite order;
+// see update_container().
+static std::string
+inverted_path(const std::string& path)
+{
+	static constexpr auto hexdigits{"0123456789abcdef"};
+
+	std::string inverted{path};
+	for (auto&& c : inverted)
+		if (const auto val{g_ascii_xdigit_value(c)}; val >= 0)
+			c = hexdigits[15 - val];
+
+	return inverted;
+}
+
+Option<ThreadOrder>
+Mu::calculate_threads_from_paths(Mu::QueryResults& qres, bool descending)
+{
+	struct PathEntry {
+		QueryMatch* qmatch;
+		size_t      position;
+		std::string thread_id;
+		std::string thread_path;
+		std::string thread_date;
+	};
+	std::vector<PathEntry>                       entries;
+	std::unordered_map<std::string, std::string> thread_dates;
+
+	// 1. gather the thread-ids, -paths and -dates (i.e., the date of the
+	// newest matching message)
+	entries.reserve(qres.size());
+	for (auto&& mi : qres) {
+		auto& qmatch{mi.query_match()};
+		qmatch.date_key = mi.date().value_or("");
+		qmatch.subject  = mi.subject().value_or("");
+
+		auto thread_id{mi.thread_id()};
+		auto thread_path{mi.thread_path()};
+		if (thread_id && !thread_path)
+			return Nothing; // not calculated (yet)
+		else if (!thread_id) { // no message-id; a thread of its own.
+			thread_id   = format("#%u", mi.doc_id());
+			thread_path = "0";
+		}
+
+		auto& thread_date{thread_dates[*thread_id]};
+		thread_date = std::max(thread_date, qmatch.date_key);
+		entries.emplace_back(PathEntry{&qmatch, entries.size(), std::move(*thread_id),
+					       std::move(*thread_path), {}});
+	}
+
+	if (entries.empty())
+		return ThreadOrder{};
+
+	// 2. sort threads by date, and the messages in each thread by their
+	// thread-path.
+	for (auto&& entry : entries)
+		entry.thread_date = thread_dates.at(entry.thread_id);
+	std::sort(entries.begin(), entries.end(), [](auto&& e1, auto&& e2) {
+		return std::tie(e1.thread_date, e1.thread_id, e1.thread_path) <
+		       std::tie(e2.thread_date, e2.thread_id, e2.thread_path);
+	});
+
+	// 3. walk through the threads, keeping track of the ancestors of each
+	// message that are in the results.
+	struct Ancestor {
+		std::string thread_path;
+		QueryMatch* qmatch;     // or nullptr for the missing root
+		QueryMatch* last_child; // the last child so far.
+	};
+	std::vector<Ancestor> ancestors;
+	const auto            pop_ancestor = [&] {
+		if (auto&& last{ancestors.back().last_child}; last)
+			last->flags |= QueryMatch::Flags::Last;
+		ancestors.pop_back();
+	};
+
+	const auto          digits{format("%zx", thread_dates.size()).length()};
+	size_t              thread_idx{};
+	std::string         prev_subject;
+	std::vector<size_t> thread_starts{0};
+	for (auto it = entries.begin(); it != entries.end(); ++it) {
+		auto& qmatch{*it->qmatch};
+		if (it != entries.begin() && it->thread_id != std::prev(it)->thread_id) {
+			thread_starts.emplace_back(it - entries.begin());
+			while (!ancestors.empty())
+				pop_ancestor();
+			++thread_idx;
+			prev_subject.clear();
+		}
+
+		while (!ancestors.empty() &&
+		       !is_ancestor_path(ancestors.back().thread_path, it->thread_path))
+			pop_ancestor();
+
+		// the root of the thread is not in the results; act like it's
+		// an empty container.
+		if (ancestors.empty() && it->thread_path.find(':') != std::string::npos)
+			ancestors.emplace_back(Ancestor{
+			    it->thread_path.substr(0, it->thread_path.find(':')), {}, {}});
+
+		if (ancestors.empty())
+			qmatch.flags |= QueryMatch::Flags::Root;
+		else {
+			auto& parent{ancestors.back()};
+			if (parent.qmatch)
+				parent.qmatch->flags |= QueryMatch::Flags::HasChild;
+			else
+				qmatch.flags |= QueryMatch::Flags::Orphan;
+			if (!parent.last_child)
+				qmatch.flags |= QueryMatch::Flags::First;
+			parent.last_child = &qmatch;
+		}
+
+		if (qmatch.has_flag(QueryMatch::Flags::Root) || prev_subject.empty() ||
+		    !subject_matches(prev_subject, qmatch.subject))
+			qmatch.flags |= QueryMatch::Flags::ThreadSubject;
+		prev_subject = qmatch.subject;
+
+		qmatch.thread_level = ancestors.size();
+		qmatch.thread_date  = it->thread_date;
+		// as in update_container(): when sorting in descending order, the
+		// top-level order is reversed (by xapian), but not the rest.
+		if (descending)
+			qmatch.thread_path = format("%0*zx:%s:z", (int)digits, thread_idx,
+						    inverted_path(it->thread_path).c_str());
+		else
+			qmatch.thread_path = format("%0*zx:%s", (int)digits, thread_idx,
+						    it->thread_path.c_str());
+
+		ancestors.emplace_back(Ancestor{it->thread_path, &qmatch, {}});
+	}
+	while (!ancestors.empty())
+		pop_ancestor();
+
+	// 4. the order; as in display_order(), in descending order only the
+	// threads are reversed, not the messages in them.
+	ThreadOrder order;
+	order.positions.reserve(entries.size());
+	thread_starts.emplace_back(entries.size());
+	for (auto t = 0U; t + 1 < thread_starts.size(); ++t) {
+		const auto thread{descending ? thread_starts.size() - 2 - t : t};
+		for (auto e = thread_starts[thread]; e != thread_starts[thread + 1]; ++e)
+			order.positions.emplace_back(entries[e].position);
+		order.thread_ends.emplace_back(order.positions.size());
+	}
+
+	return order;
+}
+
+namespace {
+// Adapts a ThreadMessage for calculate_threads_real()
+struct ThreadMessageResult {
+	ThreadMessageResult(ThreadMessage& msg) : msg_{msg} {}
+
+	Option<std::string>             message_id() const { return msg_.message_id; }
+	Option<std::string>             path() const { return msg_.message_id; }
+	Option<std::string>             date() const { return msg_.date; }
+	Option<std::string>             subject() const { return Nothing; }
+	QueryMatch&                     query_match() { return query_match_; }
+	const QueryMatch&               query_match() const { return query_match_; }
+	const std::vector<std::string>& references() const { return msg_.references; }
+
+	ThreadMessage& msg_;
+	QueryMatch     query_match_{};
+};
+} // namespace
+
+void
+Mu::calculate_thread_paths(std::vector<ThreadMessage>& msgs)
+{
+	std::vector<ThreadMessageResult> results;
+	std::unordered_set<std::string>  msgids;
+
+	results.reserve(msgs.size());
+	for (auto&& msg : msgs) {
+		results.emplace_back(msg);
+		if (!msgids.emplace(msg.message_id).second)
+			results.back().query_match().flags |= QueryMatch::Flags::Duplicate;
+	}
+
+	calculate_threads_real(results, false /*ascending*/);
+
+	for (auto&& res : results)
+		res.msg_.thread_path = res.query_match().thread_path;
+}
+
+#ifdef BUILD_TESTS
+
+#include <map>
+#include <random>
+#include <sys/resource.h>
 
 struct MockQueryResult {
 	MockQueryResult(const std::string&              message_id_arg,
@@ -620,6 +1281,11 @@ struct MockQueryResult {
 	Option<std::string>             path() const { return path_; }
 	Option<std::string>             date() const { return date_; }
 	Option<std::string>             subject() const { return subject_; }
+	// as in the store: the first reference, or the message-id.
+	Option<std::string> thread_id() const
+	{
+		return refs_.empty() ? message_id_ : refs_.front();
+	}
 	QueryMatch&                     query_match() { return query_match_; }
 	const QueryMatch&               query_match() const { return query_match_; }
 	const std::vector<std::string>& references() const { return refs_; }
@@ -644,10 +1310,10 @@ operator<<(std::ostream& os, const MockQueryResults& qrs)
 	return os;
 }
 
-static void
+static ThreadOrder
 calculate_threads(MockQueryResults& qres, bool descending)
 {
-	calculate_threads_real(qres, descending);
+	return calculate_threads_real(qres, descending);
 }
 
 using Expected = std::vector<std::pair<std::string, std::string>>;
@@ -885,6 +1551,473 @@ test_thread_info_descending()
 							QueryMatch::Flags::First));
 }
 
+// mock results for @p n messages, in threads of up to 20 messages, with
+// References: as in real messages.
+static MockQueryResults
+make_mock_results(size_t n)
+{
+	std::mt19937     rng{42};
+	MockQueryResults results;
+	results.reserve(n);
+
+	size_t thread_start{}, thread_end{};
+	for (auto i = 0U; i != n; ++i) {
+		if (i == thread_end) {
+			thread_start = i;
+			thread_end   = i + 1 + rng() % 20;
+		}
+
+		std::vector<std::string> refs;
+		if (i != thread_start) {
+			const auto& parent{results.at(thread_start + rng() % (i - thread_start))};
+			refs = parent.refs_;
+			refs.emplace_back(parent.message_id_);
+			if (refs.size() > 10)
+				refs.erase(refs.begin());
+		}
+		results.emplace_back(format("m%u@example.com", i), format("%010u", i),
+				     std::move(refs));
+	}
+
+	return results;
+}
+
+// like make_mock_results(), but with messages referring to other threads or
+// to messages we don't have, duplicates and dates that are the same, or
+// out of order.
+static MockQueryResults
+make_tangled_mock_results(size_t n, unsigned seed)
+{
+	std::mt19937     rng{seed};
+	MockQueryResults results;
+	results.reserve(n);
+
+	size_t thread_start{}, thread_end{};
+	for (auto i = 0U; i != n; ++i) {
+		if (i == thread_end) {
+			thread_start = i;
+			thread_end   = i + 1 + rng() % 10;
+		}
+		const auto date{format("%04u", static_cast<unsigned>(rng() % (n / 2 + 1)))};
+
+		if (i != 0 && rng() % 20 == 0) {
+			auto dup{results.at(rng() % i)};
+			dup.query_match_.flags = QueryMatch::Flags::Duplicate;
+			dup.date_              = date;
+			results.emplace_back(std::move(dup));
+			continue;
+		}
+
+		std::vector<std::string> refs;
+		if (i != 0 && rng() % 15 == 0)
+			refs.emplace_back(results.at(rng() % i).message_id_);
+		else if (rng() % 15 == 0)
+			refs.emplace_back(format("missing%u@example.com",
+						 static_cast<unsigned>(rng() % 10)));
+		else if (i != thread_start) {
+			const auto& parent{results.at(thread_start + rng() % (i - thread_start))};
+			refs = parent.refs_;
+			refs.emplace_back(parent.message_id_);
+		}
+		results.emplace_back(format("m%u@example.com", i), date, std::move(refs));
+		results.back().subject_ = format("Re: subject %u", static_cast<unsigned>(rng() % 3));
+	}
+
+	return results;
+}
+
+static void
+test_partitioned()
+{
+	for (auto&& descending : {false, true}) {
+		for (auto seed = 0U; seed != 20; ++seed) {
+			auto results{make_tangled_mock_results(500, seed)};
+			auto results2{results};
+
+			const auto order{calculate_threads(results, descending)};
+			const auto order2{calculate_threads_partitioned(results2, descending, 4)};
+			g_assert_true(order.positions == order2.positions);
+			g_assert_true(order.thread_ends == order2.thread_ends);
+
+			for (auto i = 0U; i != results.size(); ++i) {
+				const auto& qm1{results[i].query_match()};
+				const auto& qm2{results2[i].query_match()};
+				g_assert_cmpstr(qm1.thread_path.c_str(), ==,
+						qm2.thread_path.c_str());
+				g_assert_cmpuint(qm1.thread_level, ==, qm2.thread_level);
+				g_assert_cmpstr(qm1.thread_date.c_str(), ==,
+						qm2.thread_date.c_str());
+				g_assert_true(qm1.flags == qm2.flags);
+			}
+		}
+	}
+}
+
+static void
+test_order()
+{
+	for (auto seed = 0U; seed != 20; ++seed) {
+		auto       results{make_tangled_mock_results(500, seed)};
+		const auto order{calculate_threads(results, false /*ascending*/)};
+
+		// all messages with a thread-path, in the order of their
+		// thread-paths.
+		const auto threaded = std::count_if(results.begin(), results.end(), [](auto&& r) {
+			return !r.query_match().thread_path.empty();
+		});
+		g_assert_cmpuint(order.positions.size(), ==, static_cast<size_t>(threaded));
+		const auto path = [&](size_t pos) -> const std::string& {
+			return results.at(order.positions.at(pos)).query_match().thread_path;
+		};
+		for (auto i = 1U; i < order.positions.size(); ++i)
+			g_assert_cmpstr(path(i - 1).c_str(), <, path(i).c_str());
+
+		// and a thread is everything with the same root.
+		const auto root = [&](size_t pos) { return path(pos).substr(0, path(pos).find(':')); };
+		size_t     start{};
+		for (auto&& end : order.thread_ends) {
+			g_assert_cmpuint(start, <, end);
+			for (auto i = start + 1; i != end; ++i)
+				g_assert_cmpstr(root(i).c_str(), ==, root(start).c_str());
+			if (start != 0)
+				g_assert_cmpstr(root(start - 1).c_str(), !=, root(start).c_str());
+			start = end;
+		}
+		g_assert_cmpuint(start, ==, order.positions.size());
+	}
+}
+
+// The threader as it was before it moved to a flat arena of containers (see
+// calculate_threads_real()); test_differential() checks the two agree.
+namespace Reference {
+
+struct Container {
+	using Containers = std::vector<Container*>;
+
+	Container() = default;
+	Container(Option<QueryMatch&> msg) : query_match{msg} {}
+	Container(const Container&) = delete;
+	Container(Container&&)      = default;
+
+	void add_child(Container& new_child)
+	{
+		new_child.parent = this;
+		children.emplace_back(&new_child);
+	}
+	void remove_child(Container& child)
+	{
+		children.erase(std::find(children.begin(), children.end(), &child));
+	}
+	bool is_reachable(Container* other) const
+	{
+		auto up{ur_parent()};
+		return up && up == other->ur_parent();
+	}
+	template <typename Func> void for_each_child(Func&& func)
+	{
+		auto it{children.rbegin()};
+		while (it != children.rend()) {
+			auto next = std::next(it);
+			func(*it);
+			it = next;
+		}
+	}
+
+	std::string         thread_date_key;
+	Option<QueryMatch&> query_match;
+	bool                is_nuked{};
+	Container*          parent{};
+	Containers          children;
+
+private:
+	const Container* ur_parent() const { return parent ? parent->ur_parent() : this; }
+};
+
+using Containers = Container::Containers;
+using IdTable    = std::unordered_map<std::string, Container>;
+using DupTable   = std::multimap<std::string, Container>;
+using ThreadPath = std::vector<unsigned>;
+
+template <typename QueryResultsType>
+static IdTable
+determine_id_table(QueryResultsType& qres)
+{
+	IdTable  id_table;
+	DupTable dups;
+	for (auto&& mi : qres) {
+		const auto msgid{mi.message_id().value_or(*mi.path())};
+		if (mi.query_match().has_flag(QueryMatch::Flags::Duplicate)) {
+			dups.emplace(msgid, mi.query_match());
+			continue;
+		}
+		auto  c_it      = id_table.find(msgid);
+		auto& container = [&]() -> Container& {
+			if (c_it != id_table.end()) {
+				if (!c_it->second.query_match)
+					c_it->second.query_match = mi.query_match();
+				return c_it->second;
+			} else
+				return id_table.emplace(msgid, mi.query_match()).first->second;
+		}();
+
+		container.thread_date_key = container.query_match->date_key =
+		    mi.date().value_or("");
+		container.query_match->subject = mi.subject().value_or("");
+
+		Container* parent_ref_container{};
+		for (const auto& ref : mi.references()) {
+			auto ref_it = id_table.find(ref);
+			if (ref_it == id_table.end())
+				ref_it = id_table.emplace(ref, Nothing).first;
+			auto ref_container{&ref_it->second};
+			if (parent_ref_container && !ref_container->parent &&
+			    !parent_ref_container->is_reachable(ref_container))
+				parent_ref_container->add_child(*ref_container);
+			parent_ref_container = ref_container;
+		}
+		if (parent_ref_container && !container.parent &&
+		    !parent_ref_container->is_reachable(&container))
+			parent_ref_container->add_child(container);
+	}
+
+	// add duplicates as fake children
+	size_t n{};
+	for (auto&& dup : dups) {
+		auto it = id_table.find(dup.first);
+		if (it == id_table.end())
+			continue;
+		it->second.add_child(
+		    id_table.emplace(format("dup-%zu", ++n), std::move(dup.second)).first->second);
+	}
+
+	return id_table;
+}
+
+static void
+prune(Container* child)
+{
+	Container* container{child->parent};
+	for (auto& grandchild : child->children) {
+		grandchild->parent = container;
+		if (container)
+			container->children.emplace_back(grandchild);
+	}
+	child->children.clear();
+	child->is_nuked = true;
+	if (container)
+		container->remove_child(*child);
+}
+
+static bool
+prune_empty_containers(Container& container)
+{
+	Containers to_prune;
+	container.for_each_child([&](auto& child) {
+		if (prune_empty_containers(*child))
+			to_prune.emplace_back(child);
+	});
+	for (auto& child : to_prune)
+		prune(child);
+
+	if (container.query_match)
+		return false;
+
+	return container.parent || container.children.size() <= 1;
+}
+
+static std::string
+to_string(const ThreadPath& tpath, size_t digits)
+{
+	std::string str;
+	bool        first{true};
+	for (auto&& segm : tpath) {
+		str += format("%s%0*x", first ? "" : ":", (int)digits, segm);
+		first = false;
+	}
+
+	return str;
+}
+
+static bool
+update_container(Container& container, bool descending, ThreadPath& tpath, size_t seg_size,
+		 const std::string& prev_subject = "")
+{
+	if (!container.children.empty()) {
+		if (auto first = container.children.front(); first->query_match)
+			first->query_match->flags |= QueryMatch::Flags::First;
+		if (auto last = container.children.back(); last->query_match)
+			last->query_match->flags |= QueryMatch::Flags::Last;
+	}
+	if (!container.query_match)
+		return false;
+
+	auto& qmatch(*container.query_match);
+	if (!container.parent)
+		qmatch.flags |= QueryMatch::Flags::Root;
+	else if (!container.parent->query_match)
+		qmatch.flags |= QueryMatch::Flags::Orphan;
+	if (!container.children.empty())
+		qmatch.flags |= QueryMatch::Flags::HasChild;
+	if (qmatch.has_flag(QueryMatch::Flags::Root) || prev_subject.empty() ||
+	    !subject_matches(prev_subject, qmatch.subject))
+		qmatch.flags |= QueryMatch::Flags::ThreadSubject;
+
+	if (descending && container.parent)
+		tpath.back() = ((1U << (4 * seg_size)) - 1) - tpath.back();
+
+	qmatch.thread_path  = to_string(tpath, seg_size);
+	qmatch.thread_level = tpath.size() - 1;
+	if (descending)
+		qmatch.thread_path += ":z";
+
+	return true;
+}
+
+static void
+update_containers(Containers& children, bool descending, ThreadPath& tpath, size_t seg_size,
+		  std::string& prev_subject)
+{
+	size_t idx{0};
+	for (auto&& c : children) {
+		tpath.emplace_back(idx++);
+		if (c->query_match) {
+			update_container(*c, descending, tpath, seg_size, prev_subject);
+			prev_subject = c->query_match->subject;
+		}
+		update_containers(c->children, descending, tpath, seg_size, prev_subject);
+		tpath.pop_back();
+	}
+}
+
+static void
+sort_container(Container& container)
+{
+	if (container.children.empty())
+		return;
+	for (auto& child : container.children)
+		sort_container(*child);
+	std::sort(container.children.begin(), container.children.end(),
+		  [&](auto&& c1, auto&& c2) { return c1->thread_date_key < c2->thread_date_key; });
+	if (const auto& newest_date = container.children.back()->thread_date_key;
+	    !newest_date.empty())
+		container.thread_date_key = newest_date;
+}
+
+template <typename Results>
+static void
+calculate_threads(Results& qres, bool descending)
+{
+	auto id_table{determine_id_table(qres)};
+
+	for (auto&& item : id_table)
+		if (!item.second.parent && prune_empty_containers(item.second))
+			prune(&item.second);
+
+	Containers root_vec;
+	for (auto&& item : id_table)
+		if (!item.second.parent && !item.second.is_nuked)
+			root_vec.emplace_back(&item.second);
+	for (auto&& c : root_vec)
+		sort_container(*c);
+	std::sort(root_vec.begin(), root_vec.end(), [&](auto&& c1, auto&& c2) {
+		return descending ? c2->thread_date_key < c1->thread_date_key
+				  : c1->thread_date_key < c2->thread_date_key;
+	});
+
+	ThreadPath tpath;
+	const auto seg_size{static_cast<size_t>(std::ceil(std::log2(id_table.size()) / 4.0))};
+	size_t     idx{0};
+	for (auto&& c : root_vec) {
+		tpath.emplace_back(idx++);
+		std::string prev_subject;
+		if (update_container(*c, descending, tpath, seg_size))
+			prev_subject = c->query_match->subject;
+		update_containers(c->children, descending, tpath, seg_size, prev_subject);
+		tpath.pop_back();
+	}
+
+	for (auto&& item : id_table)
+		if (item.second.query_match)
+			item.second.query_match->thread_date = item.second.thread_date_key;
+}
+
+} // namespace Reference
+
+// random, tangled threads, with (flagged and unflagged) duplicates, and
+// references to missing messages. Dates are distinct, since the reference
+// threader does not sort stably.
+static MockQueryResults
+make_random_mock_results(unsigned seed)
+{
+	std::mt19937     rng{seed};
+	const auto       n{1 + rng() % 60};
+	MockQueryResults results;
+
+	std::unordered_set<std::string> seen;
+	for (auto i = 0U; i != n; ++i) {
+		std::vector<std::string> refs(rng() % 5);
+		for (auto&& ref : refs)
+			ref = format("m%u", static_cast<unsigned>(rng() % (n + 10)));
+		results.emplace_back(format("m%u", static_cast<unsigned>(rng() % (n + 10))),
+				     format("%06u", i * 7919 % 1000003), std::move(refs));
+		results.back().subject_ = (rng() % 3) ? "foo" : "Re: bar";
+		if (!seen.emplace(results.back().message_id_).second && rng() % 2)
+			results.back().query_match_.flags = QueryMatch::Flags::Duplicate;
+	}
+
+	return results;
+}
+
+static void
+test_differential()
+{
+	for (auto&& descending : {false, true}) {
+		for (auto seed = 0U; seed != 1500; ++seed) {
+			auto results{make_random_mock_results(seed)};
+			auto results2{results};
+
+			calculate_threads(results, descending);
+			Reference::calculate_threads(results2, descending);
+
+			for (auto i = 0U; i != results.size(); ++i) {
+				const auto& qm1{results[i].query_match()};
+				const auto& qm2{results2[i].query_match()};
+				g_assert_cmpstr(qm1.thread_path.c_str(), ==,
+						qm2.thread_path.c_str());
+				g_assert_cmpuint(qm1.thread_level, ==, qm2.thread_level);
+				g_assert_cmpstr(qm1.thread_date.c_str(), ==,
+						qm2.thread_date.c_str());
+				g_assert_true(qm1.flags == qm2.flags);
+			}
+		}
+	}
+}
+
+static void
+test_perf()
+{
+	const auto workers{std::max(std::thread::hardware_concurrency(), 1U)};
+
+	for (auto&& n : {100000U, 1000000U, 5000000U}) {
+		auto results{make_mock_results(n)};
+		auto results2{results};
+
+		g_test_timer_start();
+		calculate_threads(results, true);
+		const auto elapsed{g_test_timer_elapsed()};
+
+		g_test_timer_start();
+		calculate_threads_partitioned(results2, true, workers);
+		const auto elapsed2{g_test_timer_elapsed()};
+
+		struct rusage usage {};
+		::getrusage(RUSAGE_SELF, &usage);
+		g_test_message("%u matches: %.3fs; partitioned (%u workers): %.3fs; "
+			       "peak memory (so far): %ld MiB",
+			       n, elapsed, workers, elapsed2, usage.ru_maxrss / 1024);
+	}
+}
+
 int
 main(int argc, char* argv[])
 try {
@@ -906,6 +2039,11 @@ try {
 
 	g_test_add_func("/threader/thread-info/ascending", test_thread_info_ascending);
 	g_test_add_func("/threader/thread-info/descending", test_thread_info_descending);
+	g_test_add_func("/threader/partitioned", test_partitioned);
+	g_test_add_func("/threader/order", test_order);
+	g_test_add_func("/threader/differential", test_differential);
+	if (g_test_perf())
+		g_test_add_func("/threader/perf", test_perf);
 
 	return g_test_run();
 } catch (const std::runtime_error& re) {
@@ -23,18 +23,69 @@
 #include "mu-query-results.hh"
 
 namespace Mu {
+/**
+ * The threaded order of query results.
+ */
+struct ThreadOrder {
+	QueryOrder          positions;   /**< Positions of the matches, thread by thread */
+	std::vector<size_t> thread_ends; /**< For each thread, the end of its positions */
+};
+
 /**
  * Calculate the threads for these query results; that is, determine the
- * thread-paths for each message, so we can let Xapian order them in the correct
- * order.
+ * thread-paths and other thread information for each message, and the order
+ * of the messages.
  *
  * Note - threads are sorted chronologically, and the messages below the top
  * level are always sorted in ascending orde
  *
+ * For bigger result sets, this uses multiple threads, each threading some of
+ * the messages, partitioned by their thread-id.
+ *
+ * @param qres query results
+ * @param descending whether to sort the top-level in descending order
+ *
+ * @return the threaded order of the results
+ */
+ThreadOrder calculate_threads(QueryResults& qres, bool descending);
+
+/**
+ * Like calculate_threads(), but using the thread-paths the store determined
+ * when indexing the messages (see calculate_thread_paths()), rather than
+ * threading the messages from scratch; this only has to sort them.
+ *
+ * Messages whose thread-ancestors are not in the results are attached to their
+ * nearest ancestor that is, or become a thread-root otherwise.
+ *
  * @param qres query results
  * @param descending whether to sort the top-level in descending order
+ *
+ * @return the threaded order of the results, or Nothing if some of the
+ * messages do not have a thread-path (e.g., in stores from older versions), in
+ * which case the caller should use calculate_threads() instead.
+ */
+Option<ThreadOrder> calculate_threads_from_paths(QueryResults& qres, bool descending);
+
+/**
+ * A message for calculate_thread_paths().
+ */
+struct ThreadMessage {
+	std::string              message_id; /**< The message-id */
+	std::string              date;       /**< The date (as in the Date value) */
+	std::vector<std::string> references; /**< The references */
+	std::string              thread_path; /**< Result: the thread-path */
+};
+
+/**
+ * Calculate the thread-paths for all the messages in some thread (i.e., all
+ * messages with the same thread-id), as calculate_threads() would for
+ * ascending order. The store does this at index-time, so queries do not have
+ * to (see calculate_threads_from_paths()). Thread-paths can only be compared
+ * with those from the same thread.
+ *
+ * @param msgs the messages; their thread_path is set
  */
-void calculate_threads(QueryResults& qres, bool descending);
+void calculate_thread_paths(std::vector<ThreadMessage>& msgs);
 
 } // namespace Mu
 
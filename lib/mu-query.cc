@@ -24,8 +24,12 @@
 #include <cstring>
 #include <sstream>
 #include <cmath>
+#include <algorithm>
+#include <unordered_set>
+#include <thread>
 
 #include <stdlib.h>
+#include <unistd.h>
 #include <xapian.h>
 #include <glib/gstdio.h>
 
@@ -36,19 +40,23 @@
 
 using namespace Mu;
 
+// with LazyUnreadable, the minimum number of results for each thread that
+// checks them, and the maximum number of those threads.
+constexpr size_t MinLazyChecks   = 64;
+constexpr size_t MaxLazyCheckers = 4;
+
 struct Query::Private {
-	Private(const Store& store) : store_{store}, parser_{store_} {}
+	Private(const Store& store, const Xapian::Database& db)
+	    : store_{store}, db_{db}, parser_{db_} {}
 	// New
 	// bool calculate_threads (Xapian::Enquire& enq, size maxnum);
 
 	Xapian::Enquire make_enquire(const std::string&       expr,
 				     std::optional<Field::Id> sortfield_id,
 				     QueryFlags               qflags) const;
-	Xapian::Enquire make_related_enquire(const StringSet&         thread_ids,
-					     std::optional<Field::Id> sortfield_id,
-					     QueryFlags               qflags) const;
+	Xapian::Enquire make_related_enquire(const std::string& thread_id) const;
 
-	Option<QueryResults> run_threaded(QueryResults&& qres, Xapian::Enquire& enq,
+	Option<QueryResults> run_threaded(QueryResults&& qres, const Xapian::MSet& mset,
 					  QueryFlags qflags, size_t max_size) const;
 	Option<QueryResults> run_singular(const std::string&       expr,
 					  std::optional<Field::Id> sortfield_id,
@@ -61,13 +69,22 @@ struct Query::Private {
 				 std::optional<Field::Id> sortfield_id, QueryFlags qflags,
 				 size_t maxnum) const;
 
-	size_t store_size() const { return store_.database().get_doccount(); }
+	DeciderInfo make_decider_info() const;
+	void        check_readable(QueryResults& qres) const;
+	void        lazy_check_readable(QueryResults& qres, QueryFlags qflags) const;
+
+	size_t store_size() const { return db_.get_doccount(); }
 
-	const Store& store_;
-	const Parser parser_;
+	const Store&            store_;
+	const Xapian::Database& db_;
+	const Parser            parser_;
 };
 
-Query::Query(const Store& store) : priv_{std::make_unique<Private>(store)} {}
+Query::Query(const Store& store)
+    : priv_{std::make_unique<Private>(store, store.database())} {}
+
+Query::Query(const Store& store, const Xapian::Database& db)
+    : priv_{std::make_unique<Private>(store, db)} {}
 
 Query::Query(Query&& other) = default;
 
@@ -87,7 +104,7 @@ Query::Private::make_enquire(const std::string&       expr,
 			     std::optional<Field::Id> sortfield_id,
 			     QueryFlags               qflags) const
 {
-	Xapian::Enquire enq{store_.database()};
+	Xapian::Enquire enq{db_};
 
 	if (expr.empty() || expr == R"("")")
 		enq.set_query(Xapian::Query::MatchAll);
@@ -107,51 +124,134 @@ Query::Private::make_enquire(const std::string&       expr,
 }
 
 Xapian::Enquire
-Query::Private::make_related_enquire(const StringSet& thread_ids,
-				     std::optional<Field::Id> sortfield_id,
-				     QueryFlags qflags) const
+Query::Private::make_related_enquire(const std::string& thread_id) const
 {
-	Xapian::Enquire            enq{store_.database()};
-	std::vector<Xapian::Query> qvec;
-	for (auto&& t : thread_ids)
-		qvec.emplace_back(field_from_id(Field::Id::ThreadId).xapian_term(t));
+	Xapian::Enquire enq{db_};
+	enq.set_query(Xapian::Query{field_from_id(Field::Id::ThreadId).xapian_term(thread_id)});
 
-	Xapian::Query qr{Xapian::Query::OP_OR, qvec.begin(), qvec.end()};
-	enq.set_query(qr);
-
-	if (sortfield_id)
-		sort_enquire(enq, *sortfield_id, qflags);
+	// without weights or sorting, xapian can stop as soon as it has
+	// enough matches. Newest (i.e., highest docid) first, so a cap drops
+	// the oldest messages.
+	enq.set_weighting_scheme(Xapian::BoolWeight{});
+	enq.set_docid_order(Xapian::Enquire::DESCENDING);
 
 	return enq;
 }
 
-struct ThreadKeyMaker : public Xapian::KeyMaker {
-	ThreadKeyMaker(const QueryMatches& matches) : match_info_(matches) {}
-	std::string operator()(const Xapian::Document& doc) const override
-	{
-		const auto it{match_info_.find(doc.get_docid())};
-		return (it == match_info_.end()) ? "" : it->second.thread_path;
+/// The unique-id term of a document; unlike its docid, this finds the
+/// document in a database combined from shards, too.
+static Option<std::string>
+uid_term(const Xapian::Document& doc)
+{
+	const auto prefix{field_from_id(Field::Id::Uid).xapian_term()};
+
+	auto it{doc.termlist_begin()};
+	it.skip_to(prefix);
+	if (it == doc.termlist_end() || (*it).compare(0, prefix.length(), prefix) != 0)
+		return Nothing;
+
+	return Some(*it);
+}
+
+DeciderInfo
+Query::Private::make_decider_info() const
+{
+	DeciderInfo info{};
+	if (store_.readability().is_tracking())
+		info.readability = &store_.readability();
+
+	return info;
+}
+
+void
+Query::Private::check_readable(QueryResults& qres) const
+{
+	// only the matches we actually return.
+	std::vector<std::pair<QueryMatch*, std::string>> matches;
+	for (auto&& mi : qres) {
+		auto path{mi.path()};
+		if (path)
+			matches.emplace_back(&mi.query_match(), std::move(*path));
+		else
+			mi.query_match().flags |= QueryMatch::Flags::Unreadable;
 	}
-	const QueryMatches& match_info_;
-};
+
+	const auto& readability{store_.readability()};
+	const auto  check = [&](size_t i) {
+		auto&& [qmatch, path] = matches[i];
+		const auto readable{readability.is_readable(path)};
+		if (readable ? !*readable : ::access(path.c_str(), R_OK) != 0)
+			qmatch->flags |= QueryMatch::Flags::Unreadable;
+	};
+
+	// this is I/O-bound (and may be slow, e.g. on NFS), so check them in
+	// parallel -- but with only a few threads, since this happens for
+	// every query.
+	const auto n_checkers{std::min(MaxLazyCheckers,
+				       (matches.size() + MinLazyChecks - 1) / MinLazyChecks)};
+	if (n_checkers <= 1) {
+		for (auto i = 0U; i != matches.size(); ++i)
+			check(i);
+	} else {
+		std::vector<std::thread> checkers;
+		for (auto i = 0U; i != n_checkers; ++i)
+			checkers.emplace_back([&, i] {
+				for (auto j = i; j < matches.size(); j += n_checkers)
+					check(j);
+			});
+		for (auto&& checker : checkers)
+			checker.join();
+	}
+}
+
+void
+Query::Private::lazy_check_readable(QueryResults& qres, QueryFlags qflags) const
+{
+	// with LazyUnreadable, the deciders did not check the file-system; so
+	// check the results now -- which means we may return fewer than maxnum.
+	// This must happen before threading, so the threads are built from
+	// the messages that remain.
+	if (none_of(qflags & QueryFlags::LazyUnreadable))
+		return;
+
+	check_readable(qres);
+	if (any_of(qflags & QueryFlags::SkipUnreadable))
+		qres.remove_if([](auto&& qmatch) {
+			return qmatch.has_flag(QueryMatch::Flags::Unreadable);
+		});
+}
 
 Option<QueryResults>
-Query::Private::run_threaded(QueryResults&& qres, Xapian::Enquire& enq, QueryFlags qflags,
+Query::Private::run_threaded(QueryResults&& qres, const Xapian::MSet& mset, QueryFlags qflags,
 			     size_t maxnum) const
 {
 	const auto descending{any_of(qflags & QueryFlags::Descending)};
 
-	calculate_threads(qres, descending);
+	// use the thread-paths from the store if we can; otherwise, thread
+	// from scratch.
+	auto order{calculate_threads_from_paths(qres, descending)};
+	if (!order)
+		order = calculate_threads(qres, descending);
+
+	// take whole threads, up to maxnum messages -- but at least the first
+	// thread, however big.
+	size_t end{};
+	for (auto&& thread_end : order->thread_ends) {
+		if (thread_end > maxnum && end != 0)
+			break;
+		end = thread_end;
+	}
+	order->positions.resize(end);
 
-	ThreadKeyMaker key_maker{qres.query_matches()};
-	enq.set_sort_by_key(&key_maker, descending);
+	// the positions are those in qres, which may be fewer than in the
+	// mset (see lazy_check_readable()).
+	for (auto&& pos : order->positions)
+		pos = qres.mset_position(pos);
 
-	DeciderInfo minfo;
-	minfo.matches = qres.query_matches();
-	auto mset{enq.get_mset(0, maxnum, {}, make_thread_decider(qflags, minfo).get())};
-	mset.fetch();
+	QueryResults tres{mset, std::move(qres.query_matches()), std::move(order->positions)};
+	tres.stats() = qres.stats();
 
-	return QueryResults{mset, std::move(qres.query_matches())};
+	return tres;
 }
 
 Option<QueryResults>
@@ -168,7 +268,7 @@ Query::Private::run_singular(const std::string& expr,
 	const auto singular_qflags{qflags | QueryFlags::Leader};
 	const auto threading{any_of(qflags & QueryFlags::Threading)};
 
-	DeciderInfo minfo{};
+	auto minfo{make_decider_info()};
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wextra"
 	auto enq{make_enquire(expr, threading ? Field::Id::Date : sortfield_id, qflags)};
@@ -179,8 +279,9 @@ Query::Private::run_singular(const std::string& expr,
 	mset.fetch();
 
 	auto qres{QueryResults{mset, std::move(minfo.matches)}};
+	lazy_check_readable(qres, qflags);
 
-	return threading ? run_threaded(std::move(qres), enq, qflags, maxnum) : qres;
+	return threading ? run_threaded(std::move(qres), mset, qflags, maxnum) : qres;
 }
 
 static Option<std::string>
@@ -211,35 +312,62 @@ Query::Private::run_related(const std::string& expr,
 	const auto threading{any_of(qflags & QueryFlags::Threading)};
 
 	// Run our first, "leader" query
-	DeciderInfo minfo{};
+	auto minfo{make_decider_info()};
 	auto        enq{make_enquire(expr, Field::Id::Date, leader_qflags)};
 	const auto  mset{
 	    enq.get_mset(0, maxnum, {}, make_leader_decider(leader_qflags, minfo).get())};
 
-	// Gather the thread-ids we found
+	// Gather the leaders and their thread-ids, in order.
 	mset.fetch();
+	std::unordered_set<Xapian::docid> seen;
+	std::vector<std::string>          uid_terms;
+	std::vector<std::string>          thread_ids;
+	const auto add_doc = [&](const Xapian::MSetIterator& it) {
+		if (!seen.emplace(*it).second)
+			return;
+		if (auto term{uid_term(it.get_document())}; term)
+			uid_terms.emplace_back(std::move(*term));
+	};
 	for (auto it = mset.begin(); it != mset.end(); ++it) {
+		add_doc(it);
 		auto thread_id{opt_string(it.get_document(), Field::Id::ThreadId)};
-		if (thread_id)
-			minfo.thread_ids.emplace(std::move(*thread_id));
+		if (thread_id && minfo.thread_ids.emplace(*thread_id).second)
+			thread_ids.emplace_back(std::move(*thread_id));
 	}
 
-	// Now, determine the "related query".
-	//
-	// In the threaded-case, we search among _all_ messages, since complete
-	// threads are preferred; no need to sort in that case since the search
-	// is unlimited and the sorting happens during threading.
-	auto r_enq = std::invoke([&]{
-		if (threading)
-			return make_related_enquire(minfo.thread_ids, std::nullopt, qflags);
-		else
-			return make_related_enquire(minfo.thread_ids, sortfield_id, qflags);
-	});
+	// Now, add the related messages, thread by thread, in the order of
+	// their leaders -- at most max_related per thread (the newest ones),
+	// until the threads we filled have enough messages for maxnum.
+	const auto max_related{store_.properties().max_related};
+	const auto related_decider{make_related_decider(qflags, minfo)};
+	size_t     filled{};
+	for (auto&& thread_id : thread_ids) {
+		if (filled >= maxnum)
+			break;
+		const auto r_mset{make_related_enquire(thread_id).get_mset(
+		    0, max_related, {}, related_decider.get())};
+		r_mset.fetch();
+		for (auto it = r_mset.begin(); it != r_mset.end(); ++it)
+			add_doc(it);
+		filled += r_mset.size();
+	}
 
-	const auto r_mset{r_enq.get_mset(0, threading ? store_size() : maxnum, {},
-					 make_related_decider(qflags, minfo).get())};
+	// and get all of those in a single MSet, by their unique-id terms,
+	// sorted as requested in the non-threaded case; no need to sort in the
+	// threaded case, since the sorting happens during threading.
+	const auto      num{uid_terms.size()};
+	Xapian::Enquire r_enq{db_};
+	r_enq.set_query(Xapian::Query{Xapian::Query::OP_OR, uid_terms.begin(), uid_terms.end()});
+	r_enq.set_weighting_scheme(Xapian::BoolWeight{});
+	if (!threading && sortfield_id)
+		sort_enquire(r_enq, *sortfield_id, qflags);
+
+	const auto r_mset{r_enq.get_mset(0, threading ? num : maxnum)};
 	auto       qres{QueryResults{r_mset, std::move(minfo.matches)}};
-	return threading ? run_threaded(std::move(qres), r_enq, qflags, maxnum) : qres;
+	qres.stats().related_examined = minfo.related_examined;
+	lazy_check_readable(qres, qflags);
+
+	return threading ? run_threaded(std::move(qres), r_mset, qflags, maxnum) : qres;
 }
 
 Option<QueryResults>
@@ -252,10 +380,9 @@ Query::Private::run(const std::string&                expr,
 #pragma GCC diagnostic ignored "-Wextra"
 	const auto eff_sortfield{sortfield_id.value_or(Field::Id::Date)};
 #pragma GCC diagnostic pop
-	if (any_of(qflags & QueryFlags::IncludeRelated))
-		return run_related(expr, eff_sortfield, qflags, eff_maxnum);
-	else
-		return run_singular(expr, eff_sortfield, qflags, eff_maxnum);
+	return any_of(qflags & QueryFlags::IncludeRelated)
+		   ? run_related(expr, eff_sortfield, qflags, eff_maxnum)
+		   : run_singular(expr, eff_sortfield, qflags, eff_maxnum);
 }
 
 Option<QueryResults>
@@ -270,7 +397,11 @@ try {
 	    any_of(qflags & QueryFlags::IncludeRelated) ? "yes" : "no",
 	    any_of(qflags & QueryFlags::Threading) ? "yes" : "no", maxnum)};
 
-	return priv_->run(expr, sortfield_id, qflags, maxnum);
+	auto qres{priv_->run(expr, sortfield_id, qflags, maxnum)};
+	if (qres && any_of(qflags & QueryFlags::IncludeRelated))
+		g_debug("examined %zu related message(s)", qres->stats().related_examined);
+
+	return qres;
 
 } catch (...) {
 	return Nothing;
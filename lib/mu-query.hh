@@ -80,6 +80,15 @@ private:
 	 * @param store a MuStore object
 	 */
 	Query(const Store& store);
+
+	/**
+	 * Construct a new Query instance for some specific database of the
+	 * store, such as a snapshot (see Store::snapshot()).
+	 *
+	 * @param store a MuStore object
+	 * @param db the database
+	 */
+	Query(const Store& store, const Xapian::Database& db);
 	/**
 	 * DTOR
 	 *
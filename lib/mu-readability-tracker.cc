@@ -0,0 +1,91 @@
+/*
+** Copyright (C) 2022 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#include "mu-readability-tracker.hh"
+
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+
+#include <glib.h>
+
+using namespace Mu;
+
+struct ReadabilityTracker::Private {
+	std::atomic<bool>               tracking_{};
+	mutable std::mutex              lock_;
+	std::unordered_set<std::string> gone_;
+};
+
+ReadabilityTracker::ReadabilityTracker() : priv_{std::make_unique<Private>()} {}
+
+ReadabilityTracker::~ReadabilityTracker() = default;
+
+void
+ReadabilityTracker::start_tracking()
+{
+	if (!priv_->tracking_.exchange(true))
+		g_debug("started readability tracking");
+}
+
+void
+ReadabilityTracker::stop_tracking()
+{
+	if (priv_->tracking_.exchange(false))
+		g_debug("stopped readability tracking");
+}
+
+bool
+ReadabilityTracker::is_tracking() const
+{
+	return priv_->tracking_;
+}
+
+void
+ReadabilityTracker::mark_gone(const std::string& path)
+{
+	std::lock_guard lock{priv_->lock_};
+	priv_->gone_.emplace(path);
+}
+
+void
+ReadabilityTracker::mark_present(const std::string& path)
+{
+	std::lock_guard lock{priv_->lock_};
+	priv_->gone_.erase(path);
+}
+
+void
+ReadabilityTracker::clear()
+{
+	stop_tracking();
+
+	std::lock_guard lock{priv_->lock_};
+	priv_->gone_.clear();
+}
+
+Option<bool>
+ReadabilityTracker::is_readable(const std::string& path) const
+{
+	if (!priv_->tracking_)
+		return Nothing;
+
+	std::lock_guard lock{priv_->lock_};
+	return Some(priv_->gone_.find(path) == priv_->gone_.end());
+}
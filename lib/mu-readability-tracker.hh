@@ -0,0 +1,107 @@
+/*
+** Copyright (C) 2022 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#ifndef MU_READABILITY_TRACKER_HH__
+#define MU_READABILITY_TRACKER_HH__
+
+#include <memory>
+#include <string>
+
+#include <utils/mu-option.hh>
+
+namespace Mu {
+
+/// @brief Tracks which of the store's messages have a readable file.
+///
+/// After the indexer has completely scanned and cleaned up the maildir, and
+/// while it watches it for changes, the store reflects the file-system: every
+/// message in it has a file, except for the ones whose files disappeared but
+/// which were not removed from the store yet. The indexer marks those, so
+/// queries can find unreadable messages without touching the file-system.
+///
+/// When the tracker is not tracking (e.g., without a watching indexer, or
+/// when the indexer lost track of things), it knows nothing.
+///
+class ReadabilityTracker {
+public:
+	/**
+	 * Construct a tracker; it is not tracking yet.
+	 */
+	ReadabilityTracker();
+
+	/**
+	 * DTOR
+	 */
+	~ReadabilityTracker();
+
+	/**
+	 * Start tracking, i.e., declare that the store reflects the
+	 * file-system, apart from the paths marked as gone.
+	 */
+	void start_tracking();
+
+	/**
+	 * Stop tracking; until start_tracking() is called again, the tracker
+	 * does not know whether messages are readable. Marks are kept.
+	 */
+	void stop_tracking();
+
+	/**
+	 * Is the tracker tracking?
+	 *
+	 * @return true or false
+	 */
+	bool is_tracking() const;
+
+	/**
+	 * Mark the file for some path as gone.
+	 *
+	 * @param path full path to a message file
+	 */
+	void mark_gone(const std::string& path);
+
+	/**
+	 * Mark the file for some path as present (again).
+	 *
+	 * @param path full path to a message file
+	 */
+	void mark_present(const std::string& path);
+
+	/**
+	 * Forget all marks, and stop tracking.
+	 */
+	void clear();
+
+	/**
+	 * Is the file for some message (in the store) readable?
+	 *
+	 * @param path full path to a message file
+	 *
+	 * @return true or false, or Nothing if we're not tracking.
+	 */
+	Option<bool> is_readable(const std::string& path) const;
+
+private:
+	struct Private;
+	std::unique_ptr<Private> priv_;
+};
+
+} // namespace Mu
+
+#endif /* MU_READABILITY_TRACKER_HH__ */
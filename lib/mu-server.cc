@@ -100,6 +100,7 @@ struct Server::Private {
 	//
 	void add_handler(const Parameters& params);
 	void compose_handler(const Parameters& params);
+	void complete_contact_handler(const Parameters& params);
 	void contacts_handler(const Parameters& params);
 	void find_handler(const Parameters& params);
 	void help_handler(const Parameters& params);
@@ -223,6 +224,15 @@ Server::Private::make_command_map()
 		"compose a new message",
 		[&](const auto& params) { compose_handler(params); }});
 
+	cmap.emplace(
+	    "complete-contact",
+	    CommandInfo{
+		ArgMap{{":prefix", ArgInfo{Type::String, true, "prefix of some word in the contact"}},
+		       {":maxnum", ArgInfo{Type::Number, false, "maximum number of contacts"}},
+		       {":personal", ArgInfo{Type::Symbol, false, "only personal contacts"}}},
+		"get the most relevant contacts matching some prefix",
+		[&](const auto& params) { complete_contact_handler(params); }});
+
 	cmap.emplace(
 	    "contacts",
 	    CommandInfo{
@@ -272,7 +282,11 @@ Server::Private::make_command_map()
 		       {":lazy-check",
 			ArgInfo{Type::Symbol,
 				false,
-				"whether to avoid indexing up-to-date directories"}}},
+				"whether to avoid indexing up-to-date directories"}},
+		       {":watch",
+			ArgInfo{Type::Symbol,
+				false,
+				"whether to keep watching for changes after indexing"}}},
 		"scan maildir for new/updated/removed messages",
 		[&](const auto& params) { index_handler(params); }});
 
@@ -517,16 +531,14 @@ Server::Private::contacts_handler(const Parameters& params)
 	    afterstr.empty()
 		? 0
 		: g_ascii_strtoll(date_to_time_t_string(afterstr, true).c_str(), {}, 10)};
-	const auto tstamp = g_ascii_strtoll(tstampstr.c_str(), NULL, 10);
+	// the 'tstamp' is the change-sequence number from our previous reply.
+	const auto since = g_ascii_strtoll(tstampstr.c_str(), NULL, 10);
 
-	auto       rank{0};
-	Sexp::List contacts;
-	store().contacts_cache().for_each([&](const Contact& ci) {
-		rank++;
+	const auto& ccache{store().contacts_cache()};
+	const auto  cur_seq{ccache.seq()};
 
-		/* since the last time we got some contacts */
-		if (tstamp > ci.tstamp)
-			return;
+	Sexp::List contacts;
+	const auto add_contact = [&](const Contact& ci) {
 		/* (maybe) only include 'personal' contacts */
 		if (personal && !ci.personal)
 			return;
@@ -537,19 +549,53 @@ Server::Private::contacts_handler(const Parameters& params)
 		Sexp::List contact;
 		contact.add_prop(":address",
 				 Sexp::make_string(ci.display_name()));
-		contact.add_prop(":rank", Sexp::make_number(rank));
+		contact.add_prop(":email", Sexp::make_string(ci.email));
+		contact.add_prop(":rank", Sexp::make_number(ContactsCache::relevance(ci)));
 
 		contacts.add(Sexp::make_list(std::move(contact)));
-	});
+	};
+
+	/* only the contacts that changed since the last time, if possible;
+	 * the ranks of the others are still valid. */
+	const auto full{since <= 0 || !ccache.for_each_since(since, add_contact)};
+	if (full)
+		ccache.for_each(add_contact);
 
 	Sexp::List seq;
 	seq.add_prop(":contacts", Sexp::make_list(std::move(contacts)));
-	seq.add_prop(":tstamp",
-		     Sexp::make_string(format("%" G_GINT64_FORMAT, g_get_monotonic_time())));
+	seq.add_prop(":tstamp", Sexp::make_string(format("%" G_GINT64_FORMAT, cur_seq)));
+	if (full)
+		seq.add_prop(":full", Sexp::make_symbol("t"));
 	/* dump the contacts cache as a giant sexp */
 	output_sexp(std::move(seq));
 }
 
+void
+Server::Private::complete_contact_handler(const Parameters& params)
+{
+	const auto prefix{get_string_or(params, ":prefix")};
+	const auto maxnum{get_int_or(params, ":maxnum", 20)};
+	const auto personal{get_bool_or(params, ":personal")};
+
+	const auto completions{store().contacts_cache().complete(
+		prefix, static_cast<size_t>(std::max(maxnum, 0)),
+		[&](const Contact& contact) { return !personal || contact.personal; })};
+
+	// the same :rank as for the contacts command (higher is more relevant)
+	Sexp::List contacts;
+	for (auto&& ci : completions) {
+		Sexp::List contact;
+		contact.add_prop(":address", Sexp::make_string(ci.display_name()));
+		contact.add_prop(":rank", Sexp::make_number(ContactsCache::relevance(ci)));
+		contacts.add(Sexp::make_list(std::move(contact)));
+	}
+
+	Sexp::List seq;
+	seq.add_prop(":completions", Sexp::make_list(std::move(contacts)));
+	seq.add_prop(":prefix", Sexp::make_string(prefix));
+	output_sexp(std::move(seq));
+}
+
 /* get a *list* of all messages with the given message id */
 static std::vector<Store::Id>
 docids_for_msgid(const Store& store, const std::string& msgid, size_t max = 100)
@@ -679,7 +725,9 @@ Server::Private::find_handler(const Parameters& params)
 	if (batch_size < 1)
 		throw Error{Error::Code::InvalidArgument, "invalid batch-size %d", batch_size};
 
-	auto qflags{QueryFlags::SkipUnreadable}; // don't show unreadables.
+	// don't show unreadables; but only check the messages we show, rather
+	// than everything the query touches.
+	auto qflags{QueryFlags::SkipUnreadable | QueryFlags::LazyUnreadable};
 	if (descending)
 		qflags |= QueryFlags::Descending;
 	if (skip_dups)
@@ -689,10 +737,16 @@ Server::Private::find_handler(const Parameters& params)
 	if (threads)
 		qflags |= QueryFlags::Threading;
 
-	std::lock_guard l{store_.lock()};
-	auto qres{store_.run_query(q, sort_field->id, qflags, maxnum)};
+	// run the query against a snapshot, so we don't need the store lock,
+	// and don't have to wait for (nor block) indexing.
+	const auto snapshot{store_.snapshot()};
+	if (!snapshot.db)
+		throw Error(Error::Code::Store, "failed to get database snapshot");
+
+	auto qres{store_.run_query(snapshot, q, sort_field->id, qflags, maxnum)};
 	if (!qres)
 		throw Error(Error::Code::Query, "failed to run query");
+	g_debug("query on generation %zu", snapshot.generation);
 
 	/* before sending new results, send an 'erase' message, so the frontend
 	 * knows it should erase the headers buffer. this will ensure that the
@@ -768,6 +822,11 @@ get_stats(const Indexer::Progress& stats, const std::string& state)
 	lst.add_prop(":checked", Sexp::make_number(stats.checked));
 	lst.add_prop(":updated", Sexp::make_number(stats.updated));
 	lst.add_prop(":cleaned-up", Sexp::make_number(stats.removed));
+	lst.add_prop(":parsed", Sexp::make_number(stats.parsed));
+	lst.add_prop(":parse-rate", Sexp::make_number(static_cast<int>(stats.parse_rate())));
+	lst.add_prop(":write-rate", Sexp::make_number(static_cast<int>(stats.write_rate())));
+	lst.add_prop(":bytes-per-message",
+		     Sexp::make_number(static_cast<int>(stats.bytes_per_message())));
 
 	return lst;
 }
@@ -778,6 +837,7 @@ Server::Private::index_handler(const Parameters& params)
 	Mu::Indexer::Config conf{};
 	conf.cleanup    = get_bool_or(params, ":cleanup");
 	conf.lazy_check = get_bool_or(params, ":lazy-check");
+	conf.watch      = get_bool_or(params, ":watch");
 	// ignore .noupdate with an empty store.
 	conf.ignore_noupdate = store().empty();
 
@@ -788,9 +848,15 @@ Server::Private::index_handler(const Parameters& params)
 	// start a background track.
 	index_thread_ = std::thread([this, conf = std::move(conf)] {
 		indexer().start(conf);
+		size_t changes{};
 		while (indexer().is_running()) {
 			std::this_thread::sleep_for(std::chrono::milliseconds(2000));
-			output_sexp(get_stats(indexer().progress(), "running"), true);
+			// when watching, only report when something changed.
+			const auto& progress{indexer().progress()};
+			if (conf.watch && progress.updated + progress.removed == changes)
+				continue;
+			changes = progress.updated + progress.removed;
+			output_sexp(get_stats(progress, "running"), true);
 		}
 		output_sexp(get_stats(indexer().progress(), "complete"), true);
 	});
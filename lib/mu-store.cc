@@ -22,11 +22,14 @@
 #include <chrono>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <array>
+#include <algorithm>
 #include <cstdlib>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <atomic>
 #include <type_traits>
 #include <iostream>
@@ -35,13 +38,21 @@
 #include <vector>
 #include <xapian.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "mu-msg.hh"
 #include "mu-store.hh"
 #include "mu-query.hh"
+#include "mu-query-threads.hh"
 #include "utils/mu-str.h"
 #include "utils/mu-error.hh"
 
 #include "mu-msg-part.hh"
+#include "mu-maildir.hh"
 #include "utils/mu-utils.hh"
 #include "utils/mu-xapian-utils.hh"
 
@@ -51,12 +62,24 @@ static_assert(std::is_same<Store::Id, Xapian::docid>::value, "wrong type for Sto
 
 constexpr auto SchemaVersionKey     = "schema-version";
 constexpr auto RootMaildirKey       = "maildir"; // XXX: make this 'root-maildir'
-constexpr auto ContactsKey          = "contacts";
 constexpr auto PersonalAddressesKey = "personal-addresses";
 constexpr auto CreatedKey           = "created";
 constexpr auto BatchSizeKey         = "batch-size";
 constexpr auto DefaultBatchSize     = 250'000U;
 
+constexpr auto BatchMemoryKey     = "batch-memory";
+constexpr auto DefaultBatchMemory = 128 * 1024 * 1024U;
+
+constexpr auto BatchSecondsKey     = "batch-seconds";
+constexpr auto DefaultBatchSeconds = 300U;
+
+constexpr auto BackgroundCommitKey = "background-commit";
+
+constexpr auto ShardsKey = "shards";
+
+constexpr auto MaxRelatedKey     = "max-related";
+constexpr auto DefaultMaxRelated = 1000U;
+
 constexpr auto MaxMessageSizeKey     = "max-message-size";
 constexpr auto DefaultMaxMessageSize = 100'000'000U;
 
@@ -91,6 +114,13 @@ static uint64_t get_hash64 (const char* str)
 	return (hash<<32) | bkdrhash;
 }
 
+// the path for a shard of the database at db_path
+static std::string
+shard_path(const std::string& db_path, size_t shard)
+{
+	return format("%s/shard-%03zu", db_path.c_str(), shard);
+}
+
 struct Store::Private {
 	enum struct XapianOpts { ReadOnly, Open, CreateOverwrite, InMemory };
 
@@ -98,9 +128,12 @@ struct Store::Private {
 	    : read_only_{readonly}, db_{make_xapian_db(path,
 						       read_only_ ? XapianOpts::ReadOnly
 								  : XapianOpts::Open)},
-	      properties_{make_properties(path)}, contacts_cache_{db().get_metadata(ContactsKey),
-						     properties_.personal_addresses}
+	      properties_{make_properties(path)},
+	      contacts_cache_{[this](const std::string& key) { return db().get_metadata(key); },
+			      properties_.personal_addresses}
 	{
+		open_shards(read_only_ ? XapianOpts::ReadOnly : XapianOpts::Open);
+		db_file_id_ = file_id(path);
 	}
 
 	Private(const std::string& path,
@@ -111,6 +144,8 @@ struct Store::Private {
 	      properties_{init_metadata(conf, path, root_maildir, personal_addresses)},
 	      contacts_cache_{"", properties_.personal_addresses}
 	{
+		open_shards(XapianOpts::CreateOverwrite);
+		db_file_id_ = file_id(path);
 	}
 
 	Private(const std::string&   root_maildir,
@@ -125,6 +160,8 @@ struct Store::Private {
 	~Private()
 	try {
 		g_debug("closing store @ %s", properties_.database_path.c_str());
+		if (committer_.joinable())
+			committer_.join();
 		if (!read_only_) {
 			transaction_maybe_commit(true /*force*/);
 		}
@@ -160,7 +197,77 @@ struct Store::Private {
 				db_path.c_str());
 	}
 
-	const Xapian::Database& db() const { return *db_.get(); }
+	/*
+	 * A sharded store keeps its documents in a number of shards (each a
+	 * Xapian database of its own, in a subdirectory of the main one),
+	 * while the main database only keeps the metadata. For reading, the
+	 * main database and the shards are combined, in that order, so
+	 * metadata comes from the main database, and the docids interleave:
+	 * store-id = (shard-docid - 1) * (n-shards + 1) + shard + 2.
+	 */
+	std::string shard_path(size_t shard) const
+	{
+		return ::shard_path(properties_.database_path, shard);
+	}
+
+	void open_shards(XapianOpts opts)
+	{
+		if (properties_.shards == 0)
+			return;
+
+		auto combined{std::make_unique<Xapian::Database>(*db_)};
+		for (auto shard = 0U; shard != properties_.shards; ++shard) {
+			shards_.emplace_back(make_xapian_db(shard_path(shard), opts));
+			combined->add_database(*shards_.back());
+		}
+		combined_ = std::move(combined);
+		g_debug("opened %zu shard(s)", shards_.size());
+	}
+
+	// all messages in the same top-level maildir go to the same shard, so
+	// moving messages around in there does not move them between shards.
+	size_t shard_for_path(const std::string& path) const
+	{
+		const auto& root{properties_.root_maildir};
+		const auto  rel{path.compare(0, root.length(), root) == 0 ?
+				path.substr(root.length()) : path};
+		const auto  start{rel.find_first_not_of('/')};
+		const auto  end{start == std::string::npos ? start : rel.find('/', start)};
+
+		auto top{end == std::string::npos ? std::string{} :
+			 rel.substr(start, end - start)};
+		if (top == "cur" || top == "new")
+			top.clear(); // message in the root maildir
+
+		return get_hash64(top.c_str()) % shards_.size();
+	}
+
+	Store::Id store_id(size_t shard, Xapian::docid docid) const
+	{
+		return (docid - 1) * (shards_.size() + 1) + shard + 2;
+	}
+
+	std::pair<size_t, Xapian::docid> shard_docid(Store::Id id) const
+	{
+		const auto n{shards_.size() + 1};
+		const auto sub{(id - 1) % n};
+		if (id == 0 || sub == 0)
+			throw Mu::Error(Error::Code::InvalidArgument, "invalid id %u", id);
+
+		return {sub - 1, (id - 1) / n + 1};
+	}
+
+	const Xapian::Database& db() const { return combined_ ? *combined_ : *db_; }
+
+	// (device, inode) for the path, to recognize when the database was
+	// replaced (see Store::replace()).
+	static std::pair<dev_t, ino_t> file_id(const std::string& path)
+	{
+		struct stat statbuf {};
+		if (::stat(path.c_str(), &statbuf) != 0)
+			return {};
+		return {statbuf.st_dev, statbuf.st_ino};
+	}
 
 	Xapian::WritableDatabase& writable_db()
 	{
@@ -169,6 +276,128 @@ struct Store::Private {
 		return dynamic_cast<Xapian::WritableDatabase&>(*db_.get());
 	}
 
+	Xapian::WritableDatabase& writable_shard(size_t shard)
+	{
+		if (read_only_)
+			throw Mu::Error(Error::Code::AccessDenied, "database is read-only");
+		return dynamic_cast<Xapian::WritableDatabase&>(*shards_.at(shard));
+	}
+
+	Store::Id add_document(const std::string& path, const std::string& uid_term,
+			       const Xapian::Document& doc)
+	{
+		if (shards_.empty())
+			return writable_db().replace_document(uid_term, doc);
+
+		const auto shard{shard_for_path(path)};
+		return store_id(shard, writable_shard(shard).replace_document(uid_term, doc));
+	}
+
+	void replace_document(Store::Id id, const Xapian::Document& doc)
+	{
+		if (shards_.empty())
+			return writable_db().replace_document(id, doc);
+
+		const auto [shard, docid] = shard_docid(id);
+		writable_shard(shard).replace_document(docid, doc);
+	}
+
+	void delete_document(Store::Id id)
+	{
+		thread_changed(db().get_document(id));
+		if (shards_.empty())
+			return writable_db().delete_document(id);
+
+		const auto [shard, docid] = shard_docid(id);
+		writable_shard(shard).delete_document(docid);
+	}
+
+	void delete_document(const std::string& path, const std::string& uid_term)
+	{
+		for (auto it = db().postlist_begin(uid_term); it != db().postlist_end(uid_term); ++it)
+			thread_changed(db().get_document(*it));
+		if (shards_.empty())
+			return writable_db().delete_document(uid_term);
+
+		writable_shard(shard_for_path(path)).delete_document(uid_term);
+	}
+
+	/*
+	 * For each message, we keep its thread-path, i.e., its position in its
+	 * thread, so threaded queries only have to sort (see
+	 * calculate_threads_from_paths()). When messages are added or removed,
+	 * we re-thread all messages with the same thread-id, which also
+	 * re-roots the thread when some parent arrives after its children. In
+	 * a transaction, this happens (once per thread) when committing, just
+	 * before Xapian writes the batch, so each message only goes to disk
+	 * once, with its thread-path.
+	 */
+	void thread_changed(const Xapian::Document& doc)
+	{
+		auto thread_id{doc.get_value(field_from_id(Field::Id::ThreadId).value_no())};
+		if (!thread_id.empty())
+			dirty_threads_.emplace(std::move(thread_id));
+	}
+
+	// Outside of a transaction, Xapian only commits every so often by
+	// itself; so update the thread-paths and commit right away, so new
+	// snapshots (see snapshot()) see the change. Must be called with lock_
+	// held.
+	void untransacted_maybe_commit()
+	{
+		if (transaction_size_ != 0)
+			return; // committed with the transaction
+
+		update_thread_paths();
+		xapian_try([this] {
+			for (auto shard = 0U; shard != shards_.size(); ++shard)
+				writable_shard(shard).commit();
+			writable_db().commit();
+		});
+		++generation_; // snapshots are now out of date.
+	}
+
+	void update_thread_paths()
+	{
+		if (dirty_threads_.empty())
+			return;
+
+		g_debug("updating thread-paths for %zu thread(s)", dirty_threads_.size());
+		for (auto&& thread_id : dirty_threads_)
+			xapian_try([&] { update_thread_paths(thread_id); });
+		dirty_threads_.clear();
+	}
+
+	void update_thread_paths(const std::string& thread_id)
+	{
+		constexpr auto path_field{field_from_id(Field::Id::ThreadPath)};
+		const auto     term{field_from_id(Field::Id::ThreadId).xapian_term(thread_id)};
+
+		std::vector<std::pair<Store::Id, Xapian::Document>> docs;
+		std::vector<ThreadMessage>                         msgs;
+		for (auto it = db().postlist_begin(term); it != db().postlist_end(term); ++it) {
+			auto doc{db().get_document(*it)};
+			msgs.emplace_back(ThreadMessage{
+			    doc.get_value(field_from_id(Field::Id::MessageId).value_no()),
+			    doc.get_value(field_from_id(Field::Id::Date).value_no()),
+			    split(doc.get_value(field_from_id(Field::Id::References).value_no()),
+				  ","),
+			    {}});
+			docs.emplace_back(*it, std::move(doc));
+		}
+
+		calculate_thread_paths(msgs);
+
+		for (auto i = 0U; i != docs.size(); ++i) {
+			auto& [id, doc] = docs.at(i);
+			const auto& thread_path{msgs.at(i).thread_path};
+			if (doc.get_value(path_field.value_no()) == thread_path)
+				continue; // unchanged
+			doc.add_value(path_field.value_no(), thread_path);
+			replace_document(id, doc);
+		}
+	}
+
 	// If not started yet, start a transaction. Otherwise, just update the transaction size.
 	void transaction_inc() noexcept
 	{
@@ -177,34 +406,123 @@ struct Store::Private {
 
 		if (transaction_size_ == 0) {
 			g_debug("starting transaction");
-			xapian_try([this] { writable_db().begin_transaction(); });
+			xapian_try([this] {
+				writable_db().begin_transaction();
+				for (auto shard = 0U; shard != shards_.size(); ++shard)
+					writable_shard(shard).begin_transaction();
+			});
+			transaction_start_ = std::chrono::steady_clock::now();
+			transaction_bytes_ = 0;
 		}
 		++transaction_size_;
 	}
 
-	// Opportunistically commit a transaction if the transaction size
-	// filled up a batch, or with force.
+	// Is the current transaction due for committing? This is when we've
+	// collected a batch full of changes, or changes taking too much
+	// memory, or when the transaction has been going on for too long.
+	bool transaction_full() const noexcept
+	{
+		const auto elapsed{std::chrono::steady_clock::now() - transaction_start_};
+
+		return transaction_size_ >= properties_.batch_size ||
+		       transaction_bytes_ >= properties_.batch_memory ||
+		       elapsed >= std::chrono::seconds(properties_.batch_seconds);
+	}
+
+	// Opportunistically commit a transaction if it is full (see
+	// transaction_full()), or with force. Must be called with lock_ held.
 	void transaction_maybe_commit(bool force = false) noexcept
 	{
 		if (properties_.in_memory || transaction_size_ == 0)
 			return; // not supported or not in transaction
 
-		if (force || transaction_size_ >= properties_.batch_size) {
-			if (contacts_cache_.dirty()) {
-				xapian_try([&] {
-					writable_db().set_metadata(ContactsKey,
-								   contacts_cache_.serialize());
+		if (force)
+			transaction_commit();
+		else if (transaction_full()) {
+			if (!properties_.background_commit)
+				transaction_commit();
+			else if (!committing_) {
+				// commit in the background, so our caller can
+				// continue (e.g., with parsing the next batch)
+				// while Xapian writes things to disk. Since we hold
+				// the lock, an earlier committer is done with it.
+				committing_ = true;
+				if (committer_.joinable())
+					committer_.join();
+				committer_ = std::thread([this] {
+					std::lock_guard guard{lock_};
+					transaction_commit();
+					committing_ = false;
 				});
 			}
-			g_debug("committing transaction (n=%zu,%zu)",
-				transaction_size_, metadata_cache_.size());
-			xapian_try([this] {
-				writable_db().commit_transaction();
-				for (auto&& mdata : metadata_cache_)
-					writable_db().set_metadata(mdata.first, mdata.second);
-				transaction_size_ = 0;
+		}
+	}
+
+	void transaction_commit() noexcept
+	{
+		if (transaction_size_ == 0)
+			return; // nothing to do (anymore)
+
+		if (contacts_cache_.dirty()) {
+			xapian_try([&] {
+				contacts_cache_.serialize([this](auto&& key, auto&& val) {
+					writable_db().set_metadata(key, val);
+				});
 			});
 		}
+		g_debug("committing transaction (n=%zu,%zu; ~%zu KiB)",
+			transaction_size_, metadata_cache_.size(), transaction_bytes_ / 1024);
+		xapian_try([this] {
+			update_thread_paths();
+
+			// each shard has its own writer, so they can write
+			// their changes to disk in parallel.
+			std::vector<std::thread> committers;
+			for (auto shard = 0U; shard != shards_.size(); ++shard)
+				committers.emplace_back([this, shard] {
+					xapian_try([&] {
+						writable_shard(shard).commit_transaction();
+					});
+				});
+			for (auto&& committer : committers)
+				committer.join();
+			writable_db().commit_transaction();
+
+			for (auto&& mdata : metadata_cache_)
+				writable_db().set_metadata(mdata.first, mdata.second);
+			transaction_size_  = 0;
+			transaction_bytes_ = 0;
+		});
+		++generation_; // snapshots are now out of date.
+	}
+
+	Store::Snapshot snapshot()
+	{
+		// in-memory databases cannot be opened a second time, and
+		// read-only ones don't change (in this process, anyway). Note
+		// that this is not a copy, so users need the lock; see the
+		// Snapshot docs.
+		if (properties_.in_memory || read_only_)
+			return {std::shared_ptr<const Xapian::Database>(
+					std::shared_ptr<const Xapian::Database>{}, &db()),
+				generation_};
+
+		std::lock_guard guard{snapshot_lock_};
+
+		const size_t generation{generation_};
+		if (snapshot_ && snapshot_generation_ == generation &&
+		    snapshot_.use_count() == 1)
+			return {snapshot_, generation};
+
+		auto db{std::make_shared<Xapian::Database>(properties_.database_path)};
+		for (auto shard = 0U; shard != shards_.size(); ++shard)
+			db->add_database(Xapian::Database{shard_path(shard)});
+		if (!snapshot_ || snapshot_generation_ != generation) { // for re-use
+			snapshot_            = db;
+			snapshot_generation_ = generation;
+		}
+
+		return {std::move(db), generation};
 	}
 
 	void add_synonyms()
@@ -243,11 +561,24 @@ struct Store::Private {
 		props.created		 = ::atoll(db().get_metadata(CreatedKey).c_str());
 		props.read_only		 = read_only_;
 		props.batch_size	 = ::atoll(db().get_metadata(BatchSizeKey).c_str());
+		props.batch_memory	 = ::atoll(db().get_metadata(BatchMemoryKey).c_str());
+		props.batch_seconds	 = ::atoll(db().get_metadata(BatchSecondsKey).c_str());
+		props.background_commit	 = db().get_metadata(BackgroundCommitKey) == "yes";
 		props.max_message_size	 = ::atoll(db().get_metadata(MaxMessageSizeKey).c_str());
+		props.shards		 = ::atoll(db().get_metadata(ShardsKey).c_str());
+		props.max_related	 = ::atoll(db().get_metadata(MaxRelatedKey).c_str());
 		props.in_memory		 = db_path.empty();
 		props.root_maildir       = db().get_metadata(RootMaildirKey);
 		props.personal_addresses = Mu::split(db().get_metadata(PersonalAddressesKey), ",");
 
+		// for stores created before these settings existed.
+		if (props.batch_memory == 0)
+			props.batch_memory = DefaultBatchMemory;
+		if (props.batch_seconds == 0)
+			props.batch_seconds = DefaultBatchSeconds;
+		if (props.max_related == 0)
+			props.max_related = DefaultMaxRelated;
+
 		return props;
 	}
 
@@ -262,12 +593,31 @@ struct Store::Private {
 		const size_t batch_size = conf.batch_size ? conf.batch_size : DefaultBatchSize;
 		writable_db().set_metadata(BatchSizeKey, Mu::format("%zu", batch_size));
 
+		const size_t batch_memory = conf.batch_memory ? conf.batch_memory
+							      : DefaultBatchMemory;
+		writable_db().set_metadata(BatchMemoryKey, Mu::format("%zu", batch_memory));
+
+		const size_t batch_seconds = conf.batch_seconds ? conf.batch_seconds
+								: DefaultBatchSeconds;
+		writable_db().set_metadata(BatchSecondsKey, Mu::format("%zu", batch_seconds));
+
+		writable_db().set_metadata(BackgroundCommitKey,
+					   conf.background_commit ? "yes" : "no");
+
 		const size_t max_msg_size = conf.max_message_size ? conf.max_message_size
 								  : DefaultMaxMessageSize;
 		writable_db().set_metadata(MaxMessageSizeKey, Mu::format("%zu", max_msg_size));
 
 		writable_db().set_metadata(RootMaildirKey, root_maildir);
 
+		// in-memory databases cannot have shards (on disk).
+		const size_t shards = path.empty() ? 0 : conf.shards;
+		writable_db().set_metadata(ShardsKey, Mu::format("%zu", shards));
+
+		const size_t max_related = conf.max_related ? conf.max_related
+							    : DefaultMaxRelated;
+		writable_db().set_metadata(MaxRelatedKey, Mu::format("%zu", max_related));
+
 		std::string addrs;
 		for (const auto& addr : personal_addresses) { // _very_ minimal check.
 			if (addr.find(",") != std::string::npos)
@@ -281,21 +631,36 @@ struct Store::Private {
 		return make_properties(path);
 	}
 
-	Xapian::docid    add_or_update_msg(Xapian::docid docid, MuMsg* msg);
-	Xapian::Document new_doc_from_message(MuMsg* msg);
+	Xapian::docid add_or_update_msg(Xapian::docid docid, MuMsg* msg);
+	Xapian::docid add_or_update_prepared(Xapian::docid docid, PreparedMessage&& pmsg);
 
 	/* metadata to write as part of a transaction commit */
 	std::unordered_map<std::string, std::string> metadata_cache_;
+	/* threads with messages added or removed; see thread_changed() */
+	std::unordered_set<std::string> dirty_threads_;
 
 	const bool                        read_only_{};
 	std::unique_ptr<Xapian::Database> db_;
+	std::vector<std::unique_ptr<Xapian::Database>> shards_;  /* sharded store only */
+	std::unique_ptr<Xapian::Database>              combined_; /* db_ + shards_ */
+	std::pair<dev_t, ino_t>                        db_file_id_{}; /* see file_id() */
 
 	const Store::Properties properties_;
 	ContactsCache            contacts_cache_;
+	ReadabilityTracker       readability_;
 	std::unique_ptr<Indexer> indexer_;
 
 	size_t     transaction_size_{};
+	size_t     transaction_bytes_{}; /* estimated size of the changes */
+	std::chrono::steady_clock::time_point transaction_start_{};
+	std::thread       committer_; /* for background commits */
+	std::atomic<bool> committing_{};
 	std::mutex lock_;
+
+	std::atomic<size_t>                     generation_{}; /* number of commits */
+	std::mutex                              snapshot_lock_;
+	std::shared_ptr<const Xapian::Database> snapshot_; /* for re-use */
+	size_t                                  snapshot_generation_{};
 };
 
 static void
@@ -304,11 +669,13 @@ hash_str(char* buf, size_t buf_size, const char* data)
 	g_snprintf(buf, buf_size, "016%" PRIx64, get_hash64(data));
 }
 
+constexpr auto UidTermPrefix{"016"};
+
 static std::string
 get_uid_term(const char* path)
 {
 	return field_from_id(Field::Id::Uid).xapian_term(
-		format("016%" PRIx64, get_hash64(path)));
+		format("%s%" PRIx64, UidTermPrefix, get_hash64(path)));
 }
 
 Store::Store(const std::string& path, bool readonly)
@@ -337,6 +704,343 @@ Store::Store(const std::string& maildir, const StringVec& personal_addresses, co
 
 Store::~Store() = default;
 
+std::unique_ptr<Store>
+Store::make_like(const std::string& path, const std::string& new_path)
+{
+	// read the configuration directly from the database, since it may have
+	// some older schema the Store constructor would refuse.
+	const auto db = std::invoke([&] {
+		try {
+			return Xapian::Database{path};
+		} catch (const Xapian::Error& xerr) {
+			throw Mu::Error(Error::Code::Store, "failed to open store @ %s: %s",
+					path.c_str(), xerr.get_msg().c_str());
+		}
+	});
+
+	const auto root_maildir{db.get_metadata(RootMaildirKey)};
+	if (root_maildir.empty())
+		throw Mu::Error(Error::Code::Store, "no maildir for store @ %s", path.c_str());
+
+	Config conf{};
+	conf.max_message_size  = ::atoll(db.get_metadata(MaxMessageSizeKey).c_str());
+	conf.batch_size        = ::atoll(db.get_metadata(BatchSizeKey).c_str());
+	conf.batch_memory      = ::atoll(db.get_metadata(BatchMemoryKey).c_str());
+	conf.batch_seconds     = ::atoll(db.get_metadata(BatchSecondsKey).c_str());
+	conf.background_commit = db.get_metadata(BackgroundCommitKey) == "yes";
+	conf.shards            = ::atoll(db.get_metadata(ShardsKey).c_str());
+	conf.max_related       = ::atoll(db.get_metadata(MaxRelatedKey).c_str());
+
+	g_debug("creating store @ %s like %s", new_path.c_str(), path.c_str());
+
+	return std::make_unique<Store>(new_path, root_maildir,
+				       Mu::split(db.get_metadata(PersonalAddressesKey), ","),
+				       conf);
+}
+
+static void
+remove_dir(const std::string& path)
+{
+	if (auto dir{g_dir_open(path.c_str(), 0, {})}; dir) {
+		while (const auto name = g_dir_read_name(dir)) {
+			const auto fullpath{path + G_DIR_SEPARATOR_S + name};
+			if (g_file_test(fullpath.c_str(), G_FILE_TEST_IS_DIR) &&
+			    !g_file_test(fullpath.c_str(), G_FILE_TEST_IS_SYMLINK))
+				remove_dir(fullpath);
+			else if (::unlink(fullpath.c_str()) != 0)
+				g_warning("failed to remove %s: %s", fullpath.c_str(),
+					  g_strerror(errno));
+		}
+		g_dir_close(dir);
+	}
+
+	if (::rmdir(path.c_str()) != 0)
+		g_warning("failed to remove %s: %s", path.c_str(), g_strerror(errno));
+}
+
+// swap the database at new_path into path, atomically where the system
+// supports that; returns the path of the old database (for removing), or
+// empty if swapping failed.
+static std::string
+swap_in_database(const std::string& path, const std::string& new_path)
+{
+#ifdef HAVE_RENAMEAT2
+	// swap the directories atomically, so there is always a database
+	// at path; afterwards, new_path has the old one.
+	if (::renameat2(AT_FDCWD, new_path.c_str(), AT_FDCWD, path.c_str(),
+			RENAME_EXCHANGE) != 0) {
+		g_warning("failed to replace %s with %s: %s", path.c_str(),
+			  new_path.c_str(), g_strerror(errno));
+		return {};
+	}
+	return new_path;
+#else
+	// directories cannot be renamed over non-empty ones, so move the old
+	// one out of the way first; there is a short time without a database
+	// at path.
+	const auto old_path{path + ".old"};
+	if (::rename(path.c_str(), old_path.c_str()) != 0) {
+		g_warning("failed to move %s out of the way: %s", path.c_str(),
+			  g_strerror(errno));
+		return {};
+	}
+	if (::rename(new_path.c_str(), path.c_str()) != 0) {
+		g_warning("failed to replace %s with %s: %s", path.c_str(),
+			  new_path.c_str(), g_strerror(errno));
+		if (::rename(old_path.c_str(), path.c_str()) != 0)
+			g_critical("failed to restore %s: %s", path.c_str(),
+				   g_strerror(errno));
+		return {};
+	}
+	return old_path;
+#endif /*HAVE_RENAMEAT2*/
+}
+
+enum struct ReplaceResult { Replaced, Locked, Changed, Failed };
+
+// replace the database at path with the one at new_path, while holding the
+// write-locks of the former (and its shards), so no one can change it just
+// before it goes away. If revisions is non-null, only do so if the
+// database still has those revisions.
+static ReplaceResult
+replace_database(const std::string& path, const std::string& new_path,
+		 const std::vector<Xapian::rev>* revisions = {})
+{
+	std::string old_path;
+	try {
+		std::vector<Xapian::WritableDatabase> locked;
+		locked.emplace_back(path, Xapian::DB_OPEN);
+		const size_t shards = ::atoll(locked.front().get_metadata(ShardsKey).c_str());
+		for (auto shard = 0U; shard != shards; ++shard)
+			locked.emplace_back(shard_path(path, shard), Xapian::DB_OPEN);
+
+		if (revisions) {
+			std::vector<Xapian::rev> current;
+			for (auto&& db : locked)
+				current.emplace_back(db.get_revision());
+			if (current != *revisions)
+				return ReplaceResult::Changed;
+		}
+
+		old_path = swap_in_database(path, new_path);
+		if (old_path.empty())
+			return ReplaceResult::Failed;
+
+	} catch (const Xapian::DatabaseLockError& err) {
+		g_debug("store @ %s is locked: %s", path.c_str(), err.get_msg().c_str());
+		return ReplaceResult::Locked;
+	} catch (const Xapian::Error& err) {
+		g_warning("failed to replace store @ %s: %s", path.c_str(),
+			  err.get_msg().c_str());
+		return ReplaceResult::Failed;
+	}
+
+	remove_dir(old_path);
+	g_debug("replaced store @ %s with %s", path.c_str(), new_path.c_str());
+
+	return ReplaceResult::Replaced;
+}
+
+bool
+Store::replace(const std::string& path, const std::string& new_path)
+{
+	const auto res{replace_database(path, new_path)};
+	if (res == ReplaceResult::Locked)
+		g_warning("store @ %s is in use by another process; not replacing it",
+			  path.c_str());
+
+	return res == ReplaceResult::Replaced;
+}
+
+// compact a database to dst_path; either keeping the docids, or with the
+// documents renumbered in ascending date order.
+static void
+compact_database(Xapian::Database& db, const std::string& dst_path,
+		 bool renumber_by_date)
+{
+	if (!renumber_by_date) {
+		db.compact(dst_path, Xapian::DBCOMPACT_NO_RENUMBER);
+		return;
+	}
+
+	// Xapian cannot renumber in any particular order, so copy the
+	// documents in date order to a temporary database, and compact that.
+	constexpr auto date_no{field_from_id(Field::Id::Date).value_no()};
+	std::vector<std::pair<std::string, Xapian::docid>> order;
+	order.reserve(db.get_doccount());
+	auto vit{db.valuestream_begin(date_no)};
+	for (auto it = db.postlist_begin(""); it != db.postlist_end(""); ++it) {
+		if (vit != db.valuestream_end(date_no) && vit.get_docid() < *it)
+			vit.skip_to(*it);
+		const auto has_date{vit != db.valuestream_end(date_no) && vit.get_docid() == *it};
+		order.emplace_back(has_date ? *vit : std::string{}, *it);
+	}
+	std::sort(order.begin(), order.end()); // date values sort as strings
+
+	const auto tmp_path{dst_path + ".tmp"};
+	{
+		Xapian::WritableDatabase tmp{tmp_path, Xapian::DB_CREATE_OR_OVERWRITE};
+		for (auto&& item : order)
+			tmp.add_document(db.get_document(item.second));
+		for (auto it = db.metadata_keys_begin(); it != db.metadata_keys_end(); ++it)
+			tmp.set_metadata(*it, db.get_metadata(*it));
+		for (auto it = db.synonym_keys_begin(); it != db.synonym_keys_end(); ++it)
+			for (auto syn = db.synonyms_begin(*it); syn != db.synonyms_end(*it); ++syn)
+				tmp.add_synonym(*it, *syn);
+		tmp.commit();
+	}
+
+	Xapian::Database{tmp_path}.compact(dst_path);
+	remove_dir(tmp_path);
+}
+
+// compact the database at path (and its shards, if any) to new_path; returns
+// the revisions that were compacted, or empty for errors.
+static std::vector<Xapian::rev>
+compact_databases(const std::string& path, const std::string& new_path, bool renumber_by_date)
+{
+	if (::access(new_path.c_str(), F_OK) == 0)
+		remove_dir(new_path); // left over from some earlier attempt.
+
+	return xapian_try([&] {
+		Xapian::Database db{path};
+		std::vector<Xapian::rev> revisions{db.get_revision()};
+		compact_database(db, new_path, renumber_by_date);
+
+		const size_t shards = ::atoll(db.get_metadata(ShardsKey).c_str());
+		for (auto shard = 0U; shard != shards; ++shard) {
+			Xapian::Database shard_db{shard_path(path, shard)};
+			revisions.emplace_back(shard_db.get_revision());
+			compact_database(shard_db, shard_path(new_path, shard), renumber_by_date);
+		}
+
+		return revisions;
+	}, std::vector<Xapian::rev>{});
+}
+
+bool
+Store::compact(const std::string& path, bool renumber_by_date)
+{
+	using namespace std::chrono_literals;
+
+	const auto     new_path{path + ".compact"};
+	constexpr auto MaxAttempts{3};
+
+	// the store may be in use while we compact; only swap in the compacted
+	// database if no one changed the store in the mean time (checked while
+	// holding its write-lock), so no changes get lost. If some process
+	// holds the write-lock, wait a bit for it.
+	for (auto attempt = 0; attempt != MaxAttempts; ++attempt) {
+		const auto revisions{compact_databases(path, new_path, renumber_by_date)};
+		if (revisions.empty())
+			break;
+
+		auto res{replace_database(path, new_path, &revisions)};
+		for (auto wait = 0; res == ReplaceResult::Locked && wait != MaxAttempts; ++wait) {
+			std::this_thread::sleep_for(1s);
+			res = replace_database(path, new_path, &revisions);
+		}
+
+		if (res == ReplaceResult::Replaced)
+			return true;
+		else if (res == ReplaceResult::Locked) {
+			g_warning("store @ %s is in use by another process", path.c_str());
+			break;
+		} else if (res == ReplaceResult::Failed)
+			break;
+
+		g_message("store @ %s changed while compacting; retrying", path.c_str());
+	}
+
+	g_warning("failed to compact store @ %s", path.c_str());
+	if (::access(new_path.c_str(), F_OK) == 0)
+		remove_dir(new_path);
+
+	return false;
+}
+
+bool
+Store::compact_in_place(bool renumber_by_date)
+{
+	if (properties().in_memory || properties().read_only)
+		throw Error{Error::Code::Store, "cannot compact this store"};
+
+	if (priv_->indexer_ && priv_->indexer_->is_running()) {
+		g_warning("not compacting store while indexing");
+		return false;
+	}
+
+	const auto path{properties().database_path};
+	const auto new_path{path + ".compact"};
+	std::string old_path;
+	{
+		// we hold the write-lock, and with lock_, no one else can change the
+		// store in the mean time.
+		std::lock_guard guard{priv_->lock_};
+		priv_->transaction_maybe_commit(true /*force*/);
+
+		if (!compact_databases(path, new_path, renumber_by_date).empty())
+			old_path = swap_in_database(path, new_path);
+	}
+
+	if (old_path.empty()) {
+		g_warning("failed to compact store @ %s", path.c_str());
+		if (::access(new_path.c_str(), F_OK) == 0)
+			remove_dir(new_path);
+		return false;
+	}
+
+	// re-opening closes the old database, so we can remove it.
+	if (!reopen_if_replaced()) {
+		g_warning("failed to re-open compacted store @ %s", path.c_str());
+		return false;
+	}
+	remove_dir(old_path);
+
+	return true;
+}
+
+bool
+Store::replaced() const
+{
+	if (properties().in_memory)
+		return false;
+
+	return Private::file_id(properties().database_path) != priv_->db_file_id_;
+}
+
+bool
+Store::reopen_if_replaced()
+{
+	if (!replaced())
+		return false;
+
+	if (priv_->indexer_ && priv_->indexer_->is_running()) {
+		g_debug("store was replaced; not re-opening while indexing");
+		return false;
+	}
+
+	std::unique_ptr<Private> priv;
+	try {
+		priv = std::make_unique<Private>(properties().database_path,
+						 properties().read_only);
+	} catch (const Mu::Error& err) {
+		g_warning("failed to re-open replaced store: %s", err.what());
+		return false;
+	}
+	if (priv->properties_.schema_version != ExpectedSchemaVersion) {
+		g_warning("store @ %s was replaced with one with schema-version %s",
+			  properties().database_path.c_str(),
+			  priv->properties_.schema_version.c_str());
+		return false;
+	}
+
+	g_message("store @ %s was replaced; re-opened", properties().database_path.c_str());
+	priv_ = std::move(priv);
+
+	return true;
+}
+
 const Store::Properties&
 Store::properties() const
 {
@@ -355,6 +1059,19 @@ Store::database() const
 	return priv_->db();
 }
 
+Store::Snapshot
+Store::snapshot() const
+{
+	return xapian_try([&] { return priv_->snapshot(); },
+			  Snapshot{{}, priv_->generation_});
+}
+
+size_t
+Store::generation() const
+{
+	return priv_->generation_;
+}
+
 Xapian::WritableDatabase&
 Store::writable_database()
 {
@@ -374,6 +1091,18 @@ Store::indexer()
 	return *priv_->indexer_.get();
 }
 
+ReadabilityTracker&
+Store::readability()
+{
+	return priv_->readability_;
+}
+
+const ReadabilityTracker&
+Store::readability() const
+{
+	return priv_->readability_;
+}
+
 std::size_t
 Store::size() const
 {
@@ -417,26 +1146,23 @@ maildir_from_path(const std::string& root, const std::string& path)
 unsigned
 Store::add_message(const std::string& path, bool use_transaction)
 {
-	std::lock_guard guard{priv_->lock_};
+	return add_message(prepare_message(path), use_transaction);
+}
 
-	GError*    gerr{};
-	const auto maildir{maildir_from_path(properties().root_maildir, path)};
-	auto       msg{mu_msg_new_from_file(path.c_str(), maildir.c_str(), &gerr)};
-	if (G_UNLIKELY(!msg))
-		throw Error{Error::Code::Message,
-			    "failed to create message: %s",
-			    gerr ? gerr->message : "something went wrong"};
+unsigned
+Store::add_message(PreparedMessage&& pmsg, bool use_transaction)
+{
+	std::lock_guard guard{priv_->lock_};
 
 	if (use_transaction)
 		priv_->transaction_inc();
 
-	const auto docid{priv_->add_or_update_msg(0, msg)};
+	const auto path{pmsg.path};
+	const auto docid{priv_->add_or_update_prepared(0, std::move(pmsg))};
 
 	if (use_transaction) /* commit if batch is full */
 		priv_->transaction_maybe_commit();
 
-	mu_msg_unref(msg);
-
 	if (G_UNLIKELY(docid == InvalidId))
 		throw Error{Error::Code::Message, "failed to add message"};
 
@@ -459,13 +1185,22 @@ Store::update_message(MuMsg* msg, unsigned docid)
 }
 
 bool
-Store::remove_message(const std::string& path)
+Store::remove_message(const std::string& path, bool use_transaction)
 {
 	return xapian_try(
 	    [&] {
 		    std::lock_guard   guard{priv_->lock_};
 		    const std::string term{(get_uid_term(path.c_str()))};
-		    priv_->writable_db().delete_document(term);
+
+		    if (use_transaction)
+			    priv_->transaction_inc();
+
+		    priv_->delete_document(path, term);
+
+		    if (use_transaction) /* commit if batch is full */
+			    priv_->transaction_maybe_commit();
+		    else
+			    priv_->untransacted_maybe_commit();
 
 		    g_debug("deleted message @ %s from store", path.c_str());
 
@@ -483,7 +1218,7 @@ Store::remove_messages(const std::vector<Store::Id>& ids)
 
 	xapian_try([&] {
 		for (auto&& id : ids) {
-			priv_->writable_db().delete_document(id);
+			priv_->delete_document(id);
 		}
 	});
 
@@ -491,6 +1226,101 @@ Store::remove_messages(const std::vector<Store::Id>& ids)
 }
 
 
+static void // remove term, if it's there.
+remove_term(Xapian::Document& doc, const std::string& term)
+{
+	try {
+		doc.remove_term(term.length() < Store::MaxTermLength ? term :
+				term.substr(0, Store::MaxTermLength));
+	} catch (const Xapian::InvalidArgumentError&) {
+		/* term was not there */
+	}
+}
+
+static void add_term(Xapian::Document& doc, const std::string& term);
+
+bool
+Store::rename_message(Id id, const std::string& new_path, bool use_transaction)
+{
+	std::lock_guard guard{priv_->lock_};
+
+	return xapian_try([&] {
+		constexpr auto path_field{field_from_id(Field::Id::Path)};
+		constexpr auto mdir_field{field_from_id(Field::Id::Maildir)};
+		constexpr auto flags_field{field_from_id(Field::Id::Flags)};
+		constexpr auto size_field{field_from_id(Field::Id::Size)};
+
+		auto       doc{priv_->db().get_document(id)};
+		const auto old_path{doc.get_value(path_field.value_no())};
+		if (old_path.empty() || old_path == new_path ||
+		    ::access(old_path.c_str(), F_OK) == 0)
+			return false; // not a rename
+
+		// a cheap check that it's the same message (the base-names of
+		// different messages could collide).
+		struct stat statbuf {
+		};
+		if (::stat(new_path.c_str(), &statbuf) != 0 ||
+		    doc.get_value(size_field.value_no()) != size_to_string(statbuf.st_size))
+			return false;
+		if (!priv_->shards_.empty() &&
+		    priv_->shard_for_path(old_path) != priv_->shard_for_path(new_path))
+			return false; // moved to another shard; re-add instead.
+
+		const auto new_mdir{maildir_from_path(properties().root_maildir, new_path)};
+		const auto path_flags{mu_maildir_flags_from_path(new_path)};
+		if (!path_flags)
+			return false;
+
+		// path & unique id
+		doc.add_value(path_field.value_no(), new_path);
+		remove_term(doc, get_uid_term(old_path.c_str()));
+		add_term(doc, get_uid_term(new_path.c_str()));
+
+		// maildir
+		remove_term(doc, mdir_field.xapian_term(
+				    utf8_flatten(doc.get_value(mdir_field.value_no()))));
+		doc.add_value(mdir_field.value_no(), new_mdir);
+		add_term(doc, mdir_field.xapian_term(utf8_flatten(new_mdir)));
+
+		// flags; keep the content flags, take the others from the path.
+		const auto old_flags{static_cast<Flags>(static_cast<int64_t>(
+			Xapian::sortable_unserialise(doc.get_value(flags_field.value_no()))))};
+		auto       flags{*path_flags};
+		flag_infos_for_each([&](auto&& info) {
+			if (info.category == MessageFlagCategory::Content)
+				flags |= old_flags & info.flag;
+		});
+		if (any_of(flags & Flags::New) || none_of(flags & Flags::Seen))
+			flags |= Flags::Unread;
+
+		doc.add_value(flags_field.value_no(),
+			      Xapian::sortable_serialise(static_cast<double>(
+				      static_cast<int64_t>(flags))));
+		flag_infos_for_each([&](auto&& info) {
+			const auto term{flags_field.xapian_term(info.shortcut_lower())};
+			if (any_of(old_flags & info.flag))
+				remove_term(doc, term);
+			if (any_of(flags & info.flag))
+				add_term(doc, term);
+		});
+
+		if (use_transaction)
+			priv_->transaction_inc();
+
+		priv_->replace_document(id, doc);
+
+		if (use_transaction) /* commit if batch is full */
+			priv_->transaction_maybe_commit();
+		else
+			priv_->untransacted_maybe_commit();
+
+		g_debug("renamed message %u: %s -> %s", id, old_path.c_str(), new_path.c_str());
+
+		return true;
+	}, false);
+}
+
 std::string
 Store::metadata(const std::string& key) const
 {
@@ -540,6 +1370,31 @@ Store::set_dirstamp(const std::string& path, time_t tstamp)
 	set_metadata(path, std::string{data.data(), len});
 }
 
+Store::DirStamps
+Store::dirstamps() const
+{
+	DirStamps stamps;
+
+	std::lock_guard guard{priv_->lock_};
+
+	// dirstamps are stored as metadata, with the directory path as the key.
+	const auto& root{properties().root_maildir};
+	xapian_try([&] {
+		const auto& db{priv_->db()};
+		for (auto it = db.metadata_keys_begin(root); it != db.metadata_keys_end(root);
+		     ++it)
+			stamps[*it] = static_cast<time_t>(
+			    strtoll(db.get_metadata(*it).c_str(), NULL, 16));
+	});
+	// and the ones that are not committed yet.
+	for (auto&& item : priv_->metadata_cache_)
+		if (g_str_has_prefix(item.first.c_str(), root.c_str()))
+			stamps[item.first] = static_cast<time_t>(
+			    strtoll(item.second.c_str(), NULL, 16));
+
+	return stamps;
+}
+
 MuMsg*
 Store::find_message(unsigned docid) const
 {
@@ -572,28 +1427,95 @@ Store::contains_message(const std::string& path) const
 	    false);
 }
 
+uint64_t
+Store::path_hash(const std::string& path)
+{
+	return get_hash64(path.c_str());
+}
+
+std::vector<uint64_t>
+Store::path_hashes() const
+{
+	std::vector<uint64_t> hashes;
+
+	xapian_try([&] {
+		std::lock_guard guard{priv_->lock_};
+		const auto      prefix{
+		    field_from_id(Field::Id::Uid).xapian_term(std::string{UidTermPrefix})};
+		const auto&     db{priv_->db()};
+
+		hashes.reserve(db.get_doccount());
+		for (auto it = db.allterms_begin(prefix); it != db.allterms_end(prefix); ++it)
+			hashes.emplace_back(g_ascii_strtoull(
+						    (*it).c_str() + prefix.length(), NULL, 16));
+	});
+
+	// the hex-numbers are not zero-padded, so the terms are not in
+	// numerical order.
+	std::sort(hashes.begin(), hashes.end());
+
+	return hashes;
+}
+
 std::size_t
-Store::for_each_message_path(Store::ForEachMessageFunc msg_func) const
+Store::for_each_values(const std::vector<Field::Id>& field_ids,
+		       Store::ForEachValuesFunc func) const
 {
 	size_t n{};
 
+	if (field_ids.empty())
+		return n;
+
+	for (auto&& field_id : field_ids)
+		if (!field_from_id(field_id).is_value())
+			throw Mu::Error{Error::Code::InvalidArgument,
+				    "field '%s' is not a value field",
+				    std::string{field_from_id(field_id).name}.c_str()};
+
 	xapian_try([&] {
 		std::lock_guard guard{priv_->lock_};
-		Xapian::Enquire enq{priv_->db()};
 
-		enq.set_query(Xapian::Query::MatchAll);
-		enq.set_cutoff(0, 0);
+		// one value-stream per field; these are sparse, so the
+		// secondary ones are skipped forward to the docid of the
+		// primary (first) one.
+		const auto& db{priv_->db()};
+		std::vector<std::pair<Xapian::ValueIterator, Xapian::ValueIterator>> streams;
+		for (auto&& field_id : field_ids) {
+			const auto value_no{field_from_id(field_id).value_no()};
+			streams.emplace_back(db.valuestream_begin(value_no),
+					     db.valuestream_end(value_no));
+		}
 
-		Xapian::MSet matches(enq.get_mset(0, priv_->db().get_doccount()));
-		constexpr auto path_no{field_from_id(Field::Id::Path).value_no()};
-		for (auto&& it = matches.begin(); it != matches.end(); ++it, ++n)
-			if (!msg_func(*it, it.get_document().get_value(path_no)))
+		std::vector<std::string> values(field_ids.size());
+		for (auto& [it, end] = streams.front(); it != end; ++it) {
+			const auto docid{it.get_docid()};
+			values[0] = *it;
+			for (auto i = 1U; i != streams.size(); ++i) {
+				auto& [sit, send] = streams[i];
+				if (sit != send && sit.get_docid() < docid)
+					sit.skip_to(docid);
+				if (sit != send && sit.get_docid() == docid)
+					values[i] = *sit;
+				else
+					values[i].clear();
+			}
+			++n;
+			if (!func(docid, values))
 				break;
+		}
 	});
 
 	return n;
 }
 
+std::size_t
+Store::for_each_message_path(Store::ForEachMessageFunc msg_func) const
+{
+	return for_each_values({Field::Id::Path}, [&](Id id, const auto& values) {
+		return msg_func(id, values.front());
+	});
+}
+
 void
 Store::commit()
 {
@@ -639,6 +1561,19 @@ Store::run_query(const std::string& expr,
 		return q.run(expr, sortfield_id, flags, maxnum);}, Nothing);
 }
 
+Option<QueryResults>
+Store::run_query(const Snapshot& snapshot, const std::string& expr,
+		 std::optional<Field::Id> sortfield_id,
+		 QueryFlags flags, size_t maxnum) const
+{
+	if (!snapshot.db)
+		return Nothing;
+
+	return xapian_try([&] {
+		Query q{*this, *snapshot.db};
+		return q.run(expr, sortfield_id, flags, maxnum);}, Nothing);
+}
+
 size_t
 Store::count_query(const std::string& expr) const
 {
@@ -857,8 +1792,7 @@ add_terms_values_default(Xapian::Document& doc, MuMsg *msg, const Field& field)
 
 
 static void
-add_contacts_terms_values(Xapian::Document& doc, MuMsg *msg,
-			  ContactsCache& contacts_cache)
+add_contacts_terms_values(Xapian::Document& doc, MuMsg *msg, Contacts& contacts_out)
 {
 	Xapian::TermGenerator termgen;
 	termgen.set_document(doc);
@@ -888,15 +1822,15 @@ add_contacts_terms_values(Xapian::Document& doc, MuMsg *msg,
 		}
 	}
 
-	contacts_cache.add(std::move(contacts));
+	contacts_out = std::move(contacts);
 }
 
-Xapian::Document
-Store::Private::new_doc_from_message(MuMsg* msg)
+static Xapian::Document
+new_doc_from_message(MuMsg* msg, Contacts& contacts)
 {
 	Xapian::Document doc;
 
-	add_contacts_terms_values(doc, msg, this->contacts_cache_);
+	add_contacts_terms_values(doc, msg, contacts);
 	field_for_each([&](auto&& field) {
 
 		if (!field.is_searchable() && !field.is_value())
@@ -925,6 +1859,7 @@ Store::Private::new_doc_from_message(MuMsg* msg)
 		case Field::Id::EmbeddedText:
 			break;
 		case Field::Id::ThreadId:
+		case Field::Id::ThreadPath:
 		case Field::Id::Uid:
 			break; /* already taken care of elsewhere */
 		default:
@@ -957,26 +1892,92 @@ update_threading_info(MuMsg* msg, Xapian::Document& doc)
 	doc.add_value(field.value_no(), thread_id);
 }
 
-Xapian::docid
-Store::Private::add_or_update_msg(Xapian::docid docid, MuMsg* msg)
+// rough estimate of the memory Xapian needs for a document until it is
+// committed.
+static size_t
+estimate_doc_size(const Xapian::Document& doc)
 {
-	g_return_val_if_fail(msg, InvalidId);
+	size_t bytes{doc.get_data().size()};
+
+	for (auto it = doc.termlist_begin(); it != doc.termlist_end(); ++it)
+		bytes += (*it).size() + 16 +
+			 it.positionlist_count() * sizeof(Xapian::termpos);
+	for (auto it = doc.values_begin(); it != doc.values_end(); ++it)
+		bytes += (*it).size() + 8;
+
+	return bytes;
+}
+
+static Store::PreparedMessage
+prepare_from_msg(MuMsg* msg)
+{
+	Store::PreparedMessage pmsg;
+
+	pmsg.path       = mu_msg_get_path(msg);
+	pmsg.doc        = new_doc_from_message(msg, pmsg.contacts);
+	pmsg.uid_term   = get_uid_term(pmsg.path.c_str());
+	pmsg.bytes_read = mu_msg_get_bytes_read(msg);
+	pmsg.doc_bytes  = estimate_doc_size(pmsg.doc);
+	add_term(pmsg.doc, pmsg.uid_term);
+
+	// update the threading info if this message has a message id
+	if (mu_msg_get_msgid(msg))
+		update_threading_info(msg, pmsg.doc);
+
+	return pmsg;
+}
+
+Store::PreparedMessage
+Store::prepare_message(const std::string& path) const
+{
+	GError*    gerr{};
+	const auto maildir{maildir_from_path(properties().root_maildir, path)};
+	auto       msg{mu_msg_new_from_file(path.c_str(), maildir.c_str(), &gerr)};
+	if (G_UNLIKELY(!msg))
+		throw Error{Error::Code::Message,
+			    "failed to create message: %s",
+			    gerr ? gerr->message : "something went wrong"};
+
+	auto pmsg = xapian_try([&] { return prepare_from_msg(msg); },
+			       PreparedMessage{});
+	mu_msg_unref(msg);
+
+	if (G_UNLIKELY(pmsg.uid_term.empty()))
+		throw Error{Error::Code::Message, "failed to prepare message @ %s",
+			    path.c_str()};
 
+	return pmsg;
+}
+
+Xapian::docid
+Store::Private::add_or_update_prepared(Xapian::docid docid, PreparedMessage&& pmsg)
+{
 	return xapian_try(
 	    [&] {
-		    Xapian::Document doc{new_doc_from_message(msg)};
-		    const std::string term{get_uid_term(mu_msg_get_path(msg))};
-		    add_term(doc, term);
-
-		    // update the threading info if this message has a message id
-		    if (mu_msg_get_msgid(msg))
-			    update_threading_info(msg, doc);
+		    transaction_bytes_ += pmsg.doc_bytes;
 
 		    if (docid == 0)
-			    return writable_db().replace_document(term, doc);
+			    docid = add_document(pmsg.path, pmsg.uid_term, pmsg.doc);
+		    else
+			    replace_document(docid, pmsg.doc);
+
+		    // only now that the message is in the store.
+		    contacts_cache_.add(std::move(pmsg.contacts));
+
+		    thread_changed(pmsg.doc);
+		    untransacted_maybe_commit();
 
-		    writable_db().replace_document(docid, doc);
 		    return docid;
 	    },
 	    InvalidId);
 }
+
+Xapian::docid
+Store::Private::add_or_update_msg(Xapian::docid docid, MuMsg* msg)
+{
+	g_return_val_if_fail(msg, InvalidId);
+
+	return xapian_try(
+	    [&] { return add_or_update_prepared(docid, prepare_from_msg(msg)); },
+	    InvalidId);
+}
@@ -26,8 +26,12 @@
 #include <vector>
 #include <mutex>
 #include <ctime>
+#include <cstdint>
+#include <unordered_map>
+#include <memory>
 
 #include "mu-contacts-cache.hh"
+#include "mu-readability-tracker.hh"
 #include <xapian.h>
 
 #include <utils/mu-utils.hh>
@@ -58,6 +62,20 @@ public:
 		/**< maximum size (in bytes) for a message, or 0 for default */
 		size_t batch_size{};
 		/**< size of batches before committing, or 0 for default */
+		size_t batch_memory{};
+		/**< estimated memory (in bytes) for a batch of changes before
+		 * committing, or 0 for default */
+		size_t batch_seconds{};
+		/**< maximum time (in seconds) for a batch before committing, or
+		 * 0 for default */
+		bool background_commit{};
+		/**< commit batches in a background thread */
+		size_t shards{};
+		/**< number of shards to spread the messages over, each with
+		 * their own writer; or 0 for a single database */
+		size_t max_related{};
+		/**< maximum number of related messages per thread for queries
+		 * that include related messages, or 0 for default */
 	};
 
 	/**
@@ -87,6 +105,87 @@ public:
 	 */
 	~Store();
 
+	/**
+	 * Create a new, empty store at @p new_path with the same configuration
+	 * (maildir, personal addresses, batch settings, shards) as the existing
+	 * one at @p path, even if the latter has some older schema. This is for
+	 * rebuilding a store next to the existing one, which can be used as
+	 * usual in the mean time; see replace().
+	 *
+	 * @param path path to the existing database
+	 * @param new_path path for the new database
+	 *
+	 * @return the new store; throws on error.
+	 */
+	static std::unique_ptr<Store> make_like(const std::string& path,
+						const std::string& new_path);
+
+	/**
+	 * Replace the database at @p path with the one at @p new_path (which
+	 * should no longer be open), atomically where the system supports
+	 * that, and remove the old one. Processes that still have the old one
+	 * open (read-only) can notice with replaced().
+	 *
+	 * This holds the write-lock of the existing database while replacing
+	 * it, so no writes get lost; hence, it fails if some other process
+	 * (such as mu server) has the existing database open for writing.
+	 *
+	 * @param path path to the existing database
+	 * @param new_path path to the new database
+	 *
+	 * @return true if replacing worked, false otherwise.
+	 */
+	static bool replace(const std::string& path, const std::string& new_path);
+
+	/**
+	 * Compact the database at @p path (using Xapian's compaction), which
+	 * makes it smaller and faster after many changes. The store can be
+	 * read in the mean time; the compacted database is built next to it
+	 * and then replaces it (see replace()), but only if the store did not
+	 * change in the mean time; otherwise, this retries a few times. Like
+	 * replace(), this fails if some other process keeps the store's
+	 * write-lock; to compact a store that is open for writing, use
+	 * compact_in_place().
+	 *
+	 * @param path path to the database
+	 * @param renumber_by_date whether to renumber the messages in ascending
+	 * date order, for better locality for date-sorted queries; otherwise,
+	 * they keep their ids.
+	 *
+	 * @return true if compacting worked, false otherwise.
+	 */
+	static bool compact(const std::string& path, bool renumber_by_date = false);
+
+	/**
+	 * Compact this (writable) store, like compact(), and re-open it
+	 * (see reopen_if_replaced()). Since this store holds the write-lock,
+	 * no one else can change the store in the mean time. Does nothing
+	 * while the indexer is running.
+	 *
+	 * @param renumber_by_date see compact()
+	 *
+	 * @return true if compacting worked, false otherwise.
+	 */
+	bool compact_in_place(bool renumber_by_date = false);
+
+	/**
+	 * Has the database on disk been replaced (see replace()) since this
+	 * store opened it?
+	 *
+	 * @return true or false
+	 */
+	bool replaced() const;
+
+	/**
+	 * Re-open the database if it has been replaced, unless the indexer is
+	 * running. This invalidates all references into the store (such as
+	 * contacts_cache() and database()), so the caller must make sure no
+	 * one else is using it.
+	 *
+	 * @return true if the database was re-opened, false otherwise.
+	 */
+	bool reopen_if_replaced();
+
 	/**
 	 * Store properties
 	 */
@@ -97,7 +196,12 @@ public:
 
 		bool   read_only;  /**< Is the database opened read-only? */
 		size_t batch_size; /**< Maximum database transaction batch size */
+		size_t batch_memory;  /**< Maximum (estimated) transaction memory */
+		size_t batch_seconds; /**< Maximum transaction time */
+		bool   background_commit; /**< Commit in a background thread? */
 		bool   in_memory;  /**< Is this an in-memory database (for testing)?*/
+		size_t shards;     /**< Number of shards, or 0 if not sharded */
+		size_t max_related; /**< Maximum related messages per thread */
 
 		std::string root_maildir; /**<  Absolute path to the top-level maildir */
 
@@ -119,16 +223,58 @@ public:
 	const ContactsCache& contacts_cache() const;
 
 	/**
-	 * Get the underlying Xapian database for this store.
+	 * Get the underlying Xapian database for this store. For a sharded
+	 * store, this combines all of the shards.
 	 *
 	 * @return the database
 	 */
 	const Xapian::Database& database() const;
 
+	/**
+	 * A read-only snapshot of the database, as of some commit. Queries
+	 * can use this without holding the lock (see lock()), so they do not
+	 * have to wait for a writer, nor a writer for them.
+	 *
+	 * However, for in-memory and read-only stores, the snapshot is not a
+	 * copy but the store's own database (see snapshot()), which is not
+	 * safe to use from multiple threads at once; so for those, callers
+	 * must still hold the lock while using the snapshot.
+	 */
+	struct Snapshot {
+		std::shared_ptr<const Xapian::Database> db; /**< The database */
+		size_t generation; /**< The generation (see generation()) */
+	};
+
+	/**
+	 * Get a snapshot of the database, as of the latest commit. Changes
+	 * outside of a transaction are committed right away, so only those in
+	 * a running transaction are missing from it. Snapshots are reused until the next commit, but never handed out to more
+	 * than one user at a time, since a Xapian::Database must not be used
+	 * from multiple threads at once. Keep the snapshot at least as long as
+	 * any results from it.
+	 *
+	 * For in-memory and read-only stores, this is the store's own
+	 * database, which the caller may only use while holding the lock.
+	 *
+	 * @return a snapshot; its db is empty if it could not be opened.
+	 */
+	Snapshot snapshot() const;
+
+	/**
+	 * Get the current generation of the store, i.e., the number of
+	 * commits since the store was opened.
+	 *
+	 * @return the generation
+	 */
+	size_t generation() const;
+
 	/**
 	 * Get the underlying writable Xapian database for this
 	 * store. Throws is this store is not writable.
 	 *
+	 * For a sharded store, this is the main database, which only has the
+	 * metadata; the messages are in the shards.
+	 *
 	 * @return the writable database
 	 */
 	Xapian::WritableDatabase& writable_database();
@@ -141,6 +287,15 @@ public:
 	 */
 	Indexer& indexer();
 
+	/**
+	 * Get the readability-tracker for this store; the indexer keeps it
+	 * up-to-date while watching the maildir.
+	 *
+	 * @return the readability-tracker
+	 */
+	ReadabilityTracker&       readability();
+	const ReadabilityTracker& readability() const;
+
 	/**
 	 * Run a						query; see the `mu-query` man page for the syntax.
 	 *
@@ -160,6 +315,27 @@ public:
 				       QueryFlags		flags       = QueryFlags::None,
 				       size_t			maxnum      = 0) const;
 
+	/**
+	 * Run a query against some snapshot (see snapshot()); this does not
+	 * require the lock, but the snapshot must be kept at least as long as
+	 * the return value. The exception are in-memory and read-only stores,
+	 * whose snapshots are the store's own database; multi-threaded
+	 * callers must hold the lock for those (see Snapshot).
+	 *
+	 * @param snapshot a snapshot
+	 * @param expr the search expression
+	 * @param sortfieldid the sortfield-id. If the field is NONE, sort by DATE
+	 * @param flags query flags
+	 * @param maxnum maximum number of results to return. 0 for 'no limit'
+	 *
+	 * @return the query-results, or Nothing in case of error.
+	 */
+	Option<QueryResults> run_query(const Snapshot&          snapshot,
+				       const std::string&       expr,
+				       std::optional<Field::Id> sortfield_id = {},
+				       QueryFlags               flags        = QueryFlags::None,
+				       size_t                   maxnum       = 0) const;
+
 	/**
 	 * run a Xapian query merely to count the number of matches; for the
 	 * syntax, please refer to the mu-query manpage
@@ -194,6 +370,46 @@ public:
 	 */
 	Id add_message(const std::string& path, bool use_transaction = false);
 
+	/**
+	 * A message that has been parsed into a document, but has not been
+	 * added to the store yet.
+	 */
+	struct PreparedMessage {
+		std::string      path;     /**< Path to the message file */
+		std::string      uid_term; /**< Unique term for the message */
+		Xapian::Document doc;      /**< The document to store */
+		Contacts         contacts; /**< Contacts to add to the contacts-cache */
+		size_t           bytes_read{}; /**< Bytes read from disk for parsing */
+		size_t           doc_bytes{};  /**< Estimated size of the document */
+	};
+
+	/**
+	 * Parse a message into a document that can be added with
+	 * add_message(PreparedMessage&&). This does not touch the database nor
+	 * take the store lock, so it can be called from multiple threads at
+	 * the same time.
+	 *
+	 * Throws Mu::Error if the message cannot be parsed.
+	 *
+	 * @param path the message path.
+	 *
+	 * @return a prepared message
+	 */
+	PreparedMessage prepare_message(const std::string& path) const;
+
+	/**
+	 * Add a message that was prepared with prepare_message() to the
+	 * store. See add_message(const std::string&, bool) for the use of
+	 * transactions.
+	 *
+	 * @param pmsg the prepared message
+	 * @param use_transaction whether to bundle up to batch_size changes
+	 * in a transaction
+	 *
+	 * @return the doc id of the added message
+	 */
+	Id add_message(PreparedMessage&& pmsg, bool use_transaction = false);
+
 	/**
 	 * Update a message in the store.
 	 *
@@ -204,15 +420,38 @@ public:
 	 */
 	bool update_message(MuMsg* msg, Id id);
 
+	/**
+	 * Update the path of a message in the store, for a message file that
+	 * was renamed or moved (e.g., from new/ to cur/, or to another
+	 * maildir). This only updates the path-derived parts of the message
+	 * (its path, maildir and maildir-flags), without re-parsing the
+	 * message.
+	 *
+	 * This only works when the message's current path no longer exists,
+	 * i.e. when the message was moved rather than copied, and when the
+	 * file at new_path has the same size as the message.
+	 *
+	 * @param id the store id for the message
+	 * @param new_path the new path for the message
+	 * @param use_transaction whether to bundle up to batch_size changes
+	 * in a transaction; see add_message()
+	 *
+	 * @return true if the message was updated; false otherwise
+	 */
+	bool rename_message(Id id, const std::string& new_path,
+			    bool use_transaction = false);
+
 	/**
 	 * Remove a message from the store. It will _not_ remove the message
 	 * from the file system.
 	 *
 	 * @param path the message path.
+	 * @param use_transaction whether to bundle up to batch_size changes
+	 * in a transaction; see add_message()
 	 *
 	 * @return true if removing happened; false otherwise.
 	 */
-	bool remove_message(const std::string& path);
+	bool remove_message(const std::string& path, bool use_transaction = false);
 
 	/**
 	 * Remove a number if messages from the store. It will _not_ remove the
@@ -248,6 +487,25 @@ public:
 	 */
 	bool contains_message(const std::string& path) const;
 
+	/**
+	 * Get the path-hash for some message path; a message is in the store
+	 * if and only if its path-hash is.
+	 *
+	 * @param path the message path
+	 *
+	 * @return the path-hash
+	 */
+	static uint64_t path_hash(const std::string& path);
+
+	/**
+	 * Get the path-hashes of all messages in the store, sorted. Together
+	 * with path_hash(), this allows for checking whether the store
+	 * contains a message without a database lookup.
+	 *
+	 * @return sorted vector of path hashes
+	 */
+	std::vector<uint64_t> path_hashes() const;
+
 	/**
 	 * Prototype for the ForEachMessageFunc
 	 *
@@ -259,7 +517,7 @@ public:
 	using ForEachMessageFunc = std::function<bool(Id, const std::string&)>;
 
 	/**
-	 * Call @param func for each document in the store. This takes a lock on
+	 * Call @param func for each document in the store, in docid order. This takes a lock on
 	 * the store, so the func should _not_ call any other Store:: methods.
 	 *
 	 * @param func a Callable invoked for each message.
@@ -268,6 +526,39 @@ public:
 	 */
 	size_t for_each_message_path(ForEachMessageFunc func) const;
 
+	/**
+	 * Prototype for the ForEachValuesFunc
+	 *
+	 * @param id the store Id for the message
+	 * @param values the values for the requested fields, in the same order;
+	 * empty for fields without a value for this message. The vector is
+	 * re-used between calls.
+	 *
+	 * @return true if for_each should continue; false to quit
+	 */
+	using ForEachValuesFunc = std::function<bool(Id, const std::vector<std::string>&)>;
+
+	/**
+	 * Call @param func with the values of the given fields for each
+	 * document in the store, in docid order.
+	 *
+	 * This reads the value slots directly (using Xapian value-streams),
+	 * without running a query or fetching any documents, which makes it
+	 * suitable for scanning the whole store. The scan is driven by the
+	 * first field: documents without a value for it are skipped.
+	 *
+	 * This takes a lock on the store, so the func should _not_ call any
+	 * other Store:: methods.
+	 *
+	 * @param field_ids the fields; these must be value fields, and there
+	 * must be at least one.
+	 * @param func a Callable invoked for each message.
+	 *
+	 * @return the number of times func was invoked
+	 */
+	size_t for_each_values(const std::vector<Field::Id>& field_ids,
+			       ForEachValuesFunc func) const;
+
 	/**
 	 * Prototype for the ForEachTermFunc
 	 *
@@ -334,6 +625,14 @@ public:
 	 */
 	void set_dirstamp(const std::string& path, time_t tstamp);
 
+	/**
+	 * Get all directory timestamps in the store.
+	 *
+	 * @return a map of directory path -> timestamp
+	 */
+	using DirStamps = std::unordered_map<std::string, time_t>;
+	DirStamps dirstamps() const;
+
 	/**
 	 * Get the number of documents in the document database
 	 *
@@ -17,6 +17,8 @@
 **
 */
 
+#include <config.h>
+
 #include <vector>
 #include <glib.h>
 
@@ -24,31 +26,88 @@
 #include <sstream>
 #include <unistd.h>
 
-#include "mu-indexer.hh"
+#include "mu-store.hh"
+#include "index/mu-indexer.hh"
 #include "utils/mu-utils.hh"
-#include "test-mu-common.h"
+#include "test-mu-common.hh"
 
 using namespace Mu;
 
 static void
-test_index_maildir()
+index_and_wait(Store& store)
 {
-	allow_warnings();
-
-	Store   store{test_mu_common_get_random_tmpdir(), std::string{MU_TESTMAILDIR}};
-	Indexer idx{Indexer::Config{}, store};
+	auto&& idx{store.indexer()};
 
-	g_assert_true(idx.start());
+	g_assert_true(idx.start(Indexer::Config{}));
 	while (idx.is_running()) {
 		sleep(1);
 	}
+}
 
-	g_print("again!\n");
+static void
+test_index_maildir()
+{
+	allow_warnings();
 
-	g_assert_true(idx.start());
-	while (idx.is_running()) {
-		sleep(1);
-	}
+	char* tdir{test_mu_common_get_random_tmpdir()};
+	Store store{tdir, std::string{MU_TESTMAILDIR}, {}, {}};
+	g_free(tdir);
+
+	index_and_wait(store);
+	const auto n{store.size()};
+	g_assert_cmpuint(n, >, 0);
+
+	// again; nothing should change.
+	index_and_wait(store);
+	g_assert_cmpuint(store.size(), ==, n);
+}
+
+static void
+test_index_rename()
+{
+	allow_warnings();
+
+	char* tdir{test_mu_common_get_random_tmpdir()};
+	const std::string tmpdir{tdir};
+	g_free(tdir);
+
+	// we're going to change the maildir, so use a copy.
+	const auto mdir{tmpdir + "/maildir"};
+	const auto cmdline{format("/bin/cp -r %s %s", MU_TESTMAILDIR, mdir.c_str())};
+	g_assert_true(g_spawn_command_line_sync(cmdline.c_str(), NULL, NULL, NULL, NULL));
+
+	Store store{tmpdir + "/xapian", mdir, {}, {}};
+	index_and_wait(store);
+	const auto n{store.size()};
+	g_assert_cmpuint(n, >, 0);
+
+	const auto find_id = [&](const std::string& path) {
+		auto id{Store::InvalidId};
+		store.for_each_message_path([&](Store::Id mid, const std::string& mpath) {
+			if (mpath == path)
+				id = mid;
+			return id == Store::InvalidId;
+		});
+		return id;
+	};
+
+	const auto old_path{mdir + "/new/1220863087.12663_21.mindcrime"};
+	const auto new_path{mdir + "/cur/1220863087.12663_21.mindcrime:2,S"};
+	const auto id{find_id(old_path)};
+	g_assert_cmpuint(id, !=, Store::InvalidId);
+	const auto n_new{store.count_query("flag:new")};
+	g_assert_cmpuint(n_new, >, 0);
+
+	// move the message from new/ to cur/, and mark it as seen.
+	g_assert_cmpint(::rename(old_path.c_str(), new_path.c_str()), ==, 0);
+	index_and_wait(store);
+
+	// the store should reflect that, for the same message.
+	g_assert_cmpuint(store.size(), ==, n);
+	g_assert_false(store.contains_message(old_path));
+	g_assert_true(store.contains_message(new_path));
+	g_assert_cmpuint(find_id(new_path), ==, id);
+	g_assert_cmpuint(store.count_query("flag:new"), ==, n_new - 1);
 }
 
 int
@@ -57,6 +116,7 @@ try {
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/indexer/index-maildir", test_index_maildir);
+	g_test_add_func("/indexer/index-rename", test_index_rename);
 
 	return g_test_run();
 
@@ -196,6 +196,19 @@ test_mu_maildir_flags_from_path(void)
 	}
 }
 
+static void
+test_mu_maildir_base_name(void)
+{
+	assert_equal(mu_maildir_base_name("/home/foo/Maildir/test/cur/123456:2,FSR"),
+		     "123456");
+	assert_equal(mu_maildir_base_name("/home/foo/Maildir/test/new/123456"),
+		     "123456");
+	assert_equal(mu_maildir_base_name("/home/foo/Maildir/test/cur/123456!2,S"),
+		     "123456");
+	assert_equal(mu_maildir_base_name("/home/foo/Maildir/test/cur/123:456:2,"),
+		     "123:456");
+}
+
 [[maybe_unused]] static void
 assert_matches_regexp(const char* str, const char* rx)
 {
@@ -457,6 +470,8 @@ main(int argc, char* argv[])
 
 	g_test_add_func("/mu-maildir/mu-maildir-flags-from-path",
 			test_mu_maildir_flags_from_path);
+	g_test_add_func("/mu-maildir/mu-maildir-base-name",
+			test_mu_maildir_base_name);
 
 
 	g_test_add_func("/mu-maildir/mu-maildir-determine-target-ok",
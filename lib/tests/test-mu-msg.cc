@@ -78,6 +78,8 @@ test_mu_msg_01(void)
 			"contact gcc-help-help@gcc.gnu.org; run by ezmlm");
 	g_assert_true(mu_msg_get_prio(msg) == Priority::Normal);
 	g_assert_cmpuint(mu_msg_get_date(msg), ==, 1217530645);
+	// the message is read only once
+	g_assert_cmpuint(mu_msg_get_bytes_read(msg), ==, mu_msg_get_size(msg));
 
 	const auto contacts{mu_msg_get_contacts(msg)};
 	g_assert_cmpuint(contacts.size(), == , 2);
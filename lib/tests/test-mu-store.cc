@@ -21,10 +21,15 @@
 
 #include <glib.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <time.h>
 
 #include <locale.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
 
 #include "test-mu-common.hh"
 #include "mu-store.hh"
@@ -32,6 +37,21 @@
 static std::string MuTestMaildir  = Mu::canonicalize_filename(MU_TESTMAILDIR, "/");
 static std::string MuTestMaildir2 = Mu::canonicalize_filename(MU_TESTMAILDIR2, "/");
 
+// copy a message file to dest, creating its directory if needed
+static void
+copy_test_message(const std::string& src, const std::string& dest)
+{
+	char* dir{g_path_get_dirname(dest.c_str())};
+	g_assert_cmpint(g_mkdir_with_parents(dir, 0700), ==, 0);
+	g_free(dir);
+
+	gchar* contents{};
+	gsize  len{};
+	g_assert_true(g_file_get_contents(src.c_str(), &contents, &len, NULL));
+	g_assert_true(g_file_set_contents(dest.c_str(), contents, len, NULL));
+	g_free(contents);
+}
+
 static void
 test_store_ctor_dtor()
 {
@@ -79,6 +99,346 @@ test_store_add_count_remove()
 	g_assert_false(store.contains_message(MuTestMaildir2 + "/bar/cur/mail3"));
 }
 
+static void
+test_store_batches()
+{
+	char* tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert(tmpdir);
+	const std::string dbpath{tmpdir};
+	g_free(tmpdir);
+
+	const std::vector<std::string> paths = {
+		MuTestMaildir + "/cur/1283599333.1840_11.cthulhu!2,",
+		MuTestMaildir + "/cur/1220863042.12663_1.mindcrime!2,S",
+		MuTestMaildir + "/cur/1220863060.12663_3.mindcrime!2,S"};
+	{
+		Mu::Store::Config conf{};
+		conf.batch_size        = 2;
+		conf.batch_memory      = 1024;
+		conf.background_commit = true;
+
+		Mu::Store store{dbpath, MuTestMaildir, {}, conf};
+		g_assert_cmpuint(store.properties().batch_size, ==, 2);
+		g_assert_cmpuint(store.properties().batch_memory, ==, 1024);
+		g_assert_true(store.properties().background_commit);
+
+		for (auto&& path : paths)
+			g_assert_cmpuint(store.add_message(path, true /*use-transaction*/),
+					 !=, Mu::Store::InvalidId);
+		store.commit();
+		g_assert_cmpuint(store.size(), ==, paths.size());
+	}
+
+	// everything should have been committed.
+	Mu::Store store{dbpath, true /*readonly*/};
+	g_assert_cmpuint(store.size(), ==, paths.size());
+	g_assert_cmpuint(store.properties().batch_seconds, >, 0);
+	for (auto&& path : paths)
+		g_assert_true(store.contains_message(path));
+}
+
+static void
+test_store_snapshots()
+{
+	using namespace std::chrono_literals;
+
+	char* tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert(tmpdir);
+	const std::string dbpath{tmpdir};
+	g_free(tmpdir);
+
+	const std::vector<std::string> paths = {
+		MuTestMaildir + "/cur/1283599333.1840_11.cthulhu!2,",
+		MuTestMaildir + "/cur/1220863042.12663_1.mindcrime!2,S",
+		MuTestMaildir + "/cur/1220863060.12663_3.mindcrime!2,S"};
+
+	Mu::Store store{dbpath, MuTestMaildir, {}, {}};
+	const auto gen0{store.generation()};
+	{
+		const auto snapshot{store.snapshot()};
+		g_assert_true(!!snapshot.db);
+		g_assert_cmpuint(snapshot.generation, ==, gen0);
+		g_assert_cmpuint(snapshot.db->get_doccount(), ==, 0);
+	}
+
+	g_assert_cmpuint(store.add_message(paths[0], true), !=, Mu::Store::InvalidId);
+	store.commit();
+	g_assert_cmpuint(store.generation(), >, gen0);
+	{
+		const auto snapshot{store.snapshot()};
+		g_assert_cmpuint(snapshot.generation, ==, store.generation());
+		g_assert_cmpuint(snapshot.db->get_doccount(), ==, 1);
+
+		// snapshots don't change...
+		g_assert_cmpuint(store.add_message(paths[1], true), !=, Mu::Store::InvalidId);
+		store.commit();
+		g_assert_cmpuint(snapshot.db->get_doccount(), ==, 1);
+		// ... but new ones do.
+		g_assert_cmpuint(store.snapshot().db->get_doccount(), ==, 2);
+	}
+
+	// changes outside of a transaction (as the server makes them) are
+	// committed right away, so new snapshots see them.
+	{
+		const auto gen{store.generation()};
+		g_assert_cmpuint(store.add_message(paths[2]), !=, Mu::Store::InvalidId);
+		g_assert_cmpuint(store.generation(), >, gen);
+		g_assert_cmpuint(store.snapshot().db->get_doccount(), ==, 3);
+
+		g_assert_true(store.remove_message(paths[2]));
+		g_assert_cmpuint(store.snapshot().db->get_doccount(), ==, 2);
+	}
+
+	// queries on snapshots do not wait for whoever holds the lock (such as
+	// an indexer, for a slow commit)
+	{
+		std::atomic<bool> locked{}, done{};
+		std::thread       locker([&] {
+			std::lock_guard guard{store.lock()};
+			locked = true;
+			const auto start{Mu::Clock::now()};
+			while (!done && Mu::Clock::now() - start < 2s)
+				std::this_thread::sleep_for(10ms);
+		});
+		while (!locked)
+			std::this_thread::sleep_for(1ms);
+
+		const auto start{Mu::Clock::now()};
+		const auto snapshot{store.snapshot()};
+		const auto qres{store.run_query(snapshot, "")};
+		const auto elapsed{Mu::Clock::now() - start};
+		done = true;
+		locker.join();
+
+		g_assert_true(!!qres);
+		g_assert_cmpuint(qres->size(), ==, 2);
+		g_assert_cmpuint(Mu::to_ms(elapsed), <, 1000);
+	}
+
+	// hammer the store with queries while indexing.
+	{
+		std::atomic<bool> done{};
+		std::thread       indexer([&] {
+			for (auto i = 0; i != 50; ++i) {
+				for (auto&& path : paths)
+					store.add_message(path, true);
+				store.commit();
+			}
+			done = true;
+		});
+
+		size_t                    n{}, last_gen{};
+		Mu::Clock::duration max_latency{};
+		while (!done) {
+			const auto start{Mu::Clock::now()};
+			const auto snapshot{store.snapshot()};
+			const auto qres{store.run_query(snapshot, "")};
+			max_latency = std::max(max_latency, Mu::Clock::now() - start);
+
+			g_assert_true(!!qres);
+			g_assert_cmpuint(snapshot.generation, >=, last_gen);
+			last_gen = snapshot.generation;
+			++n;
+		}
+		indexer.join();
+
+		g_test_message("%zu queries; max latency %" G_GINT64_FORMAT " ms",
+			       n, static_cast<gint64>(Mu::to_ms(max_latency)));
+		g_assert_cmpuint(Mu::to_ms(max_latency), <, 1000);
+		g_assert_cmpuint(store.snapshot().db->get_doccount(), ==, paths.size());
+	}
+}
+
+static void
+test_store_shards()
+{
+	char* tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert(tmpdir);
+	const std::string dbpath{tmpdir};
+	g_free(tmpdir);
+
+	const std::vector<std::string> paths = {
+		MuTestMaildir2 + "/bar/cur/mail1",
+		MuTestMaildir2 + "/bar/cur/mail2",
+		MuTestMaildir2 + "/Foo/cur/mail5",
+		MuTestMaildir2 + "/wom_bat/cur/atomic"};
+	std::vector<Mu::Store::Id> ids;
+	{
+		Mu::Store::Config conf{};
+		conf.shards = 3;
+
+		Mu::Store store{dbpath, MuTestMaildir2, {}, conf};
+		g_assert_cmpuint(store.properties().shards, ==, 3);
+
+		for (auto&& path : paths) {
+			ids.emplace_back(store.add_message(path, true /*use-transaction*/));
+			g_assert_cmpuint(ids.back(), !=, Mu::Store::InvalidId);
+		}
+		store.set_dirstamp(MuTestMaildir2 + "/bar/cur", 12345);
+		store.commit();
+		g_assert_cmpuint(store.size(), ==, paths.size());
+
+		// ids must map back to the right messages.
+		std::vector<std::pair<Mu::Store::Id, std::string>> id_paths;
+		store.for_each_message_path([&](auto&& id, auto&& path) {
+			id_paths.emplace_back(id, path);
+			return true;
+		});
+		g_assert_cmpuint(id_paths.size(), ==, paths.size());
+		for (auto i = 0U; i != paths.size(); ++i)
+			g_assert_true(std::find(id_paths.begin(), id_paths.end(),
+						std::make_pair(ids.at(i), paths.at(i))) !=
+				      id_paths.end());
+
+		store.remove_messages({ids.at(0)});
+		g_assert_cmpuint(store.size(), ==, paths.size() - 1);
+		g_assert_false(store.contains_message(paths.at(0)));
+		g_assert_true(store.remove_message(paths.at(2)));
+		g_assert_cmpuint(store.size(), ==, paths.size() - 2);
+	}
+
+	// re-open; the shards, the metadata and the messages should be there.
+	Mu::Store store{dbpath, true /*readonly*/};
+	g_assert_cmpuint(store.properties().shards, ==, 3);
+	g_assert_cmpuint(store.size(), ==, paths.size() - 2);
+	g_assert_cmpuint(store.dirstamp(MuTestMaildir2 + "/bar/cur"), ==, 12345);
+	g_assert_true(store.contains_message(paths.at(1)));
+	g_assert_true(store.contains_message(paths.at(3)));
+	g_assert_false(store.contains_message(paths.at(2)));
+
+	const auto snapshot{store.snapshot()};
+	g_assert_nonnull(snapshot.db);
+	g_assert_cmpuint(snapshot.db->get_doccount(), ==, paths.size() - 2);
+
+	// related messages, with a thread spread over the shards.
+	char* tmpdir2 = test_mu_common_get_random_tmpdir();
+	g_assert(tmpdir2);
+	const std::string mdir{tmpdir2};
+	g_free(tmpdir2);
+
+	std::vector<std::string> thread_paths;
+	for (auto&& num : {"21", "23", "25"}) {
+		thread_paths.emplace_back(mdir + "/folder" + num + "/cur/mail" + num);
+		copy_test_message(MuTestMaildir + "/new/1220863087.12663_" + num + ".mindcrime",
+				  thread_paths.back());
+	}
+
+	Mu::Store::Config conf{};
+	conf.shards = 3;
+	Mu::Store rstore{mdir + "/.xapian", mdir, {}, conf};
+	for (auto&& path : thread_paths)
+		g_assert_cmpuint(rstore.add_message(path, true), !=, Mu::Store::InvalidId);
+	rstore.commit();
+
+	for (auto&& qflags : {Mu::QueryFlags::IncludeRelated,
+			      Mu::QueryFlags::IncludeRelated | Mu::QueryFlags::Threading}) {
+		auto qres{rstore.run_query("i:uwsireh25.fsf@one.dot.net", Mu::Field::Id::Date,
+					   qflags)};
+		g_assert_true(!!qres);
+		g_assert_cmpuint(qres->size(), ==, thread_paths.size());
+
+		size_t related{};
+		for (auto&& mi : *qres) {
+			g_assert_true(std::find(thread_paths.begin(), thread_paths.end(),
+						mi.path().value_or("")) != thread_paths.end());
+			if (mi.query_match().has_flag(Mu::QueryMatch::Flags::Related))
+				++related;
+		}
+		g_assert_cmpuint(related, ==, thread_paths.size() - 1);
+	}
+}
+
+static void
+test_store_replace()
+{
+	char* tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert(tmpdir);
+	const std::string dbpath{tmpdir};
+	const std::string new_dbpath{dbpath + ".rebuild"};
+	g_free(tmpdir);
+
+	Mu::Store::Config conf{};
+	conf.batch_size = 123;
+
+	{
+		Mu::Store store{dbpath, MuTestMaildir, {"foo@example.com"}, conf};
+		g_assert_cmpuint(store.add_message(
+					 MuTestMaildir + "/cur/1283599333.1840_11.cthulhu!2,"),
+				 !=, Mu::Store::InvalidId);
+		store.commit();
+
+		auto new_store{Mu::Store::make_like(dbpath, new_dbpath)};
+		g_assert_true(new_store->empty());
+		g_assert_cmpuint(new_store->properties().batch_size, ==, 123);
+		g_assert_true(new_store->properties().root_maildir == MuTestMaildir);
+		g_assert_cmpuint(new_store->properties().personal_addresses.size(), ==, 1);
+
+		new_store->add_message(MuTestMaildir + "/cur/1220863042.12663_1.mindcrime!2,S");
+		new_store->add_message(MuTestMaildir + "/cur/1220863060.12663_3.mindcrime!2,S");
+		new_store.reset();
+
+		// the store is open for writing, so it cannot be replaced.
+		g_test_expect_message(NULL, G_LOG_LEVEL_WARNING, "*in use*");
+		g_assert_false(Mu::Store::replace(dbpath, new_dbpath));
+		g_test_assert_expected_messages();
+		g_assert_cmpint(::access(new_dbpath.c_str(), F_OK), ==, 0);
+	}
+
+	Mu::Store store{dbpath}; // read-only
+	g_assert_false(store.replaced());
+	g_assert_false(store.reopen_if_replaced());
+	g_assert_cmpuint(store.size(), ==, 1);
+
+	g_assert_true(Mu::Store::replace(dbpath, new_dbpath));
+	g_assert_cmpint(::access(new_dbpath.c_str(), F_OK), !=, 0);
+
+	g_assert_true(store.replaced());
+	g_assert_true(store.reopen_if_replaced());
+	g_assert_false(store.replaced());
+	g_assert_cmpuint(store.size(), ==, 2);
+	g_assert_false(store.contains_message(
+			       MuTestMaildir + "/cur/1283599333.1840_11.cthulhu!2,"));
+}
+
+static void
+test_store_compact()
+{
+	char* tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert(tmpdir);
+	const std::string dbpath{tmpdir};
+	g_free(tmpdir);
+
+	Mu::Store store{dbpath, MuTestMaildir, {}, {}};
+	for (auto&& path : {MuTestMaildir + "/cur/1283599333.1840_11.cthulhu!2,",
+			    MuTestMaildir + "/cur/1220863042.12663_1.mindcrime!2,S",
+			    MuTestMaildir + "/cur/1220863060.12663_3.mindcrime!2,S",
+			    MuTestMaildir + "/cur/1305664394.2171_402.cthulhu!2,"})
+		g_assert_cmpuint(store.add_message(path), !=, Mu::Store::InvalidId);
+	g_assert_true(store.remove_message(MuTestMaildir + "/cur/1305664394.2171_402.cthulhu!2,"));
+	store.commit();
+
+	// the store holds the write-lock, so only it can compact itself.
+	g_test_expect_message(NULL, G_LOG_LEVEL_WARNING, "*in use*");
+	g_test_expect_message(NULL, G_LOG_LEVEL_WARNING, "failed to compact*");
+	g_assert_false(Mu::Store::compact(dbpath));
+	g_test_assert_expected_messages();
+	g_assert_true(store.compact_in_place(true /*renumber by date*/));
+	g_assert_false(store.replaced());
+	g_assert_cmpuint(store.size(), ==, 3);
+
+	// ids are now dense, and in date order.
+	std::vector<std::string> dates;
+	std::vector<Mu::Store::Id> ids;
+	store.for_each_values({Mu::Field::Id::Date}, [&](auto&& id, auto&& vals) {
+		ids.emplace_back(id);
+		dates.emplace_back(vals.at(0));
+		return true;
+	});
+	g_assert_true(ids == std::vector<Mu::Store::Id>({1, 2, 3}));
+	g_assert_true(std::is_sorted(dates.begin(), dates.end()));
+	g_assert_true(store.contains_message(MuTestMaildir + "/cur/1283599333.1840_11.cthulhu!2,"));
+}
+
 static void
 test_store_add_count_remove_in_memory()
 {
@@ -100,6 +460,26 @@ test_store_add_count_remove_in_memory()
 	g_assert_cmpuint(store.size(), ==, 2);
 	g_assert_true(store.contains_message(MuTestMaildir2 + "/bar/cur/mail3"));
 
+	std::vector<std::string> paths;
+	g_assert_cmpuint(store.for_each_message_path([&](auto&&, auto&& path) {
+		paths.emplace_back(path);
+		return true;
+	}), ==, 2);
+	g_assert_true(paths.at(0) == MuTestMaildir + "/cur/1283599333.1840_11.cthulhu!2,");
+	g_assert_true(paths.at(1) == MuTestMaildir2 + "/bar/cur/mail3");
+
+	size_t n{};
+	g_assert_cmpuint(store.for_each_values({Mu::Field::Id::Path, Mu::Field::Id::Size},
+					       [&](auto&& id, auto&& vals) {
+						       g_assert_cmpuint(vals.size(), ==, 2);
+						       g_assert_true(vals.at(0) == paths.at(n));
+						       g_assert_false(vals.at(1).empty());
+						       if (n++ == 0)
+							       g_assert_cmpuint(id, ==, id1);
+						       return false; // stop after the first
+					       }), ==, 1);
+	g_assert_cmpuint(n, ==, 1);
+
 	store.remove_message(id1);
 	g_assert_cmpuint(store.size(), ==, 1);
 	g_assert_false(
@@ -110,6 +490,217 @@ test_store_add_count_remove_in_memory()
 	g_assert_false(store.contains_message(MuTestMaildir2 + "/bar/cur/mail3"));
 }
 
+static void
+test_store_path_hashes_dirstamps()
+{
+	Mu::Store store{MuTestMaildir, {}, {}};
+
+	const auto path1{MuTestMaildir + "/cur/1283599333.1840_11.cthulhu!2,"};
+	const auto path2{MuTestMaildir + "/cur/1220863042.12663_1.mindcrime!2,S"};
+	g_assert_cmpuint(store.add_message(path1), !=, Mu::Store::InvalidId);
+	g_assert_cmpuint(store.add_message(path2), !=, Mu::Store::InvalidId);
+	store.commit();
+
+	const auto hashes{store.path_hashes()};
+	g_assert_cmpuint(hashes.size(), ==, 2);
+	g_assert_true(std::is_sorted(hashes.begin(), hashes.end()));
+	g_assert_true(std::binary_search(hashes.begin(), hashes.end(),
+					 Mu::Store::path_hash(path1)));
+	g_assert_true(std::binary_search(hashes.begin(), hashes.end(),
+					 Mu::Store::path_hash(path2)));
+	g_assert_false(std::binary_search(hashes.begin(), hashes.end(),
+					  Mu::Store::path_hash(MuTestMaildir + "/cur/foo")));
+
+	store.set_dirstamp(MuTestMaildir + "/cur", 12345);
+	store.set_dirstamp(MuTestMaildir + "/new", 54321);
+	const auto stamps{store.dirstamps()};
+	g_assert_cmpuint(stamps.size(), ==, 2);
+	g_assert_cmpint(stamps.at(MuTestMaildir + "/cur"), ==, 12345);
+	g_assert_cmpint(stamps.at(MuTestMaildir + "/new"), ==, 54321);
+}
+
+static void
+test_store_rename_message()
+{
+	char* tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert(tmpdir);
+	const std::string mdir{tmpdir};
+	g_free(tmpdir);
+
+	const auto old_path{mdir + "/cur/1234.abc:2,"};
+	const auto new_path{mdir + "/cur/1234.abc:2,RS"};
+	copy_test_message(MuTestMaildir2 + "/bar/cur/mail3", old_path);
+
+	Mu::Store store{mdir, {}, {}};
+	const auto id = store.add_message(old_path);
+	g_assert_cmpuint(id, !=, Mu::Store::InvalidId);
+	g_assert_cmpuint(store.count_query("flag:seen"), ==, 0);
+
+	// not renamed (yet)
+	g_assert_false(store.rename_message(id, new_path));
+
+	g_assert_cmpint(::rename(old_path.c_str(), new_path.c_str()), ==, 0);
+	g_assert_true(store.rename_message(id, new_path));
+
+	g_assert_cmpuint(store.size(), ==, 1);
+	g_assert_false(store.contains_message(old_path));
+	g_assert_true(store.contains_message(new_path));
+	g_assert_cmpuint(store.count_query("flag:seen"), ==, 1);
+	g_assert_cmpuint(store.count_query("flag:replied"), ==, 1);
+	g_assert_cmpuint(store.count_query("flag:unread"), ==, 0);
+}
+
+static void
+test_store_thread_paths()
+{
+	// 21 is the parent of 23 and 25; add it last.
+	const auto parent{MuTestMaildir + "/new/1220863087.12663_21.mindcrime"};
+	const auto child1{MuTestMaildir + "/new/1220863087.12663_23.mindcrime"};
+	const auto child2{MuTestMaildir + "/new/1220863087.12663_25.mindcrime"};
+
+	Mu::Store store{MuTestMaildir, {}, {}};
+	const auto thread_paths = [&] {
+		std::unordered_map<std::string, std::string> paths;
+		store.for_each_values({Mu::Field::Id::Path, Mu::Field::Id::ThreadPath},
+				      [&](auto&&, auto&& values) {
+					      paths.emplace(values.at(0), values.at(1));
+					      return true;
+				      });
+		return paths;
+	};
+
+	g_assert_cmpuint(store.add_message(child1), !=, Mu::Store::InvalidId);
+	g_assert_cmpuint(store.add_message(child2), !=, Mu::Store::InvalidId);
+	auto paths{thread_paths()};
+	g_assert_cmpstr(paths.at(child1).c_str(), ==, "0:0");
+	g_assert_cmpstr(paths.at(child2).c_str(), ==, "0:1");
+
+	// the late parent re-roots the thread
+	g_assert_cmpuint(store.add_message(parent), !=, Mu::Store::InvalidId);
+	paths = thread_paths();
+	g_assert_cmpstr(paths.at(parent).c_str(), ==, "0");
+	g_assert_cmpstr(paths.at(child1).c_str(), ==, "0:0");
+	g_assert_cmpstr(paths.at(child2).c_str(), ==, "0:1");
+
+	// threaded queries use those
+	auto qres{store.run_query("", Mu::Field::Id::Date, Mu::QueryFlags::Threading)};
+	g_assert_true(!!qres);
+	g_assert_cmpuint(qres->size(), ==, 3);
+	g_assert_true(qres->begin().path() == parent); // in thread order
+	for (auto&& mi : *qres) {
+		const auto& qmatch{mi.query_match()};
+		if (mi.path() == parent) {
+			g_assert_cmpuint(qmatch.thread_level, ==, 0);
+			g_assert_true(qmatch.has_flag(Mu::QueryMatch::Flags::Root |
+						      Mu::QueryMatch::Flags::HasChild));
+		} else
+			g_assert_cmpuint(qmatch.thread_level, ==, 1);
+	}
+
+	// and when the parent goes away, the children are orphans again.
+	g_assert_true(store.remove_message(parent));
+	paths = thread_paths();
+	g_assert_cmpstr(paths.at(child1).c_str(), ==, "0:0");
+	g_assert_cmpstr(paths.at(child2).c_str(), ==, "0:1");
+}
+
+static void
+test_store_related_bounded()
+{
+	Mu::Store::Config conf{};
+	conf.max_related = 1;
+
+	Mu::Store store{MuTestMaildir, {}, conf};
+	g_assert_cmpuint(store.properties().max_related, ==, 1);
+	for (auto&& num : {"21", "23", "25"})
+		g_assert_cmpuint(store.add_message(MuTestMaildir + "/new/1220863087.12663_" +
+						   num + ".mindcrime"),
+				 !=, Mu::Store::InvalidId);
+
+	// the leader, plus (at most) one related message from its thread
+	auto qres{store.run_query("i:uwsireh25.fsf@one.dot.net",
+				  Mu::Field::Id::Date,
+				  Mu::QueryFlags::IncludeRelated | Mu::QueryFlags::Threading)};
+	g_assert_true(!!qres);
+	g_assert_cmpuint(qres->size(), ==, 2);
+	g_assert_cmpuint(qres->stats().related_examined, >=, 1);
+
+	// ... which is the newest one.
+	size_t related{};
+	for (auto&& mi : *qres)
+		if (mi.query_match().has_flag(Mu::QueryMatch::Flags::Related)) {
+			++related;
+			g_assert_true(g_str_has_suffix(mi.path().value_or("").c_str(),
+						       "_23.mindcrime"));
+		}
+	g_assert_cmpuint(related, ==, 1);
+}
+
+static void
+test_store_readability()
+{
+	char* tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert(tmpdir);
+	const std::string mdir{tmpdir};
+	g_free(tmpdir);
+
+	const auto path1{mdir + "/cur/mail3"};
+	const auto path2{mdir + "/cur/mail4"};
+	copy_test_message(MuTestMaildir2 + "/bar/cur/mail3", path1);
+	copy_test_message(MuTestMaildir2 + "/bar/cur/mail4", path2);
+
+	Mu::Store store{mdir, {}, {}};
+	g_assert_cmpuint(store.add_message(path1), !=, Mu::Store::InvalidId);
+	g_assert_cmpuint(store.add_message(path2), !=, Mu::Store::InvalidId);
+	g_assert_cmpint(::unlink(path2.c_str()), ==, 0);
+
+	const auto count = [&](Mu::QueryFlags qflags) {
+		auto qres{store.run_query("", {}, qflags)};
+		g_assert_true(!!qres);
+		return qres->size();
+	};
+
+	// checking the file-system, either for each candidate, or lazily for
+	// the results.
+	const auto lazy{Mu::QueryFlags::LazyUnreadable};
+	g_assert_cmpuint(count(Mu::QueryFlags::SkipUnreadable), ==, 1);
+	g_assert_cmpuint(count(Mu::QueryFlags::SkipUnreadable | lazy), ==, 1);
+	g_assert_cmpuint(count(lazy), ==, 2);
+	{
+		auto qres{store.run_query("", {}, lazy)};
+		for (auto&& mi : *qres)
+			g_assert_true(mi.query_match().has_flag(Mu::QueryMatch::Flags::Unreadable) ==
+				      (mi.path() == path2));
+	}
+	// unreadables are skipped before threading, so the threads only have
+	// what remains.
+	for (auto&& order : {Mu::QueryFlags::None, Mu::QueryFlags::Descending}) {
+		auto qres{store.run_query("", {}, Mu::QueryFlags::SkipUnreadable | lazy |
+						      Mu::QueryFlags::Threading | order)};
+		g_assert_true(!!qres);
+		g_assert_cmpuint(qres->size(), ==, 1);
+		const auto mi{qres->begin()};
+		g_assert_true(mi.path() == path1);
+		g_assert_cmpuint(mi.query_match().thread_level, ==, 0);
+		g_assert_true(mi.query_match().has_flag(Mu::QueryMatch::Flags::Root));
+	}
+
+	// when tracking, the tracker is trusted, rather than the file-system.
+	auto& readability{store.readability()};
+	readability.start_tracking();
+	readability.mark_gone(path1);
+	g_assert_cmpuint(count(Mu::QueryFlags::SkipUnreadable), ==, 1);
+	readability.mark_present(path1);
+	readability.mark_gone(path2);
+	g_assert_cmpuint(count(Mu::QueryFlags::SkipUnreadable), ==, 1);
+	g_assert_cmpuint(count(Mu::QueryFlags::SkipUnreadable | lazy), ==, 1);
+
+	// but not when it stops.
+	readability.clear();
+	g_assert_false(readability.is_tracking());
+	g_assert_cmpuint(count(Mu::QueryFlags::SkipUnreadable), ==, 1);
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -118,7 +709,18 @@ main(int argc, char* argv[])
 	/* mu_runtime_init/uninit */
 	g_test_add_func("/store/ctor-dtor", test_store_ctor_dtor);
 	g_test_add_func("/store/add-count-remove", test_store_add_count_remove);
+	g_test_add_func("/store/batches", test_store_batches);
+	g_test_add_func("/store/snapshots", test_store_snapshots);
+	g_test_add_func("/store/shards", test_store_shards);
+	g_test_add_func("/store/replace", test_store_replace);
+	g_test_add_func("/store/compact", test_store_compact);
 	g_test_add_func("/store/in-memory/add-count-remove", test_store_add_count_remove_in_memory);
+	g_test_add_func("/store/in-memory/path-hashes-dirstamps",
+			test_store_path_hashes_dirstamps);
+	g_test_add_func("/store/in-memory/rename-message", test_store_rename_message);
+	g_test_add_func("/store/in-memory/thread-paths", test_store_thread_paths);
+	g_test_add_func("/store/in-memory/related-bounded", test_store_related_bounded);
+	g_test_add_func("/store/in-memory/readability", test_store_readability);
 
 	// if (!g_test_verbose())
 	//	g_log_set_handler (NULL,
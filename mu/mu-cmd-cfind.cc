@@ -19,6 +19,8 @@
 #include "config.h"
 
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -273,14 +275,14 @@ struct ECData {
 	size_t         n;
 };
 
-static void
-each_contact(const Mu::Contact& ci, ECData& ecdata)
+static bool
+contact_matches(const Mu::Contact& ci, const ECData& ecdata)
 {
 	if (ecdata.personal && ci.personal)
-		return;
+		return false;
 
-	if (ci.tstamp < ecdata.after)
-		return;
+	if (ci.message_date < ecdata.after)
+		return false;
 
 	if (ecdata.rx &&
 	    !g_regex_match(ecdata.rx, ci.email.c_str(), (GRegexMatchFlags)0, NULL) &&
@@ -288,8 +290,14 @@ each_contact(const Mu::Contact& ci, ECData& ecdata)
 			   ci.name.empty() ? "" : ci.name.c_str(),
 			   (GRegexMatchFlags)0,
 			   NULL))
-		return;
+		return false;
 
+	return true;
+}
+
+static void
+each_contact(const Mu::Contact& ci, ECData& ecdata)
+{
 	++ecdata.n;
 
 	switch (ecdata.format) {
@@ -333,6 +341,7 @@ run_cmd_cfind(const Mu::Store&     store,
 	      const char*          pattern,
 	      gboolean             personal,
 	      time_t               after,
+	      int                  maxnum,
 	      const MuConfigFormat format,
 	      gboolean             color,
 	      GError**             err)
@@ -361,7 +370,22 @@ run_cmd_cfind(const Mu::Store&     store,
 
 	print_header(format);
 
-	store.contacts_cache().for_each([&](const auto& ci) { each_contact(ci, ecdata); });
+	if (maxnum > 0) {
+		std::vector<Contact> contacts;
+		store.contacts_cache().for_each([&](const auto& ci) {
+			if (contact_matches(ci, ecdata))
+				contacts.emplace_back(ci);
+		});
+		// only the most relevant (i.e., last) ones.
+		const auto skip{contacts.size() > static_cast<size_t>(maxnum) ?
+				contacts.size() - maxnum : 0};
+		std::for_each(contacts.begin() + skip, contacts.end(),
+			      [&](const auto& ci) { each_contact(ci, ecdata); });
+	} else
+		store.contacts_cache().for_each([&](const auto& ci) {
+			if (contact_matches(ci, ecdata))
+				each_contact(ci, ecdata);
+		});
 
 	g_hash_table_unref(ecdata.nicks);
 
@@ -417,6 +441,7 @@ Mu::mu_cmd_cfind(const Mu::Store& store, const MuConfig* opts, GError** err)
 				 opts->params[1],
 				 opts->personal,
 				 opts->after,
+				 opts->maxnum,
 				 opts->format,
 				 !opts->nocolor,
 				 err);
@@ -32,6 +32,7 @@
 
 #include "mu-msg.hh"
 #include "index/mu-indexer.hh"
+#include "index/mu-watcher.hh"
 #include "mu-store.hh"
 #include "mu-runtime.hh"
 
@@ -106,6 +107,12 @@ Mu::mu_cmd_index(Mu::Store& store, const MuConfig* opts, GError** err)
 		return MU_ERROR;
 	}
 
+	if (opts->watch && !Watcher::supported()) {
+		mu_util_g_set_error(err, MU_ERROR_IN_PARAMETERS,
+		                    "--watch is not supported on this system");
+		return MU_ERROR;
+	}
+
 	MaybeAnsi col{!opts->nocolor};
 	using Color = MaybeAnsi::Color;
 	if (!opts->quiet) {
@@ -121,6 +128,8 @@ Mu::mu_cmd_index(Mu::Store& store, const MuConfig* opts, GError** err)
 	Mu::Indexer::Config conf{};
 	conf.cleanup    = !opts->nocleanup;
 	conf.lazy_check = opts->lazycheck;
+	conf.parallel_scan = opts->parallelscan;
+	conf.watch         = opts->watch;
 	// ignore .noupdate with an empty store.
 	conf.ignore_noupdate = store.empty();
 
@@ -143,9 +152,71 @@ Mu::mu_cmd_index(Mu::Store& store, const MuConfig* opts, GError** err)
 	store.indexer().stop();
 
 	if (!opts->quiet) {
-		print_stats(store.indexer().progress(), !opts->nocolor);
+		const auto& progress{store.indexer().progress()};
+		print_stats(progress, !opts->nocolor);
 		std::cout << std::endl;
+		if (opts->verbose && progress.parsed > 0)
+			std::cout << "parse: " << progress.parsed << " message(s) at "
+				  << static_cast<size_t>(progress.parse_rate()) << "/s per thread; "
+				  << "write: " << progress.updated << " message(s) at "
+				  << static_cast<size_t>(progress.write_rate()) << "/s; "
+				  << "read: " << static_cast<size_t>(progress.bytes_per_message())
+				  << " byte(s)/message" << std::endl;
+	}
+
+	// compact the store after removing at least a tenth of its messages.
+	const auto removed{store.indexer().progress().removed};
+	if (opts->autocompact && !caught_signal && removed > 0 &&
+	    removed * 10 >= store.size() + removed) {
+		if (!opts->quiet)
+			std::cout << "compacting store after removing " << removed
+				  << " message(s)" << std::endl;
+		if (!store.compact_in_place())
+			g_warning("failed to compact store");
+	}
+
+	return MU_OK;
+}
+
+MuError
+Mu::mu_cmd_index_rebuild(const MuConfig* opts, GError** err)
+{
+	g_return_val_if_fail(opts, MU_ERROR);
+	g_return_val_if_fail(opts->cmd == MU_CONFIG_CMD_INDEX, MU_ERROR);
+
+	if (opts->watch) {
+		mu_util_g_set_error(err, MU_ERROR_IN_PARAMETERS,
+		                    "--watch cannot be combined with --rebuild");
+		return MU_ERROR;
 	}
 
+	// build the new store next to the existing one, which stays usable
+	// (read-only) until we swap them; the swap fails if some process, such
+	// as mu server, has it open for writing.
+	const std::string path{mu_runtime_path(MU_RUNTIME_PATH_XAPIANDB)};
+	const auto        new_path{path + ".rebuild"};
+	{
+		auto store{Store::make_like(path, new_path)};
+		if (const auto res = mu_cmd_index(*store, opts, err); res != MU_OK)
+			return res;
+	}
+
+	if (caught_signal) {
+		mu_util_g_set_error(err, MU_ERROR,
+		                    "rebuild interrupted; keeping the existing store");
+		return MU_ERROR;
+	}
+
+	if (!Store::replace(path, new_path)) {
+		mu_util_g_set_error(err, MU_ERROR_FILE,
+		                    "failed to replace store @ %s (is it in use?); "
+		                    "the rebuilt store is @ %s",
+		                    path.c_str(), new_path.c_str());
+		return MU_ERROR;
+	}
+
+	if (!opts->quiet)
+		std::cout << "replaced store @ " << path << " with the rebuilt one" << std::endl;
+
 	return MU_OK;
 }
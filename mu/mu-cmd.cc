@@ -507,6 +507,13 @@ cmd_info(const Mu::Store& store, const MuConfig* opts, GError** err)
 	key_val(col, "schema-version", store.properties().schema_version);
 	key_val(col, "max-message-size", store.properties().max_message_size);
 	key_val(col, "batch-size", store.properties().batch_size);
+	key_val(col, "batch-memory", format("%zu MiB", store.properties().batch_memory /
+					    (1024 * 1024)));
+	key_val(col, "batch-seconds", store.properties().batch_seconds);
+	key_val(col, "background-commit",
+		store.properties().background_commit ? "yes" : "no");
+	key_val(col, "shards", store.properties().shards);
+	key_val(col, "max-related", store.properties().max_related);
 	key_val(col, "messages in store", store.size());
 
 	const auto created{store.properties().created};
@@ -550,11 +557,31 @@ cmd_init(const MuConfig* opts, GError** err)
 	} else if (opts->batch_size < 0) {
 		mu_util_g_set_error(err, MU_ERROR_IN_PARAMETERS, "invalid value for batch-size");
 		return MU_ERROR_IN_PARAMETERS;
+	} else if (opts->batch_memory < 0) {
+		mu_util_g_set_error(err, MU_ERROR_IN_PARAMETERS,
+				    "invalid value for batch-memory");
+		return MU_ERROR_IN_PARAMETERS;
+	} else if (opts->batch_seconds < 0) {
+		mu_util_g_set_error(err, MU_ERROR_IN_PARAMETERS,
+				    "invalid value for batch-seconds");
+		return MU_ERROR_IN_PARAMETERS;
+	} else if (opts->shards < 0) {
+		mu_util_g_set_error(err, MU_ERROR_IN_PARAMETERS, "invalid value for shards");
+		return MU_ERROR_IN_PARAMETERS;
+	} else if (opts->max_related < 0) {
+		mu_util_g_set_error(err, MU_ERROR_IN_PARAMETERS,
+				    "invalid value for max-related");
+		return MU_ERROR_IN_PARAMETERS;
 	}
 
 	Mu::Store::Config conf{};
-	conf.max_message_size = opts->max_msg_size;
-	conf.batch_size       = opts->batch_size;
+	conf.max_message_size  = opts->max_msg_size;
+	conf.batch_size        = opts->batch_size;
+	conf.batch_memory      = static_cast<size_t>(opts->batch_memory) * 1024 * 1024;
+	conf.batch_seconds     = opts->batch_seconds;
+	conf.background_commit = opts->background_commit;
+	conf.shards            = opts->shards;
+	conf.max_related       = opts->max_related;
 
 	Mu::StringVec my_addrs;
 	auto          addrs = opts->my_addresses;
@@ -572,6 +599,28 @@ cmd_init(const MuConfig* opts, GError** err)
 	return MU_OK;
 }
 
+static MuError
+cmd_compact(const MuConfig* opts, GError** err)
+{
+	if (opts->params[1]) {
+		mu_util_g_set_error(err, MU_ERROR_IN_PARAMETERS, "unexpected parameter");
+		return MU_ERROR_IN_PARAMETERS;
+	}
+
+	const std::string path{mu_runtime_path(MU_RUNTIME_PATH_XAPIANDB)};
+	if (!opts->quiet)
+		std::cout << "compacting store @ " << path
+			  << (opts->bydate ? " (renumbering by date)" : "") << std::endl;
+
+	if (!Mu::Store::compact(path, opts->bydate)) {
+		mu_util_g_set_error(err, MU_ERROR_XAPIAN, "failed to compact store @ %s",
+				    path.c_str());
+		return MU_ERROR_XAPIAN;
+	}
+
+	return MU_OK;
+}
+
 static MuError
 cmd_find(const MuConfig* opts, GError** err)
 {
@@ -585,7 +634,7 @@ show_usage(void)
 {
 	g_print("usage: mu command [options] [parameters]\n");
 	g_print("where command is one of index, find, cfind, view, mkdir, "
-		"extract, add, remove, script, verify or server\n");
+		"extract, add, remove, compact, script, verify or server\n");
 	g_print("see the mu, mu-<command> or mu-easy manpages for "
 		"more information\n");
 }
@@ -656,11 +705,15 @@ try {
 
 	case MU_CONFIG_CMD_ADD: merr = with_writable_store(cmd_add, opts, err); break;
 	case MU_CONFIG_CMD_REMOVE: merr = with_writable_store(cmd_remove, opts, err); break;
-	case MU_CONFIG_CMD_INDEX: merr = with_writable_store(mu_cmd_index, opts, err); break;
+	case MU_CONFIG_CMD_INDEX:
+		merr = opts->rebuild ? mu_cmd_index_rebuild(opts, err)
+				     : with_writable_store(mu_cmd_index, opts, err);
+		break;
 
 	/* commands instantiate store themselves */
 	case MU_CONFIG_CMD_INIT: merr = cmd_init(opts, err); break;
 	case MU_CONFIG_CMD_SERVER: merr = mu_cmd_server(opts, err); break;
+	case MU_CONFIG_CMD_COMPACT: merr = cmd_compact(opts, err); break;
 
 	default: merr = MU_ERROR_IN_PARAMETERS; break;
 	}
@@ -94,6 +94,18 @@ MuError mu_cmd_execute(const MuConfig* opts, GError** err);
  */
 MuError mu_cmd_index(Mu::Store& store, const MuConfig* opt, GError** err);
 
+/**
+ * execute the 'index --rebuild' command; this builds a new store next to
+ * the existing one, and replaces the latter when done.
+ *
+ * @param opts configuration options
+ * @param err receives error information, or NULL
+ *
+ * @return MU_OK (0) if the command succeeded,
+ * some error code otherwise
+ */
+MuError mu_cmd_index_rebuild(const MuConfig* opts, GError** err);
+
 /**
  * execute the server command
  * @param opts configuration options
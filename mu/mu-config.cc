@@ -141,6 +141,16 @@ config_options_group_init()
              "Maximum allowed size for messages", "<size-in-bytes>"},
             {"batch-size", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.batch_size,
              "Number of changes in a database transaction batch", "<number>"},
+            {"batch-memory", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.batch_memory,
+             "Maximum memory for a database transaction batch", "<size-in-MiB>"},
+            {"batch-seconds", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.batch_seconds,
+             "Maximum time for a database transaction batch", "<seconds>"},
+            {"background-commit", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.background_commit,
+             "Commit database transactions in the background", NULL},
+            {"shards", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.shards,
+             "Number of shards to spread the messages over", "<number>"},
+            {"max-related", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.max_related,
+             "Maximum number of related messages per thread", "<number>"},
             {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
 
 	og = g_option_group_new("init", "Options for the 'init' command", "", NULL, NULL);
@@ -183,6 +193,14 @@ config_options_group_index()
              "only check dir-timestamps (false)", NULL},
             {"nocleanup", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.nocleanup,
              "don't clean up the database after indexing (false)", NULL},
+            {"parallel-scan", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.parallelscan,
+             "scan the maildir with multiple threads (false)", NULL},
+            {"watch", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.watch,
+             "keep watching the maildir for changes after indexing (false)", NULL},
+            {"rebuild", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.rebuild,
+             "rebuild the store from scratch, next to the existing one (false)", NULL},
+            {"auto-compact", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.autocompact,
+             "compact the store after cleaning up many messages (false)", NULL},
             {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
 
 	og = g_option_group_new("index", "Options for the 'index' command", "", NULL,
@@ -296,6 +314,8 @@ config_options_group_cfind()
              "whether to only get 'personal' contacts", NULL},
             {"after", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.after,
              "only get addresses last seen after T", "<timestamp>"},
+            {"maxnum", 'n', 0, G_OPTION_ARG_INT, &MU_CONFIG.maxnum,
+             "only get the N most relevant addresses", "<number>"},
             {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
 
 	og = g_option_group_new("cfind", "Options for the 'cfind' command", "", NULL,
@@ -413,6 +433,22 @@ config_options_group_verify()
 	return og;
 }
 
+static GOptionGroup*
+config_options_group_compact()
+{
+	GOptionGroup* og;
+	GOptionEntry  entries[] = {
+            {"by-date", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.bydate,
+             "renumber the messages in ascending date order (false)", NULL},
+            {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
+
+	og = g_option_group_new("compact", "Options for the 'compact' command", "", NULL,
+	                        NULL);
+	g_option_group_add_entries(og, entries);
+
+	return og;
+}
+
 static GOptionGroup*
 config_options_group_server()
 {
@@ -440,6 +476,7 @@ cmd_from_string(const char* str)
 		MuConfigCmd  cmd;
 	} cmd_map[] = {
 	    {"add", MU_CONFIG_CMD_ADD},         {"cfind", MU_CONFIG_CMD_CFIND},
+	    {"compact", MU_CONFIG_CMD_COMPACT},
 	    {"extract", MU_CONFIG_CMD_EXTRACT}, {"find", MU_CONFIG_CMD_FIND},
 	    {"help", MU_CONFIG_CMD_HELP},       {"index", MU_CONFIG_CMD_INDEX},
 	    {"info", MU_CONFIG_CMD_INFO},       {"init", MU_CONFIG_CMD_INIT},
@@ -503,6 +540,7 @@ get_option_group(MuConfigCmd cmd)
 {
 	switch (cmd) {
 	case MU_CONFIG_CMD_CFIND: return config_options_group_cfind();
+	case MU_CONFIG_CMD_COMPACT: return config_options_group_compact();
 	case MU_CONFIG_CMD_EXTRACT: return config_options_group_extract();
 	case MU_CONFIG_CMD_FIND: return config_options_group_find();
 	case MU_CONFIG_CMD_INDEX: return config_options_group_index();
@@ -64,6 +64,7 @@ typedef enum {
 
 	MU_CONFIG_CMD_ADD,
 	MU_CONFIG_CMD_CFIND,
+	MU_CONFIG_CMD_COMPACT,
 	MU_CONFIG_CMD_EXTRACT,
 	MU_CONFIG_CMD_FIND,
 	MU_CONFIG_CMD_HELP,
@@ -107,12 +108,24 @@ struct _MuConfig {
 			      * can be use multiple times */
 	int max_msg_size;    /* maximum size for message files */
 	int batch_size;      /* database transaction batch size */
+	int batch_memory;    /* max memory for a transaction batch (MiB) */
+	int batch_seconds;   /* max time for a transaction batch */
+	gboolean background_commit; /* commit in a background thread */
+	int shards;          /* number of shards for the store */
+	int max_related;     /* max related messages per thread */
 
 	/* options for indexing */
 
 	gboolean nocleanup; /* don't cleanup del'd mails from db */
 	gboolean lazycheck; /* don't check dirs with up-to-date
 			     * timestamps */
+	gboolean parallelscan; /* scan the maildir with multiple threads */
+	gboolean watch;     /* keep watching for changes after indexing */
+	gboolean rebuild;   /* rebuild the store next to the existing one */
+	gboolean autocompact; /* compact the store after large cleanups */
+
+	/* options for compact */
+	gboolean bydate;    /* renumber messages in date order */
 
 	/* options for querying 'find' (and view-> 'summary') */
 	gchar*   fields;    /* fields to show in output */
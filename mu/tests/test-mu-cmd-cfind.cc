@@ -94,6 +94,52 @@ test_mu_cfind_plain(void)
 	g_free(erroutput);
 }
 
+static void
+test_mu_cfind_maxnum(void)
+{
+	gchar *cmdline, *output, *erroutput;
+
+	cmdline = g_strdup_printf("%s cfind --muhome=%s --format=plain "
+	                          "--maxnum=1 helm",
+	                          MU_PROGRAM,
+	                          CONTACTS_CACHE);
+	if (g_test_verbose())
+		g_print("%s\n", cmdline);
+
+	output = erroutput = NULL;
+	g_assert(g_spawn_command_line_sync(cmdline, &output, &erroutput, NULL, NULL));
+	g_assert(output);
+	g_assert_cmpstr(output, ==, "Helmut Kröger hk@testmu.xxx\n");
+
+	g_free(cmdline);
+	g_free(output);
+	g_free(erroutput);
+}
+
+static void
+test_mu_cfind_maxnum_mid_word(void)
+{
+	gchar *cmdline, *output, *erroutput;
+
+	/* with --maxnum, the pattern still matches anywhere, not only at the
+	 * start of some word */
+	cmdline = g_strdup_printf("%s cfind --muhome=%s --format=plain "
+	                          "--maxnum=5 elmut",
+	                          MU_PROGRAM,
+	                          CONTACTS_CACHE);
+	if (g_test_verbose())
+		g_print("%s\n", cmdline);
+
+	output = erroutput = NULL;
+	g_assert(g_spawn_command_line_sync(cmdline, &output, &erroutput, NULL, NULL));
+	g_assert(output);
+	g_assert_cmpstr(output, ==, "Helmut Kröger hk@testmu.xxx\n");
+
+	g_free(cmdline);
+	g_free(output);
+	g_free(erroutput);
+}
+
 static void
 test_mu_cfind_bbdb(void)
 {
@@ -336,6 +382,9 @@ main(int argc, char* argv[])
 	CONTACTS_CACHE = fill_contacts_cache();
 
 	g_test_add_func("/mu-cmd-cfind/test-mu-cfind-plain", test_mu_cfind_plain);
+	g_test_add_func("/mu-cmd-cfind/test-mu-cfind-maxnum", test_mu_cfind_maxnum);
+	g_test_add_func("/mu-cmd-cfind/test-mu-cfind-maxnum-mid-word",
+			test_mu_cfind_maxnum_mid_word);
 	g_test_add_func("/mu-cmd-cfind/test-mu-cfind-bbdb", test_mu_cfind_bbdb);
 	g_test_add_func("/mu-cmd-cfind/test-mu-cfind-wl", test_mu_cfind_wl);
 	g_test_add_func("/mu-cmd-cfind/test-mu-cfind-mutt-alias", test_mu_cfind_mutt_alias);
@@ -228,11 +228,17 @@ Message-ID."
    ((eq action t)
     (all-completions str mu4e--contacts-hash pred))
    ((eq action 'metadata)
-    ;; our contacts are already sorted - just need to tell the
-    ;; completion machinery not to try to undo that...
+    ;; sort the candidates by their rank, most relevant first.
     '(metadata
-      (display-sort-function . identity)
-      (cycle-sort-function   . identity)))))
+      (display-sort-function . mu4e~compose-sort-contacts)
+      (cycle-sort-function   . mu4e~compose-sort-contacts)))))
+
+(defun mu4e~compose-sort-contacts (contacts)
+  "Sort CONTACTS by their rank, most relevant first."
+  (sort contacts
+        (lambda (c1 c2)
+          (> (gethash c1 mu4e--contacts-hash 0)
+             (gethash c2 mu4e--contacts-hash 0)))))
 
 (defun mu4e~compose-complete-contact (&optional start)
   "Complete the text at START with a contact.
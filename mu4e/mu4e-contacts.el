@@ -111,10 +111,15 @@ predicate function. A value of nil keeps all the addresses."
   "Timestamp for the most recent contacts update." )
 
 (defvar mu4e--contacts-hash nil
-  "Hash that maps contacts (ie. 'name <e-mail>') to an integer for sorting.
-We need to keep this information around to quickly re-sort
-subsets of the contacts in the completions function in
-mu4e-compose.")
+  "Hash that maps contacts (ie. 'name <e-mail>') to their rank.
+A higher rank means a more relevant contact. We need to keep this
+information around to quickly re-sort subsets of the contacts in
+the completions function in mu4e-compose.")
+
+(defvar mu4e--contacts-addresses nil
+  "Hash that maps the (lowercase) e-mail address of each contact to
+its key in `mu4e--contacts-hash'. When a contact changes (e.g.,
+gets a new name), we use this to remove its old entry.")
 
 ;;; user mail address
 (defun mu4e-personal-addresses(&optional no-regexp)
@@ -156,32 +161,42 @@ addresses and /regular expressions/."
 			"1.3.8")
 
 
-(defun mu4e--update-contacts (contacts &optional tstamp)
-  "Receive a sorted list of CONTACTS newer than TSTAMP.
-Each of the contacts has the form
-  (FULL_EMAIL_ADDRESS . RANK) and fill `mu4e--contacts-hash' with
-it, with each contact mapped to an integer for their ranking.
+(defun mu4e--update-contacts (contacts &optional tstamp full)
+  "Receive a list of CONTACTS changed since TSTAMP.
+Each of the contacts has the form (:address ADDRESS :email EMAIL
+:rank RANK); fill `mu4e--contacts-hash' with them, mapping each
+address to its rank. If FULL is non-nil, CONTACTS are all the
+contacts, and replace whatever we had before.
 
 This is used by the completion function in mu4e-compose."
-  ;; We have our nicely sorted list, map them to a list
-  ;; of increasing integers. We use that map in the composer
-  ;; to sort them there. It would have been so much easier if emacs
-  ;; allowed us to use the sorted-list as-is, but no such luck.
   (let ((n 0))
-    (unless mu4e--contacts-hash
+    (when (or full (not mu4e--contacts-hash) (not mu4e--contacts-addresses))
       (setq mu4e--contacts-hash (make-hash-table :test 'equal :weakness nil
-                                           :size (length contacts))))
+                                           :size (length contacts))
+            mu4e--contacts-addresses (make-hash-table :test 'equal :weakness nil
+                                                :size (length contacts))))
     (dolist (contact contacts)
       (cl-incf n)
-      (let* ((address (plist-get contact :address))
+      ;; note the explicit decode; the strings we get are utf-8, but
+      ;; emacs doesn't know yet.
+      (let* ((email (downcase (decode-coding-string
+                               (or (plist-get contact :email)
+                                   (plist-get contact :address))
+                               'utf-8)))
+             (address (plist-get contact :address))
              (address
               (if (functionp mu4e-contact-process-function)
                   (funcall mu4e-contact-process-function address)
-                address)))
-        (when address ;; note the explicit deccode; the strings we get are
-		      ;; utf-8, but emacs doesn't know yet.
-          (puthash (decode-coding-string address 'utf-8)
-                   (plist-get contact :rank) mu4e--contacts-hash))))
+                address))
+             (address (and address (decode-coding-string address 'utf-8)))
+             (old-address (gethash email mu4e--contacts-addresses)))
+        ;; a changed contact (e.g., with a new name) replaces its old entry.
+        (when (and old-address (not (equal old-address address)))
+          (remhash old-address mu4e--contacts-hash)
+          (remhash email mu4e--contacts-addresses))
+        (when address
+          (puthash email address mu4e--contacts-addresses)
+          (puthash address (plist-get contact :rank) mu4e--contacts-hash))))
 
     (setq mu4e--contacts-tstamp (or tstamp "0"))
 
@@ -209,8 +224,9 @@ For testing/debugging."
         (maphash (lambda (addr rank)
                    (setq contacts (cons (cons rank addr) contacts)))
                  mu4e--contacts-hash)
+        ;; most relevant first
         (setq contacts (sort contacts
-                             (lambda(cell1 cell2) (< (car cell1) (car cell2)))))
+                             (lambda(cell1 cell2) (> (car cell1) (car cell2)))))
         (dolist (contact contacts)
           (insert (format "%s\n" (cdr contact))))))
 
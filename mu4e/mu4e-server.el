@@ -141,7 +141,9 @@ from the server process.")
 
 (defvar mu4e-contacts-func nil
   "A function called for each (:contacts (<list-of-contacts>)
-sexp received from the server process.")
+sexp received from the server process. It receives the contacts,
+the :tstamp and the :full flag; when the latter is non-nil, the
+contacts replace (rather than update) any earlier ones.")
 
 (make-obsolete-variable 'mu4e-temp-func "No longer used" "1.7.0")
 
@@ -303,7 +305,8 @@ The server output is as follows:
          ((plist-member sexp :contacts)
           (funcall mu4e-contacts-func
                    (plist-get sexp :contacts)
-                   (plist-get sexp :tstamp)))
+                   (plist-get sexp :tstamp)
+                   (plist-get sexp :full)))
 
          ;; something got moved/flags changed
          ((plist-get sexp :update)
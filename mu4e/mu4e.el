@@ -252,6 +252,7 @@ chance."
   (setq
    mu4e-maildir-list nil
    mu4e--contacts-hash nil
+   mu4e--contacts-addresses nil
    mu4e--contacts-tstamp "0"))
 ;;; _
 (provide 'mu4e)